@@ -54,27 +54,41 @@ from threading import Event
 from threading import Thread
 from datetime import datetime
 import tempfile
+import struct
 
 
 heartbeat_flag = Event()
 
+# commands sent to the page server on its stdin - must match CMD_* in eeg_page_server3.c
+CMD_SEEK = 1
+CMD_PAGE_SPECS = 2
+CMD_HEARTBEAT = 3
+CMD_QUIT = 4
+
+# layout of the page server's ring buffer header (page_ring file) - must match RING_HEADER in eeg_page_server3.c
+RING_MAGIC = 0x52474545
+RING_VERSION = 3
+RING_HEADER_DTYPE = np.dtype([('magic', '<u4'), ('version', '<u4'), ('layout_id', '<u4'),
+                              ('num_chans', '<i4'), ('samps_per_page', '<i4'), ('n_slots', '<i4'),
+                              ('generation', '<u8'), ('first_sec', '<f8'), ('last_sec', '<f8'),
+                              ('secs_per_page', '<f8'), ('origin_sec', '<f8'), ('fud', '<f8'),
+                              ('heartbeat', '<i8'), ('samp_values', '<i4')])
+
 
 class HeartbeatThread(Thread):
-    def __init__(self, event, path):
+    def __init__(self, event, window):
         Thread.__init__(self)
         self.stopped = event
-        self.path_dir = path
+        self.window = window
 
     def run(self):
         cycle = True
-        # wait 1 second between writes.
+        # wait 1 second between heartbeats.
         # but only wait .5 seconds for signal to terminate thread, to make thread more responsive
         while not self.stopped.wait(.5):
             cycle = not cycle
             if cycle:
-                with open(self.path_dir+ "heartbeat_ui", 'w') as the_file:
-                    the_file.write(str(time.time()))
-                    the_file.close()
+                self.window.send_command(CMD_HEARTBEAT)
             
 # Create these subclasses so keyboard inputs are properly handled
 class MyComboBox(QComboBox):
@@ -233,6 +247,28 @@ class MainWindow(QMainWindow):
         self.hide_annotations.stateChanged.connect(self.onClicked_checkbox_redraw)
         layout_lower_checkboxes.addWidget(self.hide_annotations)
         
+        self.envelope_mode = MyCheckBox(self) #Envelope mode
+        self.envelope_mode.setText("Envelope mode")
+        self.envelope_mode.setChecked(False)
+        self.envelope_mode.stateChanged.connect(self.onClicked_resend_and_redraw)
+        layout_lower_checkboxes.addWidget(self.envelope_mode)
+        
+        self.bandpass = MyCheckBox(self) #1-70 Hz bandpass, done by the page server
+        self.bandpass.setText("1-70 Hz filter")
+        self.bandpass.setChecked(False)
+        self.bandpass.stateChanged.connect(self.onClicked_resend_and_redraw)
+        layout_lower_checkboxes.addWidget(self.bandpass)
+        
+        self.notch_combo = MyComboBox(self)
+        self.notch_combo.addItems(["No notch", "50 Hz notch", "60 Hz notch"])
+        self.notch_combo.activated.connect(self.onClicked_resend_and_redraw)
+        layout_lower_checkboxes.addWidget(self.notch_combo)
+        
+        self.montage_combo = MyComboBox(self) #re-referencing, done by the page server
+        self.montage_combo.addItems(["Referential", "Average reference"])
+        self.montage_combo.activated.connect(self.onClicked_resend_and_redraw)
+        layout_lower_checkboxes.addWidget(self.montage_combo)
+        
         
         layout_lower.addLayout(layout_lower_checkboxes)
         
@@ -249,7 +285,7 @@ class MainWindow(QMainWindow):
         #self.secpage_box.clearFocus()
         
         self.secpage_combo = MyComboBox(self)
-        self.secpage_combo.addItems(["5", "10", "15", "30", "45", "60"])
+        self.secpage_combo.addItems(["5", "10", "15", "30", "45", "60", "120", "300", "600", "1800", "3600"])
         combo_index = self.secpage_combo.findText("30")
         self.secpage_combo.setCurrentIndex(combo_index);
         self.secpage_combo.activated.connect(self.onClicked_resend_and_redraw)
@@ -311,6 +347,12 @@ class MainWindow(QMainWindow):
         self.session_start_time = None
         self.session_end_time = None
         self.server_temp_path = None
+        self.page_specs_fud = None
+        
+        # memory-mapped page ring shared with the server
+        self.ring_header = None
+        self.ring_data = None
+        self.ring_layout_id = None
         
         #form of event data:
         #self.events = [{'start':1498485704.619469, 'text':'Eyes Open'}, {'start':1498485727.166344, 'text':'Eyes Closed'}]
@@ -320,6 +362,13 @@ class MainWindow(QMainWindow):
         self.password = None
         heartbeat_flag = Event()
         self.heartbeat_thread = None
+        self.server_process = None
+        self.server_lock = threading.Lock()
+        
+        # while the server is still opening channels, the page is redrawn as more of them come in
+        self.server_info_complete = True
+        self.loading_timer = QtCore.QTimer(self)
+        self.loading_timer.timeout.connect(self.refresh_loading)
 
 
     def calibrate_monitor(self):
@@ -494,6 +543,9 @@ class MainWindow(QMainWindow):
             # privacy converns here, uuid1 might be better.
             self.server_temp_path = tempfile.gettempdir() + "/" + "eeg_view_" + str(uuid.uuid1()) + "/"
             os.mkdir(self.server_temp_path)
+            self.ring_header = None
+            self.ring_data = None
+            self.ring_layout_id = None
             print ("Temp directory created:", self.server_temp_path)
         
         
@@ -506,27 +558,30 @@ class MainWindow(QMainWindow):
                 time.sleep(.6)  # thread should wait no longer than .5 seconds to check event
                 heartbeat_flag = Event()
                 
-            # start new heartbeat thread, to write heartbeat file every second.
-            self.heartbeat_thread = HeartbeatThread(heartbeat_flag, self.server_temp_path)
-            self.heartbeat_thread.start()
+            # tell old server to quit, if it exists
+            self.stop_server()
         
-            # open server process in a non-blocking manner
+            # open server process in a non-blocking manner.  Commands are sent to it through its stdin.
             if os.name == 'nt':
-                if self.password is None:
-                    subprocess.Popen([self.page_server_dir + "/" + "eeg_page_server.exe", self.server_temp_path])
-                else:
-                    subprocess.Popen([self.page_server_dir + "/" + "eeg_page_server.exe", self.server_temp_path, self.password])
+                server_args = [self.page_server_dir + "/" + "eeg_page_server.exe", self.server_temp_path]
             else:
-                if self.password is None:
-                    subprocess.Popen([self.page_server_dir + "/" + "eeg_page_server", self.server_temp_path])
-                else:
-                    subprocess.Popen([self.page_server_dir + "/" + "eeg_page_server", self.server_temp_path, self.password])
+                server_args = [self.page_server_dir + "/" + "eeg_page_server", self.server_temp_path]
+            if self.password is not None:
+                server_args.append(self.password)
+            self.server_process = subprocess.Popen(server_args, stdin=subprocess.PIPE)
+        
+            # start new heartbeat thread, to send a heartbeat every second.
+            self.heartbeat_thread = HeartbeatThread(heartbeat_flag, self)
+            self.heartbeat_thread.start()
         
-            # write initial time and page specs, so server can read them
+            # write initial time and page specs, so server can read them.  The time is 0 ("not known") for a new
+            # session, so the server starts at the session's start rather than at the last session's time.
+            self.curr_sec = 0
             self.write_curr_sec()
             self.write_page_specs()
         
             # read info from server, including start/stop times of channels and re-ordering of channels
+            self.loading_timer.stop()
             password_needed = self.read_server_info()
             if password_needed:
                 self.password = self.prompt_for_password()
@@ -534,13 +589,9 @@ class MainWindow(QMainWindow):
                     return  # case where user gives up, clicks 'Cancel'.  Just return from this function.
                 
                 continue
+            # start where the server is reading its first page
+            self.curr_sec = int(self.first_page_sec)
             self.write_curr_sec()
-    
-            # create channel labels based on path names
-            self.channel_labels = []
-            for channel in self.channels:
-                new_label = channel["name"].split('/')
-                self.channel_labels.append(new_label[len(new_label) - 1].split('.')[0])
         
             # read initial page
             self.read_page()
@@ -576,6 +627,19 @@ class MainWindow(QMainWindow):
         # display initial page
         self.plot_eeg()
         
+        # channels that are still opening show up as they are ready
+        if not self.server_info_complete:
+            self.loading_timer.start(250)
+            
+    def refresh_loading(self):
+        if self.read_server_info():
+            self.loading_timer.stop()
+            return
+        if self.server_info_complete:
+            self.loading_timer.stop()
+        self.read_page()
+        self.plot_eeg()
+        
     def prompt_for_password(self):
         print("Prompting for password")
         text, ok = QInputDialog.getText(self, 'Password validation', 'Enter password for files:', QLineEdit.Password)
@@ -610,8 +674,9 @@ class MainWindow(QMainWindow):
         
     def onClicked_resend_and_redraw(self):
         self.secs_per_page = int(self.secpage_combo.currentText())
+        if self.server_temp_path is None:
+            return  # no session loaded yet
         self.write_page_specs()
-        self.reset_buffer_limits()
         self.read_page()
         self.plot_eeg()
     
@@ -621,29 +686,83 @@ class MainWindow(QMainWindow):
         return file
     
 
+    def send_command(self, command, payload=b''):
+        # called from the UI and heartbeat threads, so keep messages from interleaving
+        with self.server_lock:
+            if self.server_process is None:
+                return
+            try:
+                self.server_process.stdin.write(struct.pack('<II', command, len(payload)) + payload)
+                self.server_process.stdin.flush()
+            except (OSError, ValueError):
+                pass  # server has exited
+                
+                
+    def stop_server(self):
+        if self.server_process is None:
+            return
+        self.send_command(CMD_QUIT)
+        with self.server_lock:
+            try:
+                self.server_process.stdin.close()
+            except OSError:
+                pass
+            self.server_process = None
+    
+
     def write_page_specs(self):
         if self.server_temp_path is None:
             return
 
-        with open(self.server_temp_path + "page_specs", 'w') as the_file:
-            the_file.write(str(random.random()) + '\n')
-            the_file.write(self.data_dir  + '\n')
-            the_file.write(str(self.n_displayed)  + '\n')
+        # the server echoes this number in the ring header once it is serving these specs
+        self.page_specs_fud = random.random()
+
+        specs = str(self.page_specs_fud) + '\n'
+        specs += self.data_dir  + '\n'
+        specs += str(self.n_displayed)  + '\n'
             
-            # write absolute path for each channel
-            for paths in self.channel_paths:
-                the_file.write(paths  + '\n')
+        # write absolute path for each channel
+        for paths in self.channel_paths:
+            specs += paths  + '\n'
             
-            the_file.write(str(self.axpix) + '\n')
-            the_file.write(str(self.secs_per_page) + '\n')
-            the_file.write("blank" + '\n')  # default password
-            the_file.write("blank" + '\n')  # default events file
-            the_file.close()
+        specs += str(self.axpix) + '\n'
+        specs += str(self.secs_per_page) + '\n'
+        specs += "blank" + '\n'  # default password
+        specs += "blank" + '\n'  # default events file
+        
+        # optional settings
+        if self.envelope_mode.isChecked():
+            specs += "display_mode envelope" + '\n'
+        else:
+            specs += "display_mode line" + '\n'
+        # min/max pyramids for zoomed-out envelope pages are cached here, and reused across sessions
+        specs += "cache_dir " + self.pyramid_cache_dir() + '\n'
+        # display filters, in Hz
+        if self.bandpass.isChecked():
+            specs += "highpass 1" + '\n'
+            specs += "lowpass 70" + '\n'
+        if self.notch_combo.currentIndex() > 0:
+            specs += "notch " + self.notch_combo.currentText().split()[0] + '\n'
+        # montage: each channel minus the average of all of them (channels are numbered in the order listed above)
+        if self.montage_combo.currentIndex() == 1:
+            specs += "average " + " ".join("c" + str(i) for i in range(self.n_displayed)) + '\n'
+            for i in range(self.n_displayed):
+                specs += "trace c" + str(i) + " 1 a0 -1" + '\n'
+        
+        self.send_command(CMD_PAGE_SPECS, specs.encode('utf-8'))
             
           
+    def pyramid_cache_dir(self):
+        cache_dir = tempfile.gettempdir() + "/" + "eeg_view_cache"
+        if not os.path.isdir(cache_dir):
+            os.makedirs(cache_dir, exist_ok=True)
+        return cache_dir
+
     # return value:  whether or not a password is needed to properly read files
     # True: password is needed, False: password is not needed.
     def read_server_info(self):
+        # The server lists each channel as soon as it is open (and its page at first_page_sec is in the ring), and adds
+        # a closing line with the number of channels once they all are.
         while True:
     
             while True:
@@ -659,29 +778,39 @@ class MainWindow(QMainWindow):
             lines = si_file.readlines()
             si_file.close()
             
-            if (len(lines) < (self.n_displayed + 2)):
+            if (len(lines) < 2):
+                time.sleep(0.1)
                 continue
                 
             break
             
-        self.channels = []
+        self.server_info_complete = (len(lines) >= (self.n_displayed + 2))
+        tokens = lines[0].split()
+        self.first_page_sec = float(tokens[1])
             
-        line_counter = 0
-        self.session_start_time = -1
-        self.session_end_time = -1
-        while (line_counter < self.n_displayed):
-            tokens = lines[line_counter+1].split()  #skip first line
-            print (tokens)
-            print (line_counter)
-            #self.channel_paths[line_counter] = tokens[0]
+        listed = []
+        for line in lines[1:self.n_displayed + 1]:
+            tokens = line.split()
             channel = dict()
             channel["name"] = tokens[0]
             channel["start_time"] = int(tokens[1])
             channel["end_time"] = int(tokens[2])
             channel["channel_number"] = int(tokens[3])
             channel["units_conversion_factor"] = float(tokens[4])
-            self.channels.append(channel)
+            channel["row"] = int(tokens[5])  # row of the channel in the page ring (page specs order)
+            listed.append(channel)
+            
+        if self.server_info_complete:
+            self.channels = listed
+        else:
+            # until every channel is open, show them in the order they were asked for; the rest are blank for now
+            self.channels = [{"name": path, "row": row} for row, path in enumerate(self.channel_paths)]
+            for channel in listed:
+                self.channels[channel["row"]] = channel
             
+        self.session_start_time = -1
+        self.session_end_time = -1
+        for channel in listed:
             # set earliest channel start time as session start time
             if self.session_start_time == -1:
                 self.session_start_time = channel["start_time"] / 1000000
@@ -696,18 +825,19 @@ class MainWindow(QMainWindow):
                 if (channel["end_time"] / 1000000) < self.session_end_time:
                     self.session_end_time = channel["end_time"] / 1000000
             
-            line_counter = line_counter + 1
-            
         #print ("Start", self.session_start_time, "End", self.session_end_time)
-        self.curr_sec = int(self.session_start_time)
+        
+        # create channel labels based on path names
+        self.channel_labels = []
+        for channel in self.channels:
+            new_label = channel["name"].split('/')
+            self.channel_labels.append(new_label[len(new_label) - 1].split('.')[0])
         
         return False
         
             
     def write_curr_sec(self):
-            with open(self.server_temp_path + "current_sec", 'w') as the_file:
-                the_file.write(str(self.curr_sec) + '\n')
-                the_file.close()
+        self.send_command(CMD_SEEK, struct.pack('<d', self.curr_sec))
         
         
     def keyUp(self):
@@ -787,6 +917,8 @@ class MainWindow(QMainWindow):
                     sum_ranges = sum_ranges + new_range
                     ranges_counted = ranges_counted + 1
                 #print(np.nanmax(self.raw_page[i]), np.nanmin(self.raw_page[i]))
+            if ranges_counted == 0:
+                return  # nothing to scale by yet (channels still opening)
             avg_range = sum_ranges / ranges_counted
             #print (avg_range)
             self.ylim = self.ypix * (avg_range / ((self.ypix / num_chans+1) / 4))
@@ -820,6 +952,9 @@ class MainWindow(QMainWindow):
         
         #X = np.linspace(self.curr_sec, self.curr_sec + self.secs_per_page, self.axpix)
         X = np.linspace(0, self.secs_per_page, self.axpix)
+        # envelope pages alternate min and max of each column; drawing straight through them fills the envelope
+        if len(self.raw_page[0]) == 2 * self.axpix:
+            X = np.repeat(X, 2)
                 
         #print("Figure dims: ", self.figure.get_size_inches(),self.figure.dpi)
         self.figure.clear()
@@ -950,25 +1085,36 @@ class MainWindow(QMainWindow):
         self.axpix = round(pix_dims[0] * self.figure.dpi)
         self.ypix = round(pix_dims[1] * self.figure.dpi)
         self.write_page_specs()
-        self.reset_buffer_limits()
             
             
-
-    def reset_buffer_limits(self):
-        while True:
+    def map_ring(self):
+        # the header is created by the server at startup, the data file whenever the page geometry changes
+        while self.ring_header is None:
             try:
-                bl_file = open(self.server_temp_path + "buffer_limits", "w")
-                break
+                header = np.memmap(self.server_temp_path + "page_ring", dtype=RING_HEADER_DTYPE, mode='r', shape=(1,))
+                if header['magic'][0] != RING_MAGIC or header['version'][0] != RING_VERSION:
+                    del header
+                    time.sleep(0.1)
+                    continue
+                self.ring_header = header
             except:
                 time.sleep(0.1)
-                continue
+        
+        layout_id = int(self.ring_header['layout_id'][0])
+        if layout_id == 0:
+            return False
+        if layout_id != self.ring_layout_id:
+            self.ring_data = None
+            try:
+                self.ring_data = np.memmap(self.server_temp_path + "page_ring_" + str(layout_id), dtype=np.float32, mode='r',
+                                           shape=(int(self.ring_header['n_slots'][0]),
+                                                  int(self.ring_header['num_chans'][0]),
+                                                  int(self.ring_header['samps_per_page'][0]) * int(self.ring_header['samp_values'][0])))
+            except:
+                return False
+            self.ring_layout_id = layout_id
             
-        bl_file.write("0.0" + "\n")
-        # write negative value so we are forced to wait for valid data from the server to proceed
-        bl_file.write("-" + str(self.secs_per_page) + "\n")
-        bl_file.close()
-        print("UI reset buffer limits")
-        time.sleep(0.2)
+        return True
 
         
     def read_page(self):
@@ -977,50 +1123,54 @@ class MainWindow(QMainWindow):
     
         while True:
     
-            while True:
-                try:
-                    bl_file = open(self.server_temp_path + "buffer_limits")
-                    break
-                except:
-                    time.sleep(0.1)
-                    continue
-                
-            lines = bl_file.readlines()
-            bl_file.close()
-        
-            if len(lines) < 2:
+            if not self.map_ring():
+                time.sleep(0.1)
+                continue
+            header = self.ring_header
+            
+            # odd generation means the server is moving the buffer limits right now
+            generation = int(header['generation'][0])
+            if generation % 2 == 1:
+                time.sleep(0.001)
+                continue
+            
+            # wait until the server has picked up our latest page specs
+            if header['fud'][0] != self.page_specs_fud or int(header['layout_id'][0]) != self.ring_layout_id:
                 time.sleep(0.1)
                 continue
     
-            self.buffer_start_sec = float(lines[0])
+            self.buffer_start_sec = float(header['first_sec'][0])
             #print("***************start:", self.buffer_start_sec)
-            self.buffer_end_sec = float(lines[1])
+            self.buffer_end_sec = float(header['last_sec'][0])
             #print("end:", self.buffer_end_sec)
-        
-            if (self.curr_sec < self.buffer_start_sec) or (self.curr_sec + self.secs_per_page > self.buffer_end_sec):
-                time.sleep(0.5)
-            else:
-                break
-    
     
-        while True:
-            try:
-                pd_file = open(self.server_temp_path + "page_data")
-                break
-            except:
-                time.sleep(0.1)
+            # sample columns are numbered from the ring origin; each page occupies one slot, with one row per channel.
+            # In envelope mode each column has two values, min then max.
+            n_slots = int(header['n_slots'][0])
+            samps_per_page = int(header['samps_per_page'][0])
+            samp_values = int(header['samp_values'][0])
+            origin_sec = float(header['origin_sec'][0])
+            curr_buff_samp = round((self.curr_sec - origin_sec) * self.axpix / self.secs_per_page)
+            
+            # wait for every page the view touches (just one when the view is on a page boundary)
+            first_page = round((self.buffer_start_sec - origin_sec) / self.secs_per_page)
+            last_page = round((self.buffer_end_sec - origin_sec) / self.secs_per_page)
+            if (curr_buff_samp // samps_per_page < first_page) or ((curr_buff_samp + self.axpix - 1) // samps_per_page > last_page):
+                time.sleep(0.05)
                 continue
+            #print ("*********curr_buff_samp:", curr_buff_samp)
+            cols = np.repeat(np.arange(curr_buff_samp, curr_buff_samp + self.axpix), samp_values)
+            rows = (cols % samps_per_page) * samp_values + np.tile(np.arange(samp_values), self.axpix)
+            # (numpy puts the indexed axes first, so this is one row per pixel column, one column per channel)
+            arr = self.ring_data[(cols // samps_per_page) % n_slots, :, rows]
             
-        curr_buff_samp = round((self.curr_sec - self.buffer_start_sec) * self.axpix / self.secs_per_page)
-        #print ("*********curr_buff_samp:", curr_buff_samp)
-    
-        pd_file.seek(curr_buff_samp * self.n_displayed * 4, os.SEEK_SET)
-    
-        # read array of float values from page_data file
-        arr = np.fromfile(pd_file, dtype=np.float32, count=(self.n_displayed * self.axpix))
+            # the copy is only good if the server didn't recycle any of those slots while we were reading
+            if int(header['generation'][0]) != generation:
+                continue
+            break
     
-        # use 'F', or Fortran-like ordering, where the first index (n_displayed) changes the fastest.
-        self.raw_page = arr.reshape(self.n_displayed, self.axpix, order='F')
+        # rows of the ring are pixel columns, so transpose to get one row per channel (in server_info order)
+        self.raw_page = arr.T[[channel["row"] for channel in self.channels]]
     
         #chan_count = 0
         #pix_count = 0
@@ -1058,8 +1208,9 @@ def main():
     return_code = app.exec_()
     print ("Exiting eeg_view application...")
     
-    # tell heartbeat thread that we're done
+    # tell heartbeat thread and server that we're done
     heartbeat_flag.set()
+    main.stop_server()
     #time.sleep(.6)  #give it time to kill the thread  (this seems to be not needed)
     
     # exit application
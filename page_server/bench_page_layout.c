@@ -0,0 +1,182 @@
+//    bench_page_layout - page layout benchmark for eeg_page_server3
+//    Copyright (C) 2021 Mayo Foundation, Rochester MN. All rights reserved.
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU General Public License as published by
+//    the Free Software Foundation, either version 3 of the License, or
+//    (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU General Public License for more details.
+//
+//    You should have received a copy of the GNU General Public License
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/*
+
+ bench_page_layout.c
+
+ Stand-alone benchmark of the page server's page layout: channels written interleaved (page[(j * num_chans) + chan],
+ the old layout) against channel-major rows (page[(chan * samps_per_page) + j], what eeg_page_server3 writes now).
+ Each thread plays a read task, downsampling one channel's raw samples into the page; channels are handed out
+ round-robin, as the worker pool does, so neighboring channels are written by different cores at the same time.
+ The transpose row is the cost of converting a channel-major page to interleaved in one pass afterwards, for a
+ consumer that needs it.
+
+ build:  cc -O2 -o bench_page_layout bench_page_layout.c -lpthread -lm
+ run:    ./bench_page_layout [n_threads]
+
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+typedef int		si4;
+typedef long long	si8;
+typedef float		sf4;
+typedef double		sf8;
+
+#define SAMPS_PER_PAGE	2000	// pixel columns
+#define RAW_PER_COL	8	// raw samples per column
+#define N_PAGES		40
+
+typedef struct {
+		si4		thread_idx, n_threads, num_chans, channel_major;
+		si4		*raw;
+		sf4		*page;
+		pthread_barrier_t	*barrier;
+	} BENCH_THREAD;
+
+static sf8 now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return(ts.tv_sec + (ts.tv_nsec / 1e9));
+}
+
+// one column at a time, as downsample_page does, so each store lands separately
+static void write_channel(si4 *raw, sf4 *out, si4 out_stride)
+{
+    si4 j, k;
+    si8 sum;
+
+    for (j = 0; j < SAMPS_PER_PAGE; ++j) {
+        sum = 0;
+        for (k = 0; k < RAW_PER_COL; ++k)
+            sum += raw[(j * RAW_PER_COL) + k];
+        out[j * out_stride] = (sf4) sum * 0.125f;
+    }
+}
+
+static void *bench_thread(void *argument)
+{
+    BENCH_THREAD *bt;
+    si4 p, c;
+
+    bt = (BENCH_THREAD *) argument;
+    for (p = 0; p < N_PAGES; ++p) {
+        for (c = bt->thread_idx; c < bt->num_chans; c += bt->n_threads) {
+            if (bt->channel_major)
+                write_channel(bt->raw, bt->page + ((si8) c * SAMPS_PER_PAGE), 1);
+            else
+                write_channel(bt->raw, bt->page + c, bt->num_chans);
+        }
+        // every channel of a page is done before the next page starts, like pool_wait
+        pthread_barrier_wait(bt->barrier);
+    }
+
+    return(NULL);
+}
+
+static sf8 run(si4 num_chans, si4 n_threads, si4 channel_major, si4 *raw, sf4 *page)
+{
+    pthread_t *threads;
+    BENCH_THREAD *bts;
+    pthread_barrier_t barrier;
+    si4 i;
+    sf8 t0;
+
+    threads = (pthread_t *) calloc((size_t) n_threads, sizeof(pthread_t));
+    bts = (BENCH_THREAD *) calloc((size_t) n_threads, sizeof(BENCH_THREAD));
+    pthread_barrier_init(&barrier, NULL, (unsigned) n_threads);
+
+    t0 = now_sec();
+    for (i = 0; i < n_threads; ++i) {
+        bts[i].thread_idx = i;
+        bts[i].n_threads = n_threads;
+        bts[i].num_chans = num_chans;
+        bts[i].channel_major = channel_major;
+        bts[i].raw = raw;
+        bts[i].page = page;
+        bts[i].barrier = &barrier;
+        pthread_create(threads + i, NULL, bench_thread, (void *) (bts + i));
+    }
+    for (i = 0; i < n_threads; ++i)
+        pthread_join(threads[i], NULL);
+    t0 = now_sec() - t0;
+
+    pthread_barrier_destroy(&barrier);
+    free(bts);
+    free(threads);
+
+    return((t0 * 1000.0) / N_PAGES);
+}
+
+static sf8 run_transpose(si4 num_chans, sf4 *channel_major, sf4 *interleaved)
+{
+    si4 p, c, j;
+    sf8 t0;
+
+    t0 = now_sec();
+    for (p = 0; p < N_PAGES; ++p)
+        for (c = 0; c < num_chans; ++c)
+            for (j = 0; j < SAMPS_PER_PAGE; ++j)
+                interleaved[((si8) j * num_chans) + c] = channel_major[((si8) c * SAMPS_PER_PAGE) + j];
+
+    return(((now_sec() - t0) * 1000.0) / N_PAGES);
+}
+
+int main(int argc, char **argv)
+{
+    si4 n_threads, i, k, chans[3] = {64, 256, 1024};
+    si4 *raw;
+    sf4 *page, *page2;
+    sf8 interleaved_ms, channel_major_ms, transpose_ms;
+
+    n_threads = (argc > 1) ? atoi(argv[1]) : (si4) sysconf(_SC_NPROCESSORS_ONLN);
+    if (n_threads < 1)
+        n_threads = 1;
+
+    raw = (si4 *) malloc((size_t) SAMPS_PER_PAGE * RAW_PER_COL * sizeof(si4));
+    for (i = 0; i < SAMPS_PER_PAGE * RAW_PER_COL; ++i)
+        raw[i] = (si4) (1000.0 * sin(i * 0.01));
+
+    printf("%d threads, %d columns per page, ms per page (best of 3)\n", n_threads, SAMPS_PER_PAGE);
+    printf("%8s %12s %14s %8s %12s\n", "channels", "interleaved", "channel-major", "speedup", "+transpose");
+    for (i = 0; i < 3; ++i) {
+        page = (sf4 *) calloc((size_t) chans[i] * SAMPS_PER_PAGE, sizeof(sf4));
+        page2 = (sf4 *) calloc((size_t) chans[i] * SAMPS_PER_PAGE, sizeof(sf4));
+        interleaved_ms = channel_major_ms = transpose_ms = 1e30;
+        for (k = 0; k < 3; ++k) {
+            interleaved_ms = fmin(interleaved_ms, run(chans[i], n_threads, 0, raw, page));
+            channel_major_ms = fmin(channel_major_ms, run(chans[i], n_threads, 1, raw, page));
+            transpose_ms = fmin(transpose_ms, run_transpose(chans[i], page, page2));
+        }
+        printf("%8d %12.3f %14.3f %7.2fx %12.3f\n", chans[i], interleaved_ms, channel_major_ms,
+               interleaved_ms / channel_major_ms, transpose_ms);
+        free(page);
+        free(page2);
+    }
+    free(raw);
+
+    return(0);
+}
@@ -32,6 +32,14 @@
 #include <pthread.h>
 #include <float.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <errno.h>
+#ifdef USE_IO_URING
+#include <liburing.h>
+#endif
 #else
 #include <stdlib.h>
 #include <stdio.h>
@@ -44,29 +52,325 @@
 //#include <pthread.h>
 #include <float.h>
 #include <time.h>
+#include <io.h>
+#include <fcntl.h>
 #endif
 
 #include "meflib.h"
 
+// x86 vector kernels are compiled for their own instruction set and chosen at run time (see simd_init())
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSE41
+#define TARGET_AVX2
+#else
+#define TARGET_SSE41	__attribute__((target("sse4.1")))
+#define TARGET_AVX2	__attribute__((target("avx2")))
+#endif
+#endif
+
 /* defines */
 #define N_PAGES_AHEAD	50
-#define READ_INTERVAL	500000
 #define HEARTBEAT_INTERVAL 2
+#define UI_HEARTBEAT_TIMEOUT	5
 #define DISCON_MAJOR_THRESHOLD 60 * 1000000  // 1 minute
+#define N_PAGES_BEHIND	20	// pages kept (and read) before the view, for paging backward
+#define READ_BATCH_PAGES	8	// consecutive pages of a channel read and decoded together
+#define READ_BATCH_MAX_SAMPS	(16 * 1024 * 1024)	// per channel, limits the batch for long pages
+#define IO_BATCH_MAX_BYTES	((size_t) 256 * 1024 * 1024)	// compressed data read ahead of decoding, by all batches in flight
+#define IO_THREADS		32	// reads in flight at once without io_uring
+#define IO_QUEUE_DEPTH		256	// io_uring entries
+#define DECODE_PIECE_MIN_BLOCKS	16	// a batch is only split into pieces of at least this many blocks
+#define PIPELINE_BATCHES	3	// batches of pages being read at once (see PIPELINE)
+#define INTERP_CHUNK	256	// page columns placed, then interpolated, at a time
+#define RING_MAGIC	0x52474545	// "EEGR"
+#define RING_VERSION	3
+#define RING_HEADER_BYTES	4096
+
+// commands from the UI: a ui4 command code and a ui4 payload length, followed by the payload
+#define CMD_SEEK	1	// payload: sf8 seconds of the left edge of the view
+#define CMD_PAGE_SPECS	2	// payload: page specs text (see parse_page_specs())
+#define CMD_HEARTBEAT	3	// no payload
+#define CMD_QUIT	4	// no payload
+#define CMD_MAX_PAYLOAD	(4 * 1024 * 1024)
+
+// how each output sample (pixel column) of a page is made
+#define DISPLAY_LINE		0	// one value per column, interpolated between raw samples
+#define DISPLAY_ENVELOPE	1	// two values per column: min and max of the raw samples under it
+
+// display filters (page specs "highpass", "lowpass" and "notch"), applied to the decoded samples before decimation
+#define FILTER_MAX_SECTIONS	3	// one second-order section each
+#define FILTER_BUTTERWORTH_Q	0.70710678118654752
+#define FILTER_NOTCH_Q		30.0
+
+// montages (page specs "average" and "trace"): derived traces computed from the decoded samples of the channels
+#define MONTAGE_MAX_TERMS	64
+#define MONTAGE_MAX_BATCH_BYTES	((size_t) 512 * 1024 * 1024)	// decoded samples of all source channels of a batch
+
+// Each channel's block index is cached on disk next to the pyramids, so reopening a session skips the MEF metadata
+#define INDEX_CACHE_MAGIC	0x58444945	// "EIDX"
+#define INDEX_CACHE_VERSION	3
+
+// Min/max pyramid per segment, cached on disk, for zoomed-out envelope pages.  Level 0 holds the (min, max) of
+// every PYRAMID_BASE_BIN samples, and each level above combines PYRAMID_FACTOR bins of the level below.
+#define PYRAMID_MAGIC		0x50474545	// "EEGP"
+#define PYRAMID_VERSION		1
+#define PYRAMID_BASE_BIN	64
+#define PYRAMID_FACTOR		4
+#define PYRAMID_MAX_LEVELS	16
+#define PYRAMID_HEADER_BYTES	1024
+#define PYRAMID_MIN_BINS_PER_COL	4	// a coarser level would smear spikes into neighboring columns
+#define PYRAMID_READ_CHUNK	(4 * 1024 * 1024)
+
+// pyramid states
+#define PYRAMID_UNKNOWN		0
+#define PYRAMID_BUILDING	1
+#define PYRAMID_ON_DISK		2	// built (or found in the cache), not mapped yet
+#define PYRAMID_READY		3	// mapped
+#define PYRAMID_FAILED		4
+
+#define BLOCK_CACHE_BYTES	(256 * 1024 * 1024)	// decoded blocks kept for reuse by later pages
+#define BLOCK_CACHE_BUCKETS	65536
+#define BLOCK_CACHE_FREE_BYTES	(16 * 1024 * 1024)	// evicted blocks' buffers kept for decoding the next ones into
+#define BLOCK_CACHE_MIN_CLASS	4	// smallest sample buffer: 2^4 samples
+#define INDEX_MEMORY_BYTES	(256 * 1024 * 1024)	// segment block indices kept loaded, unless the page specs say otherwise
+#define DATA_FILES_OPEN		256	// .tdat files kept open, unless the page specs say otherwise (at most half the process limit)
 
-#define RF_TIMER 1001
 #define DBUG		0
 
+#ifndef _WIN32
+#define MEMORY_BARRIER()	__sync_synchronize()
+#define ATOMIC_DECREMENT(x)	__sync_sub_and_fetch(&(x), 1)	// returns the new value
+#else
+#define MEMORY_BARRIER()	MemoryBarrier()
+#define ATOMIC_DECREMENT(x)	InterlockedDecrement((volatile LONG *) &(x))
+#endif
+
 /* typedefs */
+typedef struct {
+		void		*addr;
+		size_t		bytes;
+#ifndef _WIN32
+		si4		fd;
+#else
+		HANDLE		file_handle, map_handle;
+#endif
+	} MAPPED_FILE;
+
+// a segment's files: the .tdat file read for data, and the identity of all three files for the index cache
+typedef struct {
+		si1		data_path[1024];
+		si8		file_size[3], mtime[3];	// .tmet, .tidx, .tdat
+	} SEGMENT_FILES;
+
+// The block index of one segment, read from its .tidx file when a read first needs it (see segment_blocks_get()),
+// with block start samples as channel sample numbers.  Loaded segments of all channels share one memory ceiling.
+typedef struct SEGMENT_BLOCKS {
+		struct SEGMENT_BLOCKS	**home;		// the owning channel's segment_blocks entry, cleared when this is dropped
+		si8		n_blocks;
+		si8		*start_time, *start_sample, *file_offset;
+		si4		*bytes, *samples;
+		si4		*min_value, *max_value;	// of the block's samples, from the index (see index_envelope())
+		si4		refs;		// pinned while in use, never dropped
+		size_t		memory;		// bytes held, or 0 if the arrays are in a mapped index cache file
+		struct SEGMENT_BLOCKS	*lru_prev, *lru_next;
+	} SEGMENT_BLOCKS;
+
+// Loaded segment block indices, dropped least recently used first once they hold more than max_bytes.
+typedef struct {
+		SEGMENT_BLOCKS	*lru_head, *lru_tail;  // most, least recently used
+		size_t		bytes, max_bytes;
+		ui8		loads, evictions;
+#ifndef _WIN32
+		pthread_mutex_t	lock;
+#else
+		CRITICAL_SECTION	lock;
+#endif
+	} INDEX_LRU;
+
+// A segment's .tdat file, open for reading and shared by every read of the channel.  It is mapped when it can be,
+// so blocks are decoded from the page cache in place; the descriptor stays open either way, for positional reads of
+// what the mapping doesn't cover (a file that can't be mapped, or data appended since).  Pinned while in use.
+typedef struct DATA_FILE {
+		struct DATA_FILE	**home;		// the owning channel's data_files entry, cleared when this is closed
+		MAPPED_FILE	file;		// the descriptor, and the mapping if file.addr isn't NULL
+		si4		refs;		// pinned while in use, never closed
+		struct DATA_FILE	*lru_prev, *lru_next;
+	} DATA_FILE;
+
+// Open .tdat files of all channels, closed least recently used first once more than max_open are open, so a long
+// session neither runs out of file descriptors nor reopens the files it is reading.
+typedef struct {
+		DATA_FILE	*lru_head, *lru_tail;  // most, least recently used
+		si4		n_open, max_open;
+		ui8		opens, evictions;
+#ifndef _WIN32
+		pthread_mutex_t	lock;
+#else
+		CRITICAL_SECTION	lock;
+#endif
+	} DATA_FILE_CACHE;
+
+// Index of one channel: the segments, from their metadata, and the channel metadata the server uses.  Blocks are
+// numbered across segments (segment_first_block), but a segment's block index is only loaded when it is read.
+// Built from the .tmet files when the channel is opened, or mapped from the index cache (see index_cache_load()),
+// in which case every segment's blocks are in the mapping.  Block start times are assumed to increase.
+typedef struct {
+		si8		n_blocks;
+		si4		n_segments;
+		si8		*segment_first_block;	// n_segments + 1 entries, the last one is n_blocks
+		si8		*segment_start_sample, *segment_end_sample;
+		si8		*segment_start_time;	// a segment without blocks gets the previous segment's
+		SEGMENT_FILES	*segment_files;
+		SEGMENT_BLOCKS	**segment_blocks;	// NULL until loaded
+		INDEX_LRU	*lru;
+		DATA_FILE_CACHE	*file_cache;
+		si1		*password;
+		sf8		sampling_frequency, units_conversion_factor;
+		si8		acquisition_channel_number, earliest_start_time, latest_end_time;
+		ui4		maximum_block_samples;
+		si1		encrypted;
+		DATA_FILE	**data_files;		// NULL until a read opens the segment's .tdat file
+		si1		*data_map_failed;	// (those are only read with positional reads)
+		MAPPED_FILE	*cache_map;		// if not NULL, the arrays above live in this mapped index cache file
+	} CHANNEL_INDEX;
+
+// Start of an index cache file, which holds one channel's CHANNEL_INDEX.  The arrays follow, each at a multiple of
+// 8 bytes: segment_files, segment_first_block, segment_start_sample, segment_end_sample, segment_start_time
+// (n_segments + 1 entries), then the blocks of all segments in turn: start_time, start_sample, file_offset, bytes,
+// samples, min_value, max_value (n_blocks + 1 entries).
+typedef struct {
+		ui4		magic, version;
+		si1		channel_path[1024];
+		si8		channel_mtime;		// of the channel directory, which changes when a segment is added
+		si8		n_blocks;
+		si4		n_segments;
+		ui4		maximum_block_samples;
+		sf8		sampling_frequency, units_conversion_factor;
+		si8		acquisition_channel_number, earliest_start_time, latest_end_time;
+	} INDEX_CACHE_HEADER;
+
+// One decoded RED block.  Entries in use by a read_thread are pinned (refs > 0) and are never evicted.
+typedef struct BLOCK_CACHE_ENTRY {
+		CHANNEL_INDEX	*owner;		// identifies the channel
+		si8		block;		// block number in the channel's flattened index (segment and block)
+		si8		start_time;	// from the decoded block header (recording time offset removed)
+		si4		number_of_samples, refs;
+		si4		*samples;
+		struct BLOCK_CACHE_ENTRY	*hash_next, *lru_prev, *lru_next;
+	} BLOCK_CACHE_ENTRY;
+
+// Decoded blocks shared by all channels and pages, evicted least recently used first once max_bytes is reached.
+// Evicted entries and sample buffers are kept (up to BLOCK_CACHE_FREE_BYTES) for the next blocks decoded, so once
+// the cache is full, decoding doesn't allocate.
+typedef struct {
+		BLOCK_CACHE_ENTRY	**buckets;
+		ui4		n_buckets;
+		BLOCK_CACHE_ENTRY	*lru_head, *lru_tail;  // most, least recently used
+		size_t		bytes, max_bytes;
+		si4		*free_samples[32];  // by size class (see block_cache_class()), linked through their first bytes
+		BLOCK_CACHE_ENTRY	*free_entries;  // linked through hash_next
+		size_t		free_bytes;
+		ui8		hits, misses, evictions;
+#ifndef _WIN32
+		pthread_mutex_t	lock;
+#else
+		CRITICAL_SECTION	lock;
+#endif
+	} BLOCK_CACHE;
+
+// Display filter of one channel: a cascade of second-order sections (transposed direct form II), run forward over
+// the decoded samples.  The state is kept between reads, so a batch that starts where the channel's previous one
+// ended carries on from it, without reading anything before the batch.
+typedef struct {
+		si4		n_sections;
+		sf8		b0[FILTER_MAX_SECTIONS], b1[FILTER_MAX_SECTIONS], b2[FILTER_MAX_SECTIONS];
+		sf8		a1[FILTER_MAX_SECTIONS], a2[FILTER_MAX_SECTIONS];
+		sf8		z1[FILTER_MAX_SECTIONS], z2[FILTER_MAX_SECTIONS];
+		si8		next_time;	// uutc the state has been run up to, or -1 if it doesn't continue anything
+	} CHANNEL_FILTER;
+
+// A common-average group: the mean of its members, in physical units, at the first member's sampling frequency.
+// Computed once per batch and shared by every trace that references it.
+typedef struct {
+		si4		n_members, *members;
+		sf8		samp_freq;
+		sf4		*mean;		// NAN where no member has data
+		size_t		mean_count;
+		si8		num_samps;
+	} MONTAGE_GROUP;
+
+// A derived trace: the weighted sum of channels and group means, at its first source's sampling frequency, and in
+// that source's units (terms in other units are converted).  Its display filter runs on the sum.
+typedef struct {
+		si4		n_terms;
+		si4		sources[MONTAGE_MAX_TERMS];	// channel number, or -1 - group number
+		sf8		weights[MONTAGE_MAX_TERMS];
+		sf8		samp_freq, units_conversion_factor;
+		CHANNEL_FILTER	filter;
+	} MONTAGE_TRACE;
+
+// With a montage, the pages hold one row per trace instead of one per channel.  Channels are numbered in the order
+// the page specs list them (their ring rows), and each channel any trace uses is decoded once per batch.
+typedef struct {
+		si4		n_groups, n_traces, num_chans;
+		MONTAGE_GROUP	*groups;
+		MONTAGE_TRACE	*traces;
+		si1		*channel_used;
+	} MONTAGE;
+
 typedef struct {
 		si4	samps_per_page, num_chans;
-		sf4	*page_data;
+		si4	display_mode, samp_values;
+		sf8	highpass_hz, lowpass_hz, notch_hz;  // 0 when off
 		sf8	secs_per_page, curr_view_sec, page_to_write_start_sec;
         si8 session_start_time;
         si8 session_end_time;
     char *password;
+		si1		*cache_dir;  // pyramid and index cache folder, or empty
+		BLOCK_CACHE	*block_cache;
+		INDEX_LRU	*index_lru;
+		DATA_FILE_CACHE	*file_cache;
+		MONTAGE		*montage;  // NULL: one trace per channel
 	} FIXED_INFO;
 
+// start of a pyramid file; the bins follow at PYRAMID_HEADER_BYTES, as si4 (min, max) pairs
+typedef struct {
+		ui4		magic, version;
+		si8		file_size, mtime, number_of_samples;  // identity of the .tdat file it was built from
+		si4		base_bin, factor, n_levels, pad;
+		si8		level_offset[PYRAMID_MAX_LEVELS], level_bins[PYRAMID_MAX_LEVELS];  // in bins
+	} PYRAMID_HEADER;
+
+typedef struct {
+		volatile si4	state;
+		si1		path[1024];
+		MAPPED_FILE	map;
+		PYRAMID_HEADER	*header;
+		si4		*bins;
+	} PYRAMID;
+
+// everything a background task needs to build one segment's pyramid, copied so the channel can be freed meanwhile
+// (the segment's blocks are read by the task itself)
+typedef struct {
+		PYRAMID		*pyramid;
+		si1		tdat_path[1024], *password;
+		si8		file_size, mtime, number_of_samples, number_of_blocks, start_sample;
+		si4		segment;
+		ui4		max_samps;
+		si4		generation;
+	} PYRAMID_BUILD;
+
+// a channel's index cache file to write (background task); the channel's segments are read one at a time
+typedef struct {
+		CHANNEL_INDEX	*index;
+		si1		cache_dir[1024], channel_path[1024];
+		si4		generation;
+	} INDEX_CACHE_WRITE;
+
 typedef struct {
 		si1		f_name[256];
 		si4		chan_idx;
@@ -75,50 +379,425 @@ typedef struct {
 		ui1		encryptionKey[240], data_encryption_used;
 		FILE		*d_fp;
 		//INDEX_DATA	*index_array;
-    CHANNEL   *channel;
+		CHANNEL_INDEX	*index;
 		FIXED_INFO	*fixed_info;
+		PYRAMID		*pyramids;  // one per segment, NULL when not in use
+		CHANNEL_FILTER	filter;
+		si4		*source_raw;  // with a montage, the channel's decoded samples for the current batch
+		size_t		source_raw_count;
+		si8		source_samps;
 	} THREAD_INFO;
 
+// One run of uncached blocks of a read task, read along with the rest of the batch's runs before it is decoded
+typedef struct IO_REQUEST {
+		DATA_FILE	*data_file;	// pinned until the batch has been decoded
+		si4		segment, mapped;	// mapped: the run is in the file's mapping, and is only read ahead
+		si8		offset, bytes, result;	// result: bytes read into the buffer
+		ui1		*buffer;	// NULL if the run isn't read into memory
+		struct IO_PLAN	*plan;
+		struct IO_REQUEST	*next;	// in the reads waiting for room on the ring
+	} IO_REQUEST;
+
+// A read task's runs, found by io_plan_thread().  The buffer holds the runs read into memory, each followed by 30
+// spare bytes (see read_thread()).
+typedef struct IO_PLAN {
+		struct IO_QUEUE	*queue;
+		void		*task;		// the READ_TASK, decoded once pending reaches 0
+		IO_REQUEST	*requests;
+		si4		n_requests, max_requests, pending;
+		ui1		*buffer;
+		size_t		buffer_bytes;
+	} IO_PLAN;
+
+// one unit of work for read_thread: n_pages consecutive pages of one channel, starting at page_start_sec
+typedef struct {
+		THREAD_INFO	*thread_info;
+		sf8		page_start_sec;
+		si4		n_pages, direction;  // direction: 1 reading ahead of the view, -1 behind it
+		si4		decode_only;  // just decode the batch into thread_info->source_raw, for a montage
+		sf4		*page_data[READ_BATCH_PAGES];  // ring slot of each page
+		IO_PLAN		io;  // runs read ahead for the task (none for a task run on its own)
+		si4		n_pieces;  // the most pieces the blocks may be decoded in, in parallel (see decode_split())
+		struct WORKER_POOL	*pool;  // where the other pieces go
+		struct PAGE_BATCH	*batch;  // the batch in the pipeline the task belongs to, or NULL
+		si4		in_batch;
+		volatile si4	gate, handoff;  // see pipeline_start()
+	} READ_TASK;
+
+// one montage group's means, or one trace's pages, for a batch whose source channels have been decoded
+typedef struct {
+		MONTAGE		*montage;
+		THREAD_INFO	*thread_info;  // all channels
+		si4		index;  // group or trace number
+		sf8		page_start_sec;
+		si4		n_pages, direction;
+		sf4		*page_data[READ_BATCH_PAGES];
+	} MONTAGE_TASK;
+
+// Shared with the UI, which maps it with np.memmap.  Field offsets are fixed - keep in sync with eeg_view.py.
+// generation is odd while the server is changing which pages are valid; readers retry if it changes under them.
+typedef struct {
+		ui4		magic, version, layout_id;
+		si4		num_chans, samps_per_page, n_slots;
+		volatile ui8	generation;
+		volatile sf8	first_sec, last_sec;
+		sf8		secs_per_page, origin_sec;
+		volatile sf8	fud;
+		volatile si8	heartbeat;
+		si4		samp_values;  // values per sample column: 1, or 2 (min, max) in envelope mode
+	} RING_HEADER;
+
+// Page slots live in a per-layout data file, indexed by page number (counted from origin_sec) modulo n_slots.
+// A slot is channel-major: num_chans rows of samps_per_page * samp_values values, so each read task writes one
+// contiguous row and channels on different cores never share a cache line.
+typedef struct {
+		si1		page_dir[1024], data_path[1024];
+		MAPPED_FILE	header_map, data_map;
+		RING_HEADER	*header;
+		sf4		*slots;
+		size_t		slot_samps;
+	} RING_BUFFER;
+
+// The first page of new page specs is read channel by channel, as each channel finishes opening, instead of after
+// all of them have: rows are filled in (and listed in server_info) in the order the channels become ready.  With no
+// view yet, the page is at the session's start, which is only known once every channel is open.
+typedef struct {
+		THREAD_INFO	*thread_info;  // all channels
+		struct OPEN_TASK	*open_tasks;  // one per channel
+		si4		num_chans, enabled;
+		RING_BUFFER	*ring;
+		sf8		view_sec;  // start of the page, or 0 until every channel is open
+		si4		n_open;  // channels open so far
+		si8		start_time;  // the earliest start of the channels open so far
+		si4		n_ready, *ready;  // rows filled so far, in the order they were
+		si1		*server_info_path;
+#ifndef _WIN32
+		pthread_mutex_t	lock;
+#else
+		CRITICAL_SECTION	lock;
+#endif
+	} FIRST_PAGE;
+
+#ifndef _WIN32
+typedef void *(*POOL_FUNC)(void *);
+#else
+typedef DWORD (WINAPI *POOL_FUNC)(LPVOID);
+#endif
+
+typedef struct {
+		POOL_FUNC	func;
+		void		*arg;
+	} POOL_TASK;
+
+// Scratch buffers owned by one worker thread and reused by every read task it runs, so the read path doesn't go
+// through the allocator once they have grown to the largest batch and block sizes seen.
+typedef struct {
+		si4		*raw;
+		size_t		raw_count;
+		si1		*compressed;
+		size_t		compressed_bytes;
+		ui1		*block_scratch;
+		size_t		block_scratch_bytes;
+		RED_PROCESSING_STRUCT	*rps;
+		size_t		difference_bytes;
+	} WORKER_ARENA;
+
+// growable circular FIFO of tasks
+typedef struct {
+		si4		size, head, count;
+		POOL_TASK	*tasks;
+	} TASK_QUEUE;
+
+// Long-lived worker threads, sized to the number of cores.  Foreground tasks (page reads, channel opens) always
+// run first; background tasks (cache building) only run on idle workers, and never on all of them at once.
+typedef struct WORKER_POOL {
+		si4		num_workers, quit;
+		TASK_QUEUE	queue, background_queue;
+		si4		pending, background_pending, background_running, max_background;
+#ifndef _WIN32
+		pthread_t	*workers;
+		pthread_mutex_t	lock;
+		pthread_cond_t	work_cond, done_cond;
+#else
+		HANDLE		*workers;
+		CRITICAL_SECTION	lock;
+		CONDITION_VARIABLE	work_cond, done_cond;
+#endif
+	} WORKER_POOL;
+
+// Issues all the reads of a batch at once, so the device works through them at its own queue depth, instead of one
+// read per decode worker, and decodes each read task as soon as its reads are in.  Built with USE_IO_URING (and
+// liburing) the reads go through an io_uring, whose completions a thread of its own reaps; otherwise, or if the
+// kernel has none, IO_THREADS threads of their own issue them.  Either way the decode workers never block in a read
+// of the batch, and the server loop only hands the reads over.
+typedef struct IO_QUEUE {
+#ifdef USE_IO_URING
+		struct io_uring	ring;
+		si4		have_ring, in_flight;
+		IO_REQUEST	*waiting_head, *waiting_tail;  // reads past the IO_QUEUE_DEPTH on the ring
+		pthread_t	completion_thread;
+#endif
+		WORKER_POOL	io_pool;	// (not started if the ring is used)
+		WORKER_POOL	*decode_pool;
+		ui8		batches, reads, bytes;
+#ifndef _WIN32
+		pthread_mutex_t	lock;
+#else
+		CRITICAL_SECTION	lock;
+#endif
+	} IO_QUEUE;
+
+// A read task's blocks, split into pieces of about the same compressed size, which the task's worker and idle ones
+// decode at once (see decode_split()).  Each block goes to its own stretch of the batch's raw samples, so the pieces
+// write to different parts of it.  Freed by whichever of the task and its helpers is done with it last.
+typedef struct {
+		READ_TASK	*read_task;
+		si4		*raw;
+		si8		num_samps, start_time;
+		sf8		samp_freq;
+		si8		*piece_first;	// n_pieces + 1 entries, the last one is past the task's last block
+		si4		n_pieces, next_piece, n_done;
+		si4		refs;		// the task, and the helpers that haven't finished
+#ifndef _WIN32
+		pthread_mutex_t	lock;
+		pthread_cond_t	done_cond;
+#else
+		CRITICAL_SECTION	lock;
+		CONDITION_VARIABLE	done_cond;
+#endif
+	} DECODE_SPLIT;
+
+// one unit of work for channel_open_thread
+typedef struct OPEN_TASK {
+		THREAD_INFO	*thread_info;
+		FIRST_PAGE	*first_page;
+		WORKER_POOL	*pool;  // for writing the index cache
+	} OPEN_TASK;
+
+// latest state sent by the UI, handed from control_thread to the server loop
+typedef struct {
+		sf8		curr_view_sec;
+		si4		seek_pending, specs_pending, quit;
+		si1		*page_specs;
+		time_t		last_ui_heartbeat;
+#ifndef _WIN32
+		pthread_mutex_t	lock;
+		pthread_cond_t	cond;
+#else
+		CRITICAL_SECTION	lock;
+		CONDITION_VARIABLE	cond;
+#endif
+	} CONTROL_CHANNEL;
+
+// One batch of pages in the pipeline: n_pages consecutive pages of every channel, one read task per channel.  The
+// tasks count planning and decoding down as they finish, without a lock, and the one that brings a count to 0 wakes
+// the server loop, which takes the batch on to its next stage.
+typedef struct PAGE_BATCH {
+		sf8		page_start_sec;
+		si4		n_pages, direction;
+		READ_TASK	*read_tasks;	// one per channel (in_batch is 0 for those the batch doesn't read)
+		READ_TASK	**tasks;	// the ones it does
+		si4		n_tasks, reads_issued;
+		volatile si4	planning, decoding;	// tasks still finding their runs, and not yet decoded
+		volatile si4	cancelled;	// its pages are no longer wanted (see pipeline_cancel_stale())
+		struct PIPELINE	*pipeline;
+	} PAGE_BATCH;
+
+// Batches of pages on their way through the stages of a read: finding each channel's runs of blocks, reading them,
+// decoding, and publishing the pages in the ring.  Up to max_batches are in flight at once, so the workers go on to
+// the next batches while the slowest channel of one is still being decoded, instead of waiting for it.  Batches are
+// published in the order they were started, which keeps the ring's pages contiguous.  A channel's own tasks are
+// still decoded one batch after another (its display filter carries on from one batch to the next).  A batch whose
+// pages are no longer wanted is cancelled: its tasks skip whatever they haven't started, and it is retired unpublished.
+typedef struct PIPELINE {
+		PAGE_BATCH	batches[PIPELINE_BATCHES];
+		si4		head, count, max_batches;	// oldest batch in flight, batches in flight, most allowed
+		si4		num_chans;
+		WORKER_POOL	*pool;
+		IO_QUEUE	*io_queue;
+		CONTROL_CHANNEL	*control;	// the server loop waits here
+	} PIPELINE;
+
+typedef struct {
+		sf8		fud, secs_per_page;
+		si4		num_chans, samps_per_page, display_mode;
+		sf8		highpass_hz, lowpass_hz, notch_hz;
+		si1		data_path[1024], password[16], events_file[1024], cache_dir[1024];
+		si8		index_memory_bytes;
+		si4		open_files;
+		MONTAGE		*montage;  // NULL if the specs have none
+	} PAGE_SPECS;
+
+// Vector kernels for the per-sample loops of a page (filling, envelope min/max, interpolating columns), picked once
+// at startup for what the cpu supports: AVX2, SSE4.1, or plain C.  All three give the same results.
+typedef struct {
+		void		(*fill_si4)(si4 *ptr, si4 value, si8 n);
+		void		(*fill_sf4)(sf4 *ptr, sf4 value, si8 n);
+		void		(*min_max)(si4 *raw, si8 n, si4 *min_val, si4 *max_val);
+		void		(*interpolate)(si4 *raw, si4 *idx, sf8 *frac, si4 n, sf4 *out, sf8 units_conversion_factor);
+		si1		*name;
+	} SIMD_KERNELS;
+
 /* globals */
-si4	read_files_flag = 1;
 si4 password_needed = 0;
+volatile si4 pyramid_generation = 0;  // bumped to cancel background tasks (pyramid builds, index cache writes) in progress
+#ifndef _WIN32
+static __thread WORKER_ARENA *worker_arena = NULL;  // the calling worker's arena
+#else
+static __declspec(thread) WORKER_ARENA *worker_arena = NULL;
+#endif
 
 /* prototypes */
 #ifndef _WIN32
 static void *read_thread(void *argument);
-static void *heartbeat_thread(void *argument);
-static void set_rf_flag(int);
-static ui8 update_buffer_limits();
-static si4 check_fud();
+static void *control_thread(void *argument);
+static ui8 update_buffer_limits(RING_BUFFER *ring, sf8 first_sec_written, sf8 last_sec_written);
 static void *get_mef_channel_thread(void *argument);
-static void *do_nothing_thread(void *argument);
-si8 sample_for_uutc_c(si8 uutc, CHANNEL *channel);
+static void *channel_open_thread(void *argument);
+static void *first_page_thread(void *argument);
+static void *pool_worker_thread(void *argument);
+static void *pyramid_build_thread(void *argument);
+static void *index_cache_write_thread(void *argument);
+static void *montage_group_thread(void *argument);
+static void *montage_trace_thread(void *argument);
+si8 sample_for_uutc_c(si8 uutc, CHANNEL_INDEX *index);
 #else
 DWORD WINAPI read_thread(LPVOID argument);
-DWORD WINAPI heartbeat_thread(LPVOID argument);
-void CALLBACK set_rf_flag(HWND hwnd, UINT uMsg, UINT timerId, DWORD dwTime);
-static ui8 update_buffer_limits();
-static si4 check_fud();
+DWORD WINAPI control_thread(LPVOID argument);
+static ui8 update_buffer_limits(RING_BUFFER *ring, sf8 first_sec_written, sf8 last_sec_written);
 DWORD WINAPI get_mef_channel_thread(LPVOID argument);
-DWORD WINAPI do_nothing_thread(LPVOID argument);
-si8 sample_for_uutc_c(si8 uutc, CHANNEL* channel);
+DWORD WINAPI channel_open_thread(LPVOID argument);
+DWORD WINAPI first_page_thread(LPVOID argument);
+DWORD WINAPI pool_worker_thread(LPVOID argument);
+DWORD WINAPI pyramid_build_thread(LPVOID argument);
+DWORD WINAPI index_cache_write_thread(LPVOID argument);
+DWORD WINAPI montage_group_thread(LPVOID argument);
+DWORD WINAPI montage_trace_thread(LPVOID argument);
+si8 sample_for_uutc_c(si8 uutc, CHANNEL_INDEX *index);
+#endif
+static si4 get_num_cores(void);
+static void pool_init(WORKER_POOL *pool, si4 num_workers);
+static void pool_submit(WORKER_POOL *pool, POOL_FUNC func, void *arg);
+static void pool_submit_background(WORKER_POOL *pool, POOL_FUNC func, void *arg);
+static void pool_wait(WORKER_POOL *pool);
+static void pool_wait_background(WORKER_POOL *pool);
+static void *arena_reserve(void *buf, size_t *capacity, size_t needed);
+static RED_PROCESSING_STRUCT *arena_rps(WORKER_ARENA *arena, ui4 max_samps);
+static void arena_free(WORKER_ARENA *arena);
+static si4 map_file(si1 *path, size_t bytes, MAPPED_FILE *mf);
+static si4 map_file_readonly(si1 *path, MAPPED_FILE *mf);
+static void unmap_file(MAPPED_FILE *mf);
+static void ring_init(RING_BUFFER *ring, si1 *page_dir);
+static void ring_set_layout(RING_BUFFER *ring, si4 num_chans, si4 samps_per_page, si4 samp_values, sf8 secs_per_page, sf8 fud, sf8 origin_sec);
+static void ring_reset(RING_BUFFER *ring, sf8 origin_sec);
+static sf4 *ring_slot(RING_BUFFER *ring, sf8 page_start_sec);
+static void control_init(CONTROL_CHANNEL *control);
+static void control_lock(CONTROL_CHANNEL *control);
+static void control_unlock(CONTROL_CHANNEL *control);
+static si4 control_wait(CONTROL_CHANNEL *control, si4 timeout_secs);
+static si4 parse_page_specs(si1 *text, PAGE_SPECS *specs, si1 f_names[][256]);
+static void first_page_lock(FIRST_PAGE *first_page);
+static void first_page_unlock(FIRST_PAGE *first_page);
+static void write_server_info(si1 *path, THREAD_INFO *thread_info, si4 *rows, si4 n_rows, si4 num_chans, sf8 view_sec, si4 complete);
+static si4 next_page_direction(sf8 view_sec, sf8 first_sec, sf8 last_sec, sf8 secs_per_page, sf8 start_sec, sf8 end_sec);
+static void envelope_decimate(si4 *raw, si8 num_samps, sf8 samps_per_col, si4 n_cols, sf4 *out, si4 out_stride, sf8 units_conversion_factor);
+static CHANNEL_INDEX *build_channel_index(si1 *channel_path, si1 *password);
+static void channel_index_open(CHANNEL_INDEX *index);
+static void free_channel_index(CHANNEL_INDEX *index);
+static SEGMENT_BLOCKS *read_segment_blocks(si1 *tdat_path, si1 *password, si4 segment, si8 start_sample, si8 n_blocks);
+static void index_lru_init(INDEX_LRU *lru, size_t max_bytes);
+static void index_lru_set_limit(INDEX_LRU *lru, size_t max_bytes);
+static void index_lru_drop(CHANNEL_INDEX *index);
+static void index_lru_report(INDEX_LRU *lru);
+static SEGMENT_BLOCKS *segment_blocks_get(CHANNEL_INDEX *index, si4 segment);
+static void segment_blocks_release(CHANNEL_INDEX *index, SEGMENT_BLOCKS *blocks);
+static CHANNEL_INDEX *index_cache_load(si1 *cache_dir, si1 *channel_path);
+static void index_cache_submit(WORKER_POOL *pool, CHANNEL_INDEX *index, si1 *cache_dir, si1 *channel_path);
+static ui8 fnv1a_hash(si1 *text);
+static si4 segment_for_sample(CHANNEL_INDEX *index, si8 sample);
+static si8 block_for_sample(CHANNEL_INDEX *index, si4 segment, si8 sample);
+static void data_file_cache_init(DATA_FILE_CACHE *cache, si4 max_open);
+static void data_file_cache_set_limit(DATA_FILE_CACHE *cache, si4 max_open);
+static void data_file_cache_report(DATA_FILE_CACHE *cache);
+static DATA_FILE *data_file_get(CHANNEL_INDEX *index, si4 segment);
+static void data_file_release(CHANNEL_INDEX *index, DATA_FILE *data_file);
+static si8 data_file_read(DATA_FILE *data_file, void *buffer, si8 bytes, si8 offset);
+static void data_file_drop(CHANNEL_INDEX *index);
+static void io_queue_init(IO_QUEUE *queue, WORKER_POOL *decode_pool);
+static void io_queue_report(IO_QUEUE *queue);
+#ifndef _WIN32
+static void *io_plan_thread(void *argument);
+#else
+DWORD WINAPI io_plan_thread(LPVOID argument);
+#endif
+#ifdef USE_IO_URING
+static void *io_uring_completion_thread(void *argument);
 #endif
+static void io_batch_run(IO_QUEUE *queue, READ_TASK **tasks, si4 n_tasks);
+static void io_batch_finish(READ_TASK **tasks, si4 n_tasks);
+static IO_REQUEST *io_plan_find(IO_PLAN *plan, si4 segment, si8 offset, si8 bytes);
+static void io_plan_free(IO_PLAN *plan);
+static void read_task_gate(READ_TASK *read_task);
+static void read_task_ready(IO_QUEUE *queue, READ_TASK *read_task);
+static si4 read_task_cancelled(READ_TASK *read_task);
+static void pipeline_init(PIPELINE *pipeline, WORKER_POOL *pool, IO_QUEUE *io_queue, CONTROL_CHANNEL *control);
+static void pipeline_alloc(PIPELINE *pipeline, si4 num_chans, si4 max_batches);
+static void pipeline_free(PIPELINE *pipeline);
+static si4 pipeline_ready(PIPELINE *pipeline);
+static PAGE_BATCH *pipeline_start(PIPELINE *pipeline, THREAD_INFO *thread_info, MONTAGE *montage, RING_BUFFER *ring, sf8 page_start_sec,
+                                  si4 n_pages, si4 direction);
+static void pipeline_issue_reads(PIPELINE *pipeline);
+static PAGE_BATCH *pipeline_done(PIPELINE *pipeline);
+static void pipeline_retire(PIPELINE *pipeline);
+static void pipeline_cancel(PIPELINE *pipeline);
+static void pipeline_cancel_stale(PIPELINE *pipeline, sf8 first_sec, sf8 last_sec, sf8 secs_per_page, sf8 *first_sec_read, sf8 *last_sec_read);
+static si4 pyramid_zoom(READ_TASK *read_task, si8 num_samps);
+static si4 index_zoom(READ_TASK *read_task, si8 num_samps);
+static void decode_blocks(READ_TASK *read_task, si8 first_block, si8 last_block, si4 *raw, si8 num_samps, si8 start_time, sf8 samp_freq,
+                          WORKER_ARENA *arena);
+static void decode_split(READ_TASK *read_task, si8 first_block, si8 last_block, si4 *raw, si8 num_samps, si8 start_time, sf8 samp_freq,
+                         WORKER_ARENA *arena);
+static si8 upper_bound_si8(si8 *values, si8 lo, si8 hi, si8 key);
+static si4 index_envelope(THREAD_INFO *thread_info, si8 start_time, si8 end_time, sf4 *out, si4 out_stride);
+static void advise_will_need(MAPPED_FILE *mf, si8 offset, si8 bytes);
+static void block_cache_init(BLOCK_CACHE *cache, size_t max_bytes);
+static BLOCK_CACHE_ENTRY *block_cache_get(BLOCK_CACHE *cache, CHANNEL_INDEX *owner, si8 block);
+static si4 block_cache_contains(BLOCK_CACHE *cache, CHANNEL_INDEX *owner, si8 block);
+static BLOCK_CACHE_ENTRY *block_cache_put(BLOCK_CACHE *cache, CHANNEL_INDEX *owner, si8 block, si8 start_time, si4 *samples, si4 number_of_samples);
+static void block_cache_release(BLOCK_CACHE *cache, BLOCK_CACHE_ENTRY *entry);
+static si4 *block_cache_samples(BLOCK_CACHE *cache, si4 number_of_samples);
+static void block_cache_purge(BLOCK_CACHE *cache, CHANNEL_INDEX *owner);
+static void block_cache_report(BLOCK_CACHE *cache);
+static void place_block(si4 *raw, si8 num_samps, BLOCK_CACHE_ENTRY *entry, si8 page_start_time, sf8 samp_freq);
+static sf4 *page_row(sf4 *page_data, FIXED_INFO *fixed_info, si4 chan_idx);
+static void downsample_page(si4 *raw, si8 num_samps, sf8 out_samp_period, sf4 *row, FIXED_INFO *fixed_info, sf8 units_conversion_factor);
+static si4 batch_length(si4 direction, sf8 view_sec, sf8 first_sec, sf8 last_sec, sf8 secs_per_page, sf8 start_sec, sf8 end_sec, si4 max_pages);
+static void samples_for_uutc_sweep(CHANNEL_INDEX *index, si8 start_uutc, sf8 step_uutc, si4 n, si8 *samples);
+static void pyramid_schedule(WORKER_POOL *pool, THREAD_INFO *thread_info, si4 num_chans, si1 *cache_dir, sf8 curr_view_sec);
+static void pyramid_release(THREAD_INFO *thread_info, si4 num_chans);
+static si4 pyramid_envelope(THREAD_INFO *thread_info, si8 start_time, si8 end_time, sf4 *out, si4 out_stride);
+static void fill_si4_c(si4 *ptr, si4 value, si8 n);
+static void fill_sf4_c(sf4 *ptr, sf4 value, si8 n);
+static void min_max_c(si4 *raw, si8 n, si4 *min_val, si4 *max_val);
+static void interpolate_c(si4 *raw, si4 *idx, sf8 *frac, si4 n, sf4 *out, sf8 units_conversion_factor);
+static void simd_init(void);
+static void filter_design(CHANNEL_FILTER *filter, FIXED_INFO *fixed_info, sf8 samp_freq);
+static void filter_run(CHANNEL_FILTER *filter, si4 *raw, si8 num_samps, si8 start_time, si8 end_time, sf8 samp_freq, si4 keep_state);
+static void batch_to_pages(si4 *raw, si8 num_samps, sf8 samp_freq, sf8 page_start_sec, si4 n_pages, sf4 **page_data, si4 *page_served,
+                           FIXED_INFO *fixed_info, si4 row, sf8 units_conversion_factor);
+static si4 montage_parse_line(MONTAGE **montage_ptr, si1 *line, si4 num_chans);
+static void montage_setup(MONTAGE *montage, THREAD_INFO *thread_info, FIXED_INFO *fixed_info);
+static void montage_free(MONTAGE *montage);
+
+static SIMD_KERNELS simd = {fill_si4_c, fill_sf4_c, min_max_c, interpolate_c, "scalar"};
 
 
 void memset_int(si4 *ptr, si4 value, size_t num)
 {
-    si4 *temp_ptr;
-    int i;
-    
     if (num < 1)
         return;
     
-    temp_ptr = ptr;
-    for (i=0;i<num;i++)
-    {
-        memcpy(temp_ptr, &value, sizeof(si4));
-        temp_ptr++;
-    }
+    simd.fill_si4(ptr, value, (si8) num);
 }
 
 int check_block_crc(ui1* block_hdr_ptr, ui4 max_samps, ui1* total_data_ptr, ui8 total_data_bytes)
@@ -159,35 +838,47 @@ int main(int argc, const char *argv[])
 {
 	ui1		encryptionKey[240];
 
-	si4		i, j, k, l, fd, num_chans = 0, samps_per_page, tot_samps_per_page = 0, password_valid=0;
-    si1		data_path[1024], ps_path[1024], buff_lim_path[1024], cs_path[1024], temp_path[1024], server_info_path[1024], password_needed_path[1024], events_path[1024], discon_path[1024];
-	si1		b, *c1, *c2, *c3, *c4, *header, subject_password[16], session_password[16], password[16];
-    si1     events_file[1024];
-    sf8		secs_per_page, curr_view_sec, first_sec_written = 0.0L, last_sec_written = 0.0L;
-	sf8		fud = 0.0L, nfud = 0.0L, temp_sf8;
+	si4		i, j, k, l, fd, num_chans = 0, samps_per_page, password_valid=0;
+    si1		data_path[1024], temp_path[1024], server_info_path[1024], password_needed_path[1024], events_path[1024], discon_path[1024];
+	si1		*c2, *c3, *c4, *header, subject_password[16], session_password[16], password[16];
+    si1     events_file[1024], cache_dir[1024];
+    sf8		secs_per_page, curr_view_sec = 0.0L, first_sec_written = 0.0L, last_sec_written = 0.0L;
+	sf8		first_sec_read = 0.0L, last_sec_read = 0.0L;
+	sf8		fud = 0.0L, page_start_sec, session_start_sec = 0.0L, session_end_sec = 0.0L;
+	si4		direction, n_batch, max_batch = 1;
+	sf8		max_fs;
 	ui8		flen, last_heartbeat;
-	FILE	*cs_fp, *ps_fp, *t_fp, *o_fp, *bl_fp, *si_fp;
+	si4		new_specs = 0, quit, drain = 0, same_channels;
+	si1		*specs_text = NULL;
+	PAGE_SPECS	specs;
+	CONTROL_CHANNEL	control;
 	struct	stat	sb;
 	FIXED_INFO	fixed_info;
 	THREAD_INFO	*thread_info = NULL;
+	OPEN_TASK	*open_tasks = NULL;
+	FIRST_PAGE	first_page;
+	si4		display_order[2048], ready_rows[2048];
+	MONTAGE		*montage = NULL;
+	MONTAGE_TASK	*montage_tasks = NULL;
+	si4		n_rows, n_montage_tasks = 0;
+	sf8		montage_fs;
+	WORKER_POOL	pool;
+	RING_BUFFER	ring;
+	BLOCK_CACHE	block_cache;
+	INDEX_LRU	index_lru;
+	DATA_FILE_CACHE	file_cache;
+	IO_QUEUE	io_queue;
+	PIPELINE	pipeline;
+	PAGE_BATCH	*batch;
     si1  page_dir[4096];
 #ifndef _WIN32
-    THREAD_INFO *heartbeat_thread_id = NULL;
-	pthread_t	*thread_ids = NULL;
+    pthread_t control_thread_id;
 #else
-    HANDLE thread_ids[2000];
     DWORD ThreadId;
-    DWORD ThreadId2;
 #endif
-	void		*ret_val;
-#ifndef _WIN32
-	struct		itimerval rf_timer;
-#endif
-    CHANNEL *channel;
     si1  f_name_temp[2048][256];
-    CHANNEL *temp_channel_array[2048];
+    CHANNEL_INDEX *temp_index_array[2048];
     si4 old_num_chans;
-    int counter;
     fprintf(stderr, "args: %d\n", argc);
     // set up mef 3 library
     (void) initialize_meflib();
@@ -198,6 +889,7 @@ int main(int argc, const char *argv[])
     
     // get password, if it exists
     fixed_info.password = NULL;
+    fixed_info.montage = NULL;
     fprintf(stderr, "args: %d\n", argc);
     if (argc > 2)
     {
@@ -206,44 +898,51 @@ int main(int argc, const char *argv[])
 
 	// set up paths
 	{
-		sprintf(ps_path, "%s/page_specs", page_dir);
-		sprintf(temp_path, "%s/page_data", page_dir);
-		sprintf(cs_path, "%s/current_sec", page_dir);
-		sprintf(buff_lim_path, "%s/buffer_limits", page_dir);
         sprintf(server_info_path, "%s/server_info", page_dir);
         sprintf(password_needed_path, "%s/password_needed", page_dir);
         sprintf(events_path, "%s/events", page_dir);
         sprintf(discon_path, "%s/discon", page_dir);
-#ifndef _WIN32
-		while ((o_fp = fopen(temp_path, "w+")) == NULL) usleep((useconds_t) 100000);
-#else
-        while ((o_fp = fopen(temp_path, "wb+")) == NULL) Sleep(100);
-#endif
-		fixed_info.page_data = NULL;
+		// pages are handed to the UI through a memory-mapped ring buffer
+		ring_init(&ring, page_dir);
 	}
     
+    // commands (seek, page specs, heartbeat, quit) arrive from the UI on stdin
+    control_init(&control);
 #ifndef _WIN32
-    heartbeat_thread_id = (pthread_t *) calloc((size_t) 1, sizeof(pthread_t));
-    pthread_create(heartbeat_thread_id, NULL, heartbeat_thread, (void*)(page_dir));
+    pthread_create(&control_thread_id, NULL, control_thread, (void *) &control);
 #else
-    CreateThread(NULL, 0, heartbeat_thread, (void*)page_dir, 0, &ThreadId2);
+    CreateThread(NULL, 0, control_thread, (void*) &control, 0, &ThreadId);
 #endif
 
-
-	
+    // worker threads are created once and reused for channel opens and page reads
+    simd_init();
+    pool_init(&pool, get_num_cores());
+    io_queue_init(&io_queue, &pool);
+    pipeline_init(&pipeline, &pool, &io_queue, &control);
+    
+    // channels report in here as they open (see channel_open_thread())
+    memset(&first_page, 0, sizeof(FIRST_PAGE));
+    first_page.ring = &ring;
+    first_page.ready = ready_rows;
+    first_page.server_info_path = server_info_path;
 #ifndef _WIN32
-	// set up read_files timer
-	{
-		signal(SIGALRM, set_rf_flag);
-		rf_timer.it_value.tv_sec     = 0;
-		rf_timer.it_value.tv_usec    = READ_INTERVAL; 
-		rf_timer.it_interval.tv_sec  = 0;
-		rf_timer.it_interval.tv_usec = READ_INTERVAL;
-		setitimer (ITIMER_REAL, &rf_timer, NULL);
-	}
+    pthread_mutex_init(&first_page.lock, NULL);
 #else
-	CreateThread(NULL, 0, set_rf_flag, (void*)NULL, 0, &ThreadId);
+    InitializeCriticalSection(&first_page.lock);
 #endif
+    
+    // decoded blocks are kept for reuse by neighboring and revisited pages
+    block_cache_init(&block_cache, BLOCK_CACHE_BYTES);
+    fixed_info.block_cache = &block_cache;
+    
+    // segment block indices are loaded as reads need them, within a memory ceiling shared by all channels
+    index_lru_init(&index_lru, INDEX_MEMORY_BYTES);
+    fixed_info.index_lru = &index_lru;
+    
+    // and segment data files are kept open for the reads that follow, up to a limit shared by all channels
+    data_file_cache_init(&file_cache, DATA_FILES_OPEN);
+    fixed_info.file_cache = &file_cache;
+
 	
 	//set up passwords and decryption key 
 	{
@@ -253,185 +952,293 @@ int main(int argc, const char *argv[])
 	}
 
 	last_heartbeat = time(NULL) + 10000;
+	cache_dir[0] = 0;
+	fixed_info.cache_dir = cache_dir;
     
     for (i=0;i<2048;i++)
-        temp_channel_array[i] = NULL;
+    {
+        temp_index_array[i] = NULL;
+    }
 
 	// server loop
 	while (1) {
-		// time to read
-		if (read_files_flag) {
-			// check current sec file
+		// Sleep until the UI sends a command, a batch in the pipeline is ready for its next stage, or there is another
+		// page to read around the view (and room in the pipeline for it).  While draining, only the pipeline matters.
+		{
+			control_lock(&control);
+			while ((control.seek_pending == 0) && (control.specs_pending == 0) && (control.quit == 0) && !pipeline_ready(&pipeline) &&
+				   !(drain && (pipeline.count == 0)) &&
+				   (drain || (thread_info == NULL) || (pipeline.count == pipeline.max_batches) ||
+				    (next_page_direction(curr_view_sec, first_sec_read, last_sec_read, secs_per_page, session_start_sec, session_end_sec) == 0))) {
+				// nothing to do; wake up now and then to keep the heartbeat in the ring header current
+				if (!control_wait(&control, HEARTBEAT_INTERVAL))
+					last_heartbeat = update_buffer_limits(&ring, first_sec_written, last_sec_written);
+				if (!drain && (time(NULL) - control.last_ui_heartbeat > UI_HEARTBEAT_TIMEOUT))
+					break;
+			}
+			curr_view_sec = control.curr_view_sec;
+			control.seek_pending = 0;
+			if (control.specs_pending) {
+				if (specs_text != NULL)
+					free(specs_text);
+				specs_text = control.page_specs;
+				control.page_specs = NULL;
+				control.specs_pending = 0;
+				new_specs = 1;
+			}
+			quit = control.quit;
+			// the UI stopped sending heartbeats, so assume it is gone
+			if (time(NULL) - control.last_ui_heartbeat > UI_HEARTBEAT_TIMEOUT)
+				quit = 1;
+			control_unlock(&control);
+		}
+		drain = 0;
+		
+		// a stream of commands keeps the wait above from timing out, so keep the heartbeat current here too
+		if ((si8) (time(NULL) - last_heartbeat) > HEARTBEAT_INTERVAL)
+			last_heartbeat = update_buffer_limits(&ring, first_sec_written, last_sec_written);
+		
+		// Batches in flight go on to their next stage: their reads are issued once all their runs are found, and their
+		// pages are published, oldest first, as soon as all their channels have been decoded.  Cancelled batches are
+		// just retired.
+		pipeline_issue_reads(&pipeline);
+		while ((batch = pipeline_done(&pipeline)) != NULL) {
+			if (batch->cancelled) {
+				pipeline_retire(&pipeline);
+				continue;
+			}
+			// With a montage the channels have only been decoded.  The group means come next, then the traces, which
+			// are what go into the pages.  (A montage has one batch in flight at a time, see pipeline_alloc().)
+			if (montage != NULL) {
+				for (i = 0; i < n_montage_tasks; ++i) {
+					montage_tasks[i].montage = montage;
+					montage_tasks[i].thread_info = thread_info;
+					montage_tasks[i].index = (i < montage->n_groups) ? i : (i - montage->n_groups);
+					montage_tasks[i].page_start_sec = batch->page_start_sec;
+					montage_tasks[i].n_pages = batch->n_pages;
+					montage_tasks[i].direction = batch->direction;
+					for (j = 0; j < batch->n_pages; ++j)
+						montage_tasks[i].page_data[j] = ring_slot(&ring, batch->page_start_sec + (j * secs_per_page));
+				}
+				for (i = 0; i < montage->n_groups; ++i)
+					pool_submit(&pool, montage_group_thread, (void *) (montage_tasks + i));
+				pool_wait(&pool);
+				for (i = montage->n_groups; i < n_montage_tasks; ++i)
+					pool_submit(&pool, montage_trace_thread, (void *) (montage_tasks + i));
+				pool_wait(&pool);
+			}
+			
+			// each batch adds its pages (of all requested channels) to one end of the ring
+			if (batch->direction > 0)
+				last_sec_written = batch->page_start_sec + ((batch->n_pages - 1) * secs_per_page);
+			else
+				first_sec_written = batch->page_start_sec;
+			last_heartbeat = update_buffer_limits(&ring, first_sec_written, last_sec_written);
+			pipeline_retire(&pipeline);
+		}
+		
+		// Quitting, a jump, new page specs, and pages giving up their ring slots all wait until every batch in flight
+		// has been retired (drain), since the batches' tasks use the channels and write into the slots.  All but the
+		// last discard the batches, so those are cancelled first, and the wait is only for the tasks already running.
+		if (quit) {
+			if (pipeline.count > 0) {
+				pipeline_cancel(&pipeline);
+				drain = 1;
+				continue;
+			}
+			break;
+		}
+		
+		{
+			// check current sec
 			{
-#ifndef _WIN32
-				while ((cs_fp = fopen(cs_path, "r")) == NULL) usleep((useconds_t) 100000);
-#else
-				while ((cs_fp = fopen(cs_path, "rb")) == NULL) Sleep(100);
-#endif
-				fscanf(cs_fp, "%lf\n", &curr_view_sec);
-				fclose(cs_fp);
 				if (DBUG) printf("curr_view_sec %lf\n", curr_view_sec);
-#ifndef _WIN32
-				if (DBUG) printf("hb interval %ld\n", time(NULL) - last_heartbeat);
-#else
-                if (DBUG) printf("hb interval %lld\n", time(NULL) - last_heartbeat);
-#endif
-				
-				if (time(NULL) - (si8)last_heartbeat > HEARTBEAT_INTERVAL) {
-                    if (check_fud(ps_path, nfud)) 
-                        read_files_flag = 1;
-                    else
-                        last_heartbeat = update_buffer_limits(buff_lim_path, first_sec_written, last_sec_written);
-				}
 
-				if (curr_view_sec < 0.0L)  // exit flag
-					break;
-				if ((curr_view_sec > last_sec_written) || (curr_view_sec < first_sec_written)) {
+				// The buffered pages grow outward from the view in both directions, so a view that moved by up to a page
+				// past either end is reached by extending the buffer.  Anything further is a jump, and starts over.
+				if ((curr_view_sec < 0.0L) || (curr_view_sec > (last_sec_read + secs_per_page)) || (curr_view_sec < (first_sec_read - secs_per_page))) {
+					if (pipeline.count > 0) {
+						pipeline_cancel(&pipeline);
+						drain = 1;
+						continue;
+					}
+					if (curr_view_sec < 0.0L)  // exit flag
+						break;
 					first_sec_written = curr_view_sec;
-					// last_sec_written keeps track of what data we've written so far.  It will grow by secs_per_page on
-					// each iteration of the endless loop, until the buffer is filled.  It starts out lower than first_sec_written,
-					// because later this iteration it will be incremented by secs_per_page, making it equal to first_sec_written.
-					// Each iteration after that it will be greater.
+					// [first_sec_written, last_sec_written] are the starts of the first and last pages written so far.
+					// last_sec_written starts out lower than first_sec_written (nothing written); the first page
+					// written will be the one at first_sec_written.  [first_sec_read, last_sec_read] also take in the
+					// pages of the batches in flight.
 					last_sec_written = first_sec_written - secs_per_page;
-					rewind(o_fp);
+					first_sec_read = first_sec_written;
+					last_sec_read = last_sec_written;
+					ring_reset(&ring, first_sec_written);
 				}
 				fixed_info.curr_view_sec = curr_view_sec;
+				
+				// read-ahead that the view has moved away from gives way to the pages around the view
+				pipeline_cancel_stale(&pipeline, curr_view_sec - ((N_PAGES_BEHIND + 1) * secs_per_page), curr_view_sec + ((N_PAGES_AHEAD + 1) * secs_per_page),
+									  secs_per_page, &first_sec_read, &last_sec_read);
 			}
             
 			// check for new page specs
 			{
-            start_over:
-#ifndef _WIN32
-				while ((ps_fp = fopen(ps_path, "r")) == NULL) usleep((useconds_t) 100000); //page_specs file
-#else
-				while ((ps_fp = fopen(ps_path, "r")) == NULL) Sleep(100); //page_specs file
-#endif
-                fscanf(ps_fp, "%lf\n", &fud); //fud = random fp number, tells if file was rewritten. No meaning beyond that
-				if (fud != nfud) {
-					nfud = fud;
+				if (new_specs && (pipeline.count > 0)) {
+					pipeline_cancel(&pipeline);
+					drain = 1;
+					continue;
+				}
+				if (new_specs) {  // (the batches cancelled above were never written, even if the specs turn out bad)
+					first_sec_read = first_sec_written;
+					last_sec_read = last_sec_written;
+				}
+				if (new_specs && parse_page_specs(specs_text, &specs, f_name_temp)) {
+                    fud = specs.fud; //fud = random fp number, identifies these page specs to the UI. No meaning beyond that
                     
                     
                     // check for new file list (if  file list is the same, then no need to reload MEF files
                     // (unless you care about real-time data, ie. ever-growing data files
                     
-                    // read base data folder
-                    {
-                        c1 = data_path;
-                        while ((b = (si1) fgetc(ps_fp)) != '\n')
-                            *c1++ = b;
-                        *c1 = 0;
-                    }
+                    // A window resize or a zoom only changes the page geometry (or the montage changes, over the same
+                    // channels).  The channels then stay open, with their block indices, decoded blocks and pyramids, and
+                    // only the pages are made again, starting at the view.
+                    same_channels = (thread_info != NULL) && (specs.num_chans == num_chans) && !strcmp(specs.data_path, data_path) &&
+                                    !strcmp(specs.password, password) && !strcmp(specs.events_file, events_file) && !strcmp(specs.cache_dir, cache_dir) &&
+                                    (specs.display_mode == fixed_info.display_mode) && (specs.highpass_hz == fixed_info.highpass_hz) &&
+                                    (specs.lowpass_hz == fixed_info.lowpass_hz) && (specs.notch_hz == fixed_info.notch_hz);
+                    for (i = 0; same_channels && (i < num_chans); ++i)
+                        same_channels = !strcmp(f_name_temp[i], thread_info[i].f_name);
+                    
+                    // base data folder
+                    strcpy(data_path, specs.data_path);
                     
                     old_num_chans = num_chans;
                     
-                    // read number of channels
+                    // number of channels
                     {
-                        fscanf(ps_fp, "%d\n", &num_chans);
+                        num_chans = specs.num_chans;
                         fixed_info.num_chans = num_chans;
                         if (DBUG) printf("num_chans %d\n", num_chans);
                     }
                     
-                    
-                    // read file names
-                    {
-                        for (i = 0; i < num_chans; ++i) {
-                            c1 = f_name_temp[i];
-                            counter = 0;
-                            while ((b = (si1) fgetc(ps_fp)) != '\n')
-                            {
-                                //if (b == '\r')
-                                //    break;
-                                *c1++ = b;
-                                // check if something went wrong
-                                if (counter >= 254)
+					// clean up for new data (the channels only if they are changing)
+					{
+						if (!same_channels) {
+							// stop building pyramids for the old channels before they go away
+							pyramid_generation++;
+							pool_wait_background(&pool);
+							pyramid_release(thread_info, old_num_chans);
+							if (DBUG) block_cache_report(&block_cache);
+							for (i = 0; i < old_num_chans; ++i) {
+								// free(thread_info[i].index_array);
+								// fclose(thread_info[i].d_fp);
+                                if (!strcmp(f_name_temp[i],thread_info[i].f_name))
                                 {
-                                    fclose(ps_fp);
-                                    goto start_over;
+                                    temp_index_array[i] = thread_info[i].index;
                                 }
-                            }
-                            *c1 = 0;
-
-                        }
-                    }
-                    
-					// clean up for new data
-					{
-						for (i = 0; i < old_num_chans; ++i) {
-							// free(thread_info[i].index_array);
-							// fclose(thread_info[i].d_fp);
-                            if (!strcmp(f_name_temp[i],thread_info[i].f_name))
-                            {
-                                temp_channel_array[i] = thread_info[i].channel;
-                            }
-                            else
-                            {
-                                if (thread_info[i].channel->number_of_segments > 0)
-                                    thread_info[i].channel->segments[0].metadata_fps->directives.free_password_data = MEF_TRUE;
-                                free_channel(thread_info[i].channel, MEF_TRUE);
-                                temp_channel_array[i] = NULL;
-                            }
+                                else
+                                {
+                                    block_cache_purge(&block_cache, thread_info[i].index);
+                                    free_channel_index(thread_info[i].index);
+                                    temp_index_array[i] = NULL;
+                                }
+                                if (thread_info[i].source_raw != NULL)
+                                    free(thread_info[i].source_raw);
+							}
+                            if (thread_info != NULL)
+							    free(thread_info);
+                            pipeline_free(&pipeline);
+                            if (open_tasks != NULL)
+                                free(open_tasks);
 						}
-                        if (fixed_info.page_data != NULL)
-						    free(fixed_info.page_data);
-                        if (thread_info != NULL)
-						    free(thread_info);
-#ifndef _WIN32
-						free(thread_ids);
-#endif
-						rewind(o_fp);
+                        // the new specs' montage, if any, replaces the old one (it is set up once the channels are open)
+                        montage_free(montage);
+                        montage = fixed_info.montage = specs.montage;
+                        specs.montage = NULL;
+                        if (montage_tasks != NULL)
+                            free(montage_tasks);
+                        montage_tasks = NULL;
+                        n_montage_tasks = 0;
+                        if (montage != NULL) {
+                            n_montage_tasks = montage->n_groups + montage->n_traces;
+                            montage_tasks = (MONTAGE_TASK *) calloc((size_t) n_montage_tasks, sizeof(MONTAGE_TASK));
+                        }
 						if (DBUG) printf("rewind\n");
 						fixed_info.curr_view_sec = first_sec_written = curr_view_sec;
 						//last_sec_written = first_sec_written - secs_per_page;
 					}
 
+					// samples / secs per page (per channel)
+					{
+						samps_per_page = specs.samps_per_page;
+						secs_per_page = specs.secs_per_page;
+
+						fixed_info.samps_per_page = samps_per_page;
+						fixed_info.secs_per_page = secs_per_page;
+						fixed_info.display_mode = specs.display_mode;
+						fixed_info.samp_values = (specs.display_mode == DISPLAY_ENVELOPE) ? 2 : 1;
+						fixed_info.highpass_hz = specs.highpass_hz;
+						fixed_info.lowpass_hz = specs.lowpass_hz;
+						fixed_info.notch_hz = specs.notch_hz;
+						// one row per channel, or per montage trace
+						n_rows = (montage != NULL) ? montage->n_traces : num_chans;
+						last_sec_written = first_sec_written - secs_per_page;
+						ring_set_layout(&ring, n_rows, samps_per_page, fixed_info.samp_values, secs_per_page, fud, first_sec_written);
+						strcpy(password, specs.password);
+						if (DBUG) printf("pwd %s\n", password);
+                        strcpy(events_file, specs.events_file);
+                        strcpy(cache_dir, specs.cache_dir);
+                        index_lru_set_limit(&index_lru, (size_t) specs.index_memory_bytes);
+                        data_file_cache_set_limit(&file_cache, specs.open_files);
+
+						if (DBUG) printf("Last sec written %lf\n", last_sec_written);
+					}
+
 					// allocate new threads
 					{
-						thread_info = (THREAD_INFO *) calloc((size_t) num_chans, sizeof(THREAD_INFO));
-#ifndef _WIN32
-						thread_ids = (pthread_t *) calloc((size_t) num_chans, sizeof(pthread_t));
-#endif
-						for (i = 0; i < num_chans; ++i) {
-							thread_info[i].chan_idx = i;
-							thread_info[i].fixed_info = &fixed_info;
+						if (!same_channels) {
+							thread_info = (THREAD_INFO *) calloc((size_t) num_chans, sizeof(THREAD_INFO));
+							open_tasks = (OPEN_TASK *) calloc((size_t) num_chans, sizeof(OPEN_TASK));
+							for (i = 0; i < num_chans; ++i) {
+								thread_info[i].chan_idx = i;
+								thread_info[i].fixed_info = &fixed_info;
+							}
 						}
+						// (a montage's batches are combined into traces one at a time, in the channels' source_raw)
+						pipeline_alloc(&pipeline, num_chans, (montage != NULL) ? 1 : PIPELINE_BATCHES);
 					}
 		
 					// open_files
-                    // TBD make it threaded to speed it up
-					{
+                    // Channels that are already open are reused, the rest are opened on the worker pool.  Each channel reads
+                    // the page at the view as soon as it is open, so the UI can draw the channels that are ready while the
+                    // slowest ones are still opening.  (Not with a montage, whose traces need all their channels.)
+					if (!same_channels) {
+						first_page.thread_info = thread_info;
+						first_page.num_chans = num_chans;
+						first_page.enabled = (montage == NULL);
+						first_page.open_tasks = open_tasks;
+						first_page.view_sec = curr_view_sec;  // 0: not known until every channel is open
+						first_page.n_open = first_page.n_ready = 0;
+						if (first_page.enabled)
+							simd.fill_sf4(ring_slot(&ring, first_sec_written), (sf4) NAN, (si8) ring.slot_samps);
 						for (i = 0; i < num_chans; ++i) {
 							sprintf(temp_path, "%s%s", data_path, thread_info[i].f_name);
 							//thread_info[i].d_fp = fopen(temp_path, "r");
                             strcpy(thread_info[i].f_name, f_name_temp[i]);
-                            if (temp_channel_array[i] == NULL)
-                            {
-#ifndef _WIN32
-                                pthread_create(thread_ids + i, NULL, get_mef_channel_thread, (void *) (thread_info + i));
-#else
- 								thread_ids[i] = CreateThread(NULL, 0, get_mef_channel_thread, (void*) (thread_info + i), 0, &ThreadId);
-
-#endif
-                            }
-                            else
+                            if (temp_index_array[i] != NULL)
                             {
-#ifndef _WIN32
-                                pthread_create(thread_ids + i, NULL, do_nothing_thread, (void *) (thread_info + i));
-#else
-								thread_ids[i] = CreateThread(NULL, 0, do_nothing_thread, (void*)(thread_info + i), 0, &ThreadId);
-
-#endif
-                                thread_info[i].channel = temp_channel_array[i];
+                                thread_info[i].index = temp_index_array[i];
                             }
+                            open_tasks[i].thread_info = thread_info + i;
+                            open_tasks[i].first_page = &first_page;
+                            open_tasks[i].pool = &pool;
+                            pool_submit(&pool, channel_open_thread, (void *) (open_tasks + i));
 						}
+                        pool_wait(&pool);
                         for (i=0;i<num_chans;i++)
                         {
-#ifndef _WIN32
-                            pthread_join(thread_ids[i], &ret_val);
-#else
- 							WaitForSingleObject(thread_ids[i], INFINITE);
-#endif
                             fprintf(stderr, "%s\n", thread_info[i].f_name);
-                            fprintf(stderr, "Segments in file: %d\n", thread_info[i].channel->number_of_segments);
+                            fprintf(stderr, "Segments in file: %d\n", thread_info[i].index->n_segments);
                         }
                         
 					}
@@ -444,36 +1251,17 @@ int main(int argc, const char *argv[])
                         exit(1);
                     }
                     
-                    // re-order channels based on channel num
-                    {
-                        THREAD_INFO temp_info;
-                        int did_swap;
+                    // order channels by channel number for the UI; the ring rows stay in page specs order
+                    if (!same_channels) {
+                        si4 key;
                         
-                        while (1)
+                        for (i=0;i<num_chans;i++)
                         {
-                            did_swap = 0;
-                            for (i=0;i<num_chans-1;i++)
-                            {
-                                for (j=i+1;j<num_chans;j++)
-                                {
-                                    int do_swap = 0;
-                                    if (thread_info[i].channel->metadata.time_series_section_2->acquisition_channel_number > thread_info[j].channel->metadata.time_series_section_2->acquisition_channel_number)
-                                        do_swap = 1;
-                                    
-                                    if (do_swap == 1)
-                                    {
-                                        did_swap = 1;
-                                        memcpy(&temp_info, &thread_info[i], sizeof(THREAD_INFO));
-                                        memcpy(&thread_info[i], &thread_info[j], sizeof(THREAD_INFO));
-                                        memcpy(&thread_info[j], &temp_info, sizeof(THREAD_INFO));
-                                        thread_info[i].chan_idx = i;
-                                        thread_info[j].chan_idx = j;
-                                        
-                                    }
-                                }
-                            }
-                            if (did_swap == 0)
-                                break;
+                            key = i;
+                            for (j=i;(j>0) && (thread_info[display_order[j-1]].index->acquisition_channel_number >
+                                               thread_info[key].index->acquisition_channel_number);j--)
+                                display_order[j] = display_order[j-1];
+                            display_order[j] = key;
                         }
                         
                         fixed_info.session_start_time = -1;
@@ -481,67 +1269,44 @@ int main(int argc, const char *argv[])
                         for (i=0;i<num_chans;i++)
                         {
                             if (fixed_info.session_start_time == -1)
-                                fixed_info.session_start_time = thread_info[i].channel->earliest_start_time;
-                            if (thread_info[i].channel->earliest_start_time < fixed_info.session_start_time)
-                                fixed_info.session_start_time = thread_info[i].channel->earliest_start_time;
+                                fixed_info.session_start_time = thread_info[i].index->earliest_start_time;
+                            if (thread_info[i].index->earliest_start_time < fixed_info.session_start_time)
+                                fixed_info.session_start_time = thread_info[i].index->earliest_start_time;
                             
                             if (fixed_info.session_end_time == -1)
-                                fixed_info.session_end_time = thread_info[i].channel->latest_end_time;
-                            if (thread_info[i].channel->latest_end_time > fixed_info.session_end_time)
-                                fixed_info.session_end_time = thread_info[i].channel->latest_end_time;
+                                fixed_info.session_end_time = thread_info[i].index->latest_end_time;
+                            if (thread_info[i].index->latest_end_time > fixed_info.session_end_time)
+                                fixed_info.session_end_time = thread_info[i].index->latest_end_time;
                         }
                         
-                        if (curr_view_sec == 0)
+                        session_start_sec = fixed_info.session_start_time / 1000000.0;
+                        session_end_sec = fixed_info.session_end_time / 1000000.0;
+                        
+                        if (first_page.enabled)
+                        {
+                            // the page at the view has been read for every channel
+                            curr_view_sec = fixed_info.curr_view_sec = first_sec_written = last_sec_written = first_page.view_sec;
+                        }
+                        else if (curr_view_sec == 0)
+                        {
                             curr_view_sec = fixed_info.curr_view_sec = fixed_info.session_start_time / 1000000.0;
+                        }
+                        if (first_page.view_sec == 0)
+                            first_page.view_sec = curr_view_sec;
+                        // keep the view unless the UI has seeked in the meantime
+                        control_lock(&control);
+                        if (control.seek_pending == 0)
+                            control.curr_view_sec = curr_view_sec;
+                        control_unlock(&control);
                       
                         
                         // update server_info file
-#ifndef _WIN32
-                        while ((si_fp = fopen(server_info_path, "w")) == NULL) usleep((useconds_t) 100000);
-#else
-                        while ((si_fp = fopen(server_info_path, "wb")) == NULL) Sleep(100);
-#endif
-                        fprintf(si_fp, "%d\n", num_chans);
-                        for (i=0;i<num_chans;i++)
-                        {
-                            fprintf(si_fp, "%s ", thread_info[i].f_name);
-#ifndef _WIN32
-                            fprintf(si_fp, "%ld %ld ", thread_info[i].channel->earliest_start_time, thread_info[i].channel->latest_end_time);
-#else
-                            fprintf(si_fp, "%lld %lld ", thread_info[i].channel->earliest_start_time, thread_info[i].channel->latest_end_time);
-#endif
-#ifndef _WIN32
-                            fprintf(si_fp, "%ld ", thread_info[i].channel->metadata.time_series_section_2->acquisition_channel_number);
-#else
-                            fprintf(si_fp, "%lld ", thread_info[i].channel->metadata.time_series_section_2->acquisition_channel_number);
-#endif
-                            fprintf(si_fp, "%f\n", thread_info[i].channel->metadata.time_series_section_2->units_conversion_factor);
-                        }
-                        fprintf(si_fp, "%d\n", num_chans);
-                        fclose(si_fp);
+                        write_server_info(server_info_path, thread_info, display_order, num_chans, num_chans, first_page.view_sec, 1);
                     }
                     
                     
-					// read samples / secs per page (per channel)
-					{
-						fscanf(ps_fp, "%d\n", &samps_per_page);
-						fscanf(ps_fp, "%lf\n", &secs_per_page);
-
-						fixed_info.samps_per_page = samps_per_page;
-						fixed_info.secs_per_page = secs_per_page;
-						tot_samps_per_page = num_chans * samps_per_page;
-						fixed_info.page_data = (sf4 *) calloc((size_t) tot_samps_per_page, sizeof(sf4));
-						last_sec_written = first_sec_written - secs_per_page;
-						fscanf(ps_fp, "%s\n", password);
-						if (DBUG) printf("pwd %s\n", password);
-                        fscanf(ps_fp, "%s\n", events_file);
-
-						if (DBUG) printf("Last sec written %lf\n", last_sec_written);
-					}
-                    
-                    
                     // read events files, if they exist
-                    {
+                    if (!same_channels) {
                         si1        name[MEF_BASE_FILE_NAME_BYTES];
                         si1        events_ridx[1024];
                         si1        events_rdat[1024];
@@ -627,24 +1392,28 @@ int main(int argc, const char *argv[])
                     // be presented to the user
                     //
                     // Use first channel to be representative of the whole session
-                    {
-                        CHANNEL *channel;
-                        si8 n_segments;
-                        int i,j;
+                    if (!same_channels) {
+                        CHANNEL_INDEX *index;
+                        SEGMENT_BLOCKS *blocks;
+                        si8 j;
+                        si4 s;
                         si8 end_of_previous_block;
                         si8 block_start_time;
                         FILE    *discon_out;
                         
-                        channel = thread_info[0].channel;
+                        index = thread_info[display_order[0]].index;
                         end_of_previous_block = -1;
-                        n_segments = channel->number_of_segments;
                         discon_out = fopen(discon_path, "w");
                         
-                        for (i = 0; i < n_segments; ++i)
+                        // (a segment at a time, each released for the memory ceiling to reclaim)
+                        for (s = 0; s < index->n_segments; s++)
                         {
-                            for (j = 0; j < channel->segments[i].metadata_fps->metadata.time_series_section_2->number_of_blocks; j++)
+                            blocks = segment_blocks_get(index, s);
+                            if (blocks == NULL)
+                                continue;
+                            for (j = 0; j < blocks->n_blocks; j++)
                             {
-                                block_start_time = channel->segments[i].time_series_indices_fps->time_series_indices[j].start_time;
+                                block_start_time = blocks->start_time[j];
                                 remove_recording_time_offset( &block_start_time);
                                 
                                 if (end_of_previous_block != -1)
@@ -661,9 +1430,9 @@ int main(int argc, const char *argv[])
                                 }
                                 
                                 end_of_previous_block = block_start_time +
-                                    (channel->segments[i].time_series_indices_fps->time_series_indices[j].number_of_samples *
-                                     (1000000.0 / channel->metadata.time_series_section_2->sampling_frequency));
+                                    (blocks->samples[j] * (1000000.0 / index->sampling_frequency));
                             }
+                            segment_blocks_release(index, blocks);
                         }
                             
                         fclose(discon_out);
@@ -671,83 +1440,132 @@ int main(int argc, const char *argv[])
                     
                     // set thread-specific variables
                     {
+                        max_fs = 0.0;
                         for (i = 0; i < num_chans; ++i)
                         {
-                            thread_info[i].native_fs = thread_info[i].channel->metadata.time_series_section_2->sampling_frequency;
+                            // (native_fs and the filter were set up by channel_open_thread())
+                            if (thread_info[i].native_fs > max_fs)
+                                max_fs = thread_info[i].native_fs;
                         }
-                    }
+                        
+                        // pages per read, within the per-channel sample limit
+                        max_batch = READ_BATCH_PAGES;
+                        if ((max_fs * secs_per_page * max_batch) > READ_BATCH_MAX_SAMPS)
+                            max_batch = (si4) (READ_BATCH_MAX_SAMPS / (max_fs * secs_per_page));
+                        
+                        // with a montage, every source channel's samples for the batch are held at once
+                        if (montage != NULL) {
+                            montage_setup(montage, thread_info, &fixed_info);
+                            montage_fs = 0.0;
+                            for (i = 0; i < num_chans; ++i) {
+                                if (montage->channel_used[i])
+                                    montage_fs += thread_info[i].native_fs;
+                            }
+                            if ((montage_fs * secs_per_page * max_batch * sizeof(si4)) > MONTAGE_MAX_BATCH_BYTES)
+                                max_batch = (si4) (MONTAGE_MAX_BATCH_BYTES / (montage_fs * secs_per_page * sizeof(si4)));
+                        }
+                        if (max_batch < 1)
+                            max_batch = 1;
+                    }
+                    
+                    // find or build the min/max pyramids for zoomed-out envelope pages, in the background
+                    // (the same channels' pyramids are kept, and any still being built go on)
+                    if (!same_channels && (fixed_info.display_mode == DISPLAY_ENVELOPE) && (cache_dir[0] != 0))
+                        pyramid_schedule(&pool, thread_info, num_chans, cache_dir, curr_view_sec);
                     
+                    first_sec_read = first_sec_written;
+                    last_sec_read = last_sec_written;
                 }
-                //printf("fclose\n");
-                fclose(ps_fp);
-                read_files_flag = 0;
+                new_specs = 0;
             }
         }
         
-        // if N_PAGES_AHEAD number of pages have been buffered, then we're done reading (for now).
-        // However, read_files_flag is still be set to 1 periodically, via the timer.
-        if ((last_sec_written - curr_view_sec) >= (N_PAGES_AHEAD * secs_per_page)) {
-#ifndef _WIN32
-            usleep((useconds_t)250000);
-#else
-			Sleep(250);
-#endif
+        // if the pages around the view have been buffered, or are being read, then we're done starting reads (for now).
+        // The wait at the top of the loop sleeps until the UI moves the view or sends new page specs, or a batch moves on.
+        direction = next_page_direction(curr_view_sec, first_sec_read, last_sec_read, secs_per_page, session_start_sec, session_end_sec);
+        if ((thread_info == NULL) || (direction == 0) || (pipeline.count == pipeline.max_batches))
             continue;
-        }
 
-        // thread out the reads (page wise)
-        if (DBUG) printf("thread out reads\n");
-        fixed_info.page_to_write_start_sec = last_sec_written + secs_per_page;
+        // One task per channel.  Once the view itself is buffered (or being read), several consecutive pages are read
+        // per task, so each channel's data is read and decoded in one sequential pass.
+        if (DBUG) printf("queue reads\n");
+        if ((curr_view_sec < first_sec_read) || (curr_view_sec > last_sec_read))
+            n_batch = 1;
+        else
+            n_batch = batch_length(direction, curr_view_sec, first_sec_read, last_sec_read, secs_per_page, session_start_sec, session_end_sec, max_batch);
         
-        for (i = 0; i < num_chans; ++i) {
-            //			printf("create thread %d\n", i);
-#ifndef _WIN32
-            pthread_create(thread_ids + i, NULL, read_thread, (void*)(thread_info + i));
-#else
-			thread_ids[i] = CreateThread(NULL, 0, read_thread, (void*)(thread_info + i), 0, &ThreadId);
-#endif
+        // When the ring is full, pages at the far end of the buffer give up their slots before they are overwritten.
+        // (The ring has room for more than N_PAGES_BEHIND + N_PAGES_AHEAD pages, so those pages are never needed.)
+        // Those pages may still be being read, so the batches in flight are published first.
+        if (direction > 0) {
+            page_start_sec = last_sec_read + secs_per_page;
+            if ((page_start_sec + ((n_batch - 1) * secs_per_page) - first_sec_read) > ((ring.header->n_slots - 0.5) * secs_per_page)) {
+                if (pipeline.count > 0) {
+                    drain = 1;
+                    continue;
+                }
+                while ((page_start_sec + ((n_batch - 1) * secs_per_page) - first_sec_read) > ((ring.header->n_slots - 0.5) * secs_per_page))
+                    first_sec_read += secs_per_page;
+                first_sec_written = first_sec_read;
+                update_buffer_limits(&ring, first_sec_written, last_sec_written);
+            }
         }
-        // wait for threads
-        for (i = 0; i < num_chans; ++i) {
-            //if (DBUG) printf("join thread %d\n", i);
-#ifndef _WIN32
-            pthread_join(thread_ids[i], &ret_val);
-#else
-			WaitForSingleObject(thread_ids[i], INFINITE);
-#endif
+        else {
+            page_start_sec = first_sec_read - (n_batch * secs_per_page);
+            if ((last_sec_read - page_start_sec) > ((ring.header->n_slots - 0.5) * secs_per_page)) {
+                if (pipeline.count > 0) {
+                    drain = 1;
+                    continue;
+                }
+                while ((last_sec_read - page_start_sec) > ((ring.header->n_slots - 0.5) * secs_per_page))
+                    last_sec_read -= secs_per_page;
+                last_sec_written = last_sec_read;
+                update_buffer_limits(&ring, first_sec_written, last_sec_written);
+            }
         }
-        //		printf("fwrite page_data\n");
-        fwrite(fixed_info.page_data, sizeof(sf4), (size_t)tot_samps_per_page, o_fp);
-
-        // On each iteration of the endless loop, we're adding a single page (of all requested channels) to the output file.
-        last_sec_written += secs_per_page;
-
-        // update buffer limits file
-        if (check_fud(ps_path, nfud))
-            read_files_flag = 1;
+        fixed_info.page_to_write_start_sec = page_start_sec;
+        
+        // The tasks first find the runs of blocks they will decode; then all the channels' runs are read at once, and
+        // each task is decoded as soon as its own runs are in.  The loop comes back to the batch as it gets through
+        // those stages, and meanwhile starts the next batches.
+        pipeline_start(&pipeline, thread_info, montage, &ring, page_start_sec, n_batch, direction);
+        if (direction > 0)
+            last_sec_read = page_start_sec + ((n_batch - 1) * secs_per_page);
         else
-            last_heartbeat = update_buffer_limits(buff_lim_path, first_sec_written, last_sec_written);
+            first_sec_read = page_start_sec;
 
     } // end infinite loop
 
     // clean up for quit
+    pyramid_generation++;
+    pool_wait_background(&pool);
+    pyramid_release(thread_info, num_chans);
     for (i = 0; i < num_chans; ++i) {
         //free(thread_info[i].index_array);
         //fclose(thread_info[i].d_fp);
-        if (thread_info[i].channel->number_of_segments > 0)
-            thread_info[i].channel->segments[0].metadata_fps->directives.free_password_data = MEF_TRUE;
-        free_channel(thread_info[i].channel, MEF_TRUE);
+        block_cache_purge(&block_cache, thread_info[i].index);
+        free_channel_index(thread_info[i].index);
+        if (thread_info[i].source_raw != NULL)
+            free(thread_info[i].source_raw);
     }
-    free(fixed_info.page_data);
+    block_cache_report(&block_cache);
+    index_lru_report(&index_lru);
+    data_file_cache_report(&file_cache);
+    io_queue_report(&io_queue);
     free(thread_info);
-#ifndef _WIN32
-    free(thread_ids);
-#endif
-    fclose(o_fp);
+    pipeline_free(&pipeline);
+    free(open_tasks);
+    montage_free(montage);
+    if (montage_tasks != NULL)
+        free(montage_tasks);
+    unmap_file(&ring.data_map);
+    unmap_file(&ring.header_map);
 
     return(0);
 }
 
+// "get_mef_channel_thread" builds a channel's index from the metadata of its segments.  Their block indices are read
+// when pages need them (see segment_blocks_get()), so nothing else of the channel is read or kept here.
 #ifndef _WIN32
 static void* get_mef_channel_thread(void* argument)
 #else
@@ -755,125 +1573,154 @@ DWORD WINAPI get_mef_channel_thread(LPVOID argument)
 #endif
 {
     THREAD_INFO* thread_info;
-    char command[1024];
 
     //access passed argument
     thread_info = (THREAD_INFO*)argument;
 
-    thread_info->channel = read_MEF_channel(NULL, thread_info->f_name, TIME_SERIES_CHANNEL_TYPE, thread_info->fixed_info->password, NULL, MEF_FALSE, MEF_FALSE);
+    thread_info->index = build_channel_index(thread_info->f_name, thread_info->fixed_info->password);
+    
+    return(NULL);
+}
 
-    {
-        CHANNEL* channel;
-        int i;
-        int j;
-
-        channel = thread_info->channel;
-   
-        // verify password for first segment
-        if (channel->number_of_segments > 0)
-        {
-            // check if channel needs decryption
-            //if ((all_zeros(channel->segments[0].metadata_fps->universal_header->level_1_password_validation_field, PASSWORD_VALIDATION_FIELD_BYTES) == MEF_FALSE) ||
-            //    (all_zeros(channel->segments[0].metadata_fps->universal_header->level_2_password_validation_field, PASSWORD_VALIDATION_FIELD_BYTES) == MEF_FALSE))
-            if  ((channel->segments[0].metadata_fps->metadata.section_1->section_2_encryption != NO_ENCRYPTION) ||
-                 (channel->segments[0].metadata_fps->metadata.section_1->section_3_encryption != NO_ENCRYPTION))
-            {
-                // level 1 access needed to read techinal data (level 2 not really needed)
-                if (channel->segments[0].metadata_fps->password_data->access_level < LEVEL_1_ACCESS)
-                    password_needed = 1;
-            }
+// "channel_open_thread" opens one channel (unless it is already open), sets up its display filter, and reads its
+// page at the view, which the UI can draw as soon as that is done
+#ifndef _WIN32
+static void *channel_open_thread(void *argument)
+#else
+DWORD WINAPI channel_open_thread(LPVOID argument)
+#endif
+{
+    OPEN_TASK *open_task;
+    THREAD_INFO *thread_info;
+    FIRST_PAGE *first_page;
+    si1 *cache_dir;
+    si4 i, all_open;
+    
+    open_task = (OPEN_TASK *) argument;
+    thread_info = open_task->thread_info;
+    first_page = open_task->first_page;
+    
+    // The index cache spares reading the channel's metadata and indices.  A channel read from MEF is cached for next
+    // time, in the background, since that reads every segment's index.
+    cache_dir = thread_info->fixed_info->cache_dir;
+    if ((thread_info->index == NULL) && (cache_dir[0] != 0))
+        thread_info->index = index_cache_load(cache_dir, thread_info->f_name);
+    if (thread_info->index == NULL) {
+        get_mef_channel_thread((void *) thread_info);
+        if ((cache_dir[0] != 0) && !password_needed && !thread_info->index->encrypted)
+            index_cache_submit(open_task->pool, thread_info->index, cache_dir, thread_info->f_name);
+    }
+    thread_info->index->lru = thread_info->fixed_info->index_lru;
+    thread_info->index->file_cache = thread_info->fixed_info->file_cache;
+    thread_info->native_fs = thread_info->index->sampling_frequency;
+    filter_design(&thread_info->filter, thread_info->fixed_info, thread_info->native_fs);
+    if (!first_page->enabled || password_needed)
+        return(NULL);
+    
+    // With no view yet, the page is at the start of the session (the earliest start of its channels), so the last
+    // channel to open picks it, and reads the other channels' pages too, on the pool.
+    first_page_lock(first_page);
+    if ((first_page->n_open == 0) || (thread_info->index->earliest_start_time < first_page->start_time))
+        first_page->start_time = thread_info->index->earliest_start_time;
+    all_open = (++first_page->n_open == first_page->num_chans);
+    if (first_page->view_sec == 0.0) {
+        if (!all_open) {
+            first_page_unlock(first_page);
+            return(NULL);
         }
-        // fix bad data
-        for (i = 1; i < channel->number_of_segments; i++)
-        {
-            if (channel->segments[i].metadata_fps->metadata.time_series_section_2->number_of_blocks > 0)
-            {
-                if (channel->segments[i].time_series_indices_fps->time_series_indices[0].start_sample ==
-                    channel->segments[i].metadata_fps->metadata.time_series_section_2->start_sample)
-                    
-                {
-                    for (j = 0; j < channel->segments[i].metadata_fps->metadata.time_series_section_2->number_of_blocks; j++)
-                    {
-                        channel->segments[i].time_series_indices_fps->time_series_indices[j].start_sample -= channel->segments[i].metadata_fps->metadata.time_series_section_2->start_sample;
-
-                    }
-                }
-            }
+        first_page->view_sec = floor(first_page->start_time / 1000000.0);
+        ring_reset(first_page->ring, first_page->view_sec);
+        for (i = 0; i < first_page->num_chans; ++i) {
+            if (i != thread_info->chan_idx)
+                pool_submit(open_task->pool, first_page_thread, (void *) (first_page->open_tasks + i));
         }
-
     }
+    first_page_unlock(first_page);
+    
+    first_page_thread((void *) open_task);
     
     return(NULL);
 }
 
+// "first_page_thread" reads one channel's page at the view, and publishes it
 #ifndef _WIN32
-static void *do_nothing_thread(void *argument)
+static void *first_page_thread(void *argument)
 #else
-DWORD WINAPI do_nothing_thread(LPVOID argument)
+DWORD WINAPI first_page_thread(LPVOID argument)
 #endif
 {
+    OPEN_TASK *open_task;
+    THREAD_INFO *thread_info;
+    FIRST_PAGE *first_page;
+    READ_TASK read_task;
+    
+    open_task = (OPEN_TASK *) argument;
+    thread_info = open_task->thread_info;
+    first_page = open_task->first_page;
+    
+    first_page_lock(first_page);
+    memset(&read_task, 0, sizeof(READ_TASK));
+    read_task.thread_info = thread_info;
+    read_task.page_start_sec = first_page->view_sec;
+    read_task.n_pages = 1;
+    read_task.direction = 1;
+    read_task.page_data[0] = ring_slot(first_page->ring, first_page->view_sec);
+    first_page_unlock(first_page);
+    
+    read_thread((void *) &read_task);
+    
+    // publish the page (rows not filled in yet are NAN), and list the channel in server_info
+    first_page_lock(first_page);
+    first_page->ready[first_page->n_ready++] = thread_info->chan_idx;
+    write_server_info(first_page->server_info_path, first_page->thread_info, first_page->ready, first_page->n_ready,
+                      first_page->num_chans, first_page->view_sec, 0);
+    update_buffer_limits(first_page->ring, first_page->view_sec, first_page->view_sec);
+    first_page_unlock(first_page);
+    
     return(NULL);
 }
 
-// "read_thread" reads one page of one channel
+// "read_thread" reads a batch of up to READ_BATCH_PAGES consecutive pages of one channel (a READ_TASK), decoding the
+// blocks under the whole batch at once and filling each page's row in its ring slot (or, with decode_only, just
+// decoding them into the channel's source buffer for a montage)
 #ifndef _WIN32
 static void *read_thread(void *argument)
 #else
 DWORD WINAPI read_thread(LPVOID argument)
 #endif
 {
-    si4		i, j, chan_idx, cd_len, current_val, last_val, num_chans, samps_per_page;
-    si4		*diff_buffer, *data, *dp, *dbp, offset_to_start_samp, offset_to_end_samp;
+    si4		j, chan_idx, samps_per_page;
+    READ_TASK	*read_task;
     THREAD_INFO	*thread_info;
     FIXED_INFO	*fixed_info;
     si8     start_time, end_time;
-    ui8		*samp_idxs, start_samp, end_samp, num_samps, data_len, bytesDecoded, entryCounter;
+    ui8		start_samp, end_samp, num_samps;
     sf4		*page_data;
-    sf8		out_samp_period, next_samp, curr_samp;
     ui4 n_segments;
     sf8 native_samp_freq;
-    CHANNEL    *channel;
     si4 start_segment, end_segment;
     si4 times_specified, samples_specified;
-    si8  total_samps, samp_counter_base;
-    ui8  total_data_bytes;
-    ui8  total_bytes_read;
-    ui8 start_idx, end_idx, num_blocks;
-    si4 *raw_data_buffer, *idp;
-    si1 *compressed_data_buffer, *cdp;
-    si8  segment_start_sample, segment_end_sample;
-    si8  segment_start_time, segment_end_time;
-    si8  block_start_time, block_end_time;
-    si4 num_block_in_segment;
-    si4 pass_order, stop_order;
-    si4 order;
-    FILE *fp;
-    ui8 n_read, bytes_to_read;
-    RED_PROCESSING_STRUCT	*rps;
-    sf8 *filt_data;
-    sf8         *pass_filt_nums, *pass_filt_dens;
-    sf8         *stop_filt_nums, *stop_filt_dens;
-    si4 sample_counter;
-    ui4			max_samps;
-    si4 offset_into_output_buffer;
-    si8 block_start_time_offset;
-    si4 *temp_data_buf;
-    
-    pass_order = 0;
-    stop_order = 0;
+    ui8 start_idx, end_idx;
+    si4 *raw_data_buffer;
+    WORKER_ARENA *arena, local_arena;
+    CHANNEL_INDEX *index;
+    si8 first_block, last_block;
+    si4 p, n_pages, pages_left, page_served[READ_BATCH_PAGES];
+    si8 page_start_time, page_end_time;
     
     
     //access passed argument
-    thread_info = (THREAD_INFO *) argument;
+    read_task = (READ_TASK *) argument;
+    thread_info = read_task->thread_info;
     fixed_info = thread_info->fixed_info;
     chan_idx = thread_info->chan_idx;
     samps_per_page = fixed_info->samps_per_page;
-    page_data = fixed_info->page_data;
-    num_chans = fixed_info->num_chans;
+    n_pages = read_task->n_pages;
 	
     
-    start_time = fixed_info->page_to_write_start_sec * 1000000;
-    end_time = (fixed_info->page_to_write_start_sec + fixed_info->secs_per_page) * 1000000;
+    // the whole batch of pages is read as one range
+    start_time = read_task->page_start_sec * 1000000;
+    end_time = (read_task->page_start_sec + (n_pages * fixed_info->secs_per_page)) * 1000000;
 #ifndef _WIN32
     if (DBUG) printf("start %ld end %ld\n", start_time, end_time);
 #else
@@ -883,38 +1730,45 @@ DWORD WINAPI read_thread(LPVOID argument)
     // MEF 3
     times_specified = 1;
     native_samp_freq = thread_info->native_fs;
-    channel = thread_info->channel;
     
     if (times_specified)
-        num_samps = (ui4)((((end_time - start_time) / 1000000.0) * channel->metadata.time_series_section_2->sampling_frequency) + 0.5);
+        num_samps = (ui4)((((end_time - start_time) / 1000000.0) * thread_info->index->sampling_frequency) + 0.5);
+    
+    // zoomed-out envelope pages come straight from the pyramid when it is ready, or, zoomed out past a block per
+    // column, from the block indices, without reading any data
+    pages_left = n_pages;
+    for (p = 0; p < n_pages; ++p)
+    {
+        page_served[p] = 0;
+        page_start_time = (read_task->page_start_sec + (p * fixed_info->secs_per_page)) * 1000000;
+        page_end_time = (read_task->page_start_sec + ((p + 1) * fixed_info->secs_per_page)) * 1000000;
+        if (pyramid_zoom(read_task, (si8) num_samps))
+            page_served[p] = pyramid_envelope(thread_info, page_start_time, page_end_time, page_row(read_task->page_data[p], fixed_info, chan_idx), 1);
+        if (!page_served[p] && index_zoom(read_task, (si8) num_samps))
+            page_served[p] = index_envelope(thread_info, page_start_time, page_end_time, page_row(read_task->page_data[p], fixed_info, chan_idx), 1);
+        pages_left -= page_served[p];
+    }
+    if (pages_left == 0)
+        return(NULL);
     
     // Iterate through segments, looking for data that matches our criteria
-    n_segments = channel->number_of_segments;
+    n_segments = thread_info->index->n_segments;
     start_segment = end_segment = -1;
     
     if (times_specified) {
-        start_samp = sample_for_uutc_c(start_time, channel);
-        end_samp = sample_for_uutc_c(end_time, channel);
+        start_samp = sample_for_uutc_c(start_time, thread_info->index);
+        end_samp = sample_for_uutc_c(end_time, thread_info->index);
         samples_specified = 1;
     }
     
     start_segment = 0;
     
-    // Iterate through segments and see which segments the start and end are in.
+    // find which segments the start and end are in
     if (samples_specified) {
-        for (i = 0; i < n_segments; ++i) {
-            
-            segment_start_sample = channel->segments[i].metadata_fps->metadata.time_series_section_2->start_sample;
-            segment_end_sample   = channel->segments[i].metadata_fps->metadata.time_series_section_2->start_sample +
-            channel->segments[i].metadata_fps->metadata.time_series_section_2->number_of_samples;
-            
-            if ((start_samp >= segment_start_sample) &&
-                (start_samp <= segment_end_sample))
-                start_segment = i;
-            if ((end_samp >= segment_start_sample) &&
-                (end_samp <= segment_end_sample))
-                end_segment = i;
-        }
+        start_segment = segment_for_sample(thread_info->index, start_samp);
+        end_segment = segment_for_sample(thread_info->index, end_samp);
+        if (start_segment == -1)
+            start_segment = 0;
     }
     
     if (end_segment == -1)
@@ -925,588 +1779,4621 @@ DWORD WINAPI read_thread(LPVOID argument)
     // always be < n_segments
     if ((start_segment == -1) || (end_segment == -1)) //hit the end of the file, fill out data with zeros
     {
-        for (j=0; j < samps_per_page; )
-        page_data[(j++ * num_chans) + chan_idx]=0;
+        if (read_task->decode_only) {
+            thread_info->source_samps = 0;
+            return(NULL);
+        }
+        for (p = 0; p < n_pages; ++p) {
+            page_data = page_row(read_task->page_data[p], fixed_info, chan_idx);
+            for (j=0; j < (samps_per_page * fixed_info->samp_values); )
+            page_data[j++]=0;
+        }
         
         return(NULL);
     }
     
     //fprintf(stderr, "start seg = %d, end seg = %d\n", start_segment, end_segment);
     
-    // find start block in start segment
-    samp_counter_base = channel->segments[start_segment].metadata_fps->metadata.time_series_section_2->start_sample;
-    for (j = 1; j < channel->segments[start_segment].metadata_fps->metadata.time_series_section_2->number_of_blocks; j++) {
-        
-        block_start_time = channel->segments[start_segment].time_series_indices_fps->time_series_indices[j].start_time;
-        remove_recording_time_offset( &block_start_time);
-        
-        if ((samples_specified) &&
-            (channel->segments[start_segment].time_series_indices_fps->time_series_indices[j].start_sample + samp_counter_base > start_samp)) {
-            start_idx = j - 1;
-            break;
-        }
-        // starting point is in last block in segment
-        start_idx = j;
-    }
-    
-    // find stop block in stop segment
-    samp_counter_base = channel->segments[end_segment].metadata_fps->metadata.time_series_section_2->start_sample;
-    for (j = 1; j < channel->segments[end_segment].metadata_fps->metadata.time_series_section_2->number_of_blocks; j++) {
-        
-        block_start_time = channel->segments[end_segment].time_series_indices_fps->time_series_indices[j].start_time;
-        remove_recording_time_offset( &block_start_time);
-        
-        if ((samples_specified) &&
-            (channel->segments[end_segment].time_series_indices_fps->time_series_indices[j].start_sample + samp_counter_base > end_samp)) {
-            end_idx = j - 1;
-            break;
-        }
-        // ending point is in last block in segment
-        end_idx = j;
-    }
+    // find start block in start segment, and stop block in stop segment
+    start_idx = block_for_sample(thread_info->index, start_segment, start_samp);
+    end_idx = block_for_sample(thread_info->index, end_segment, end_samp);
     
     if (DBUG) fprintf(stderr, "start_segment = %d end_segment = %d\n", start_segment, end_segment);
     if (DBUG) fprintf(stderr, "start_idx = %d end_idx = %d\n", start_idx, end_idx);
     if (DBUG) fprintf(stderr, "start_samp = %d end_samp = %d\n", start_samp, end_samp);
     
-    // find total_samps and total_data_bytes, so we can allocate buffers
-    total_samps = 0;
-    total_data_bytes = 0;
-    
-    // TBD do we care about this?
-    //chan->max_sample_value = RED_MINIMUM_SAMPLE_VALUE;
-    //chan->min_sample_value = RED_MAXIMUM_SAMPLE_VALUE;
+    // the blocks under the pages are decoded into raw_data_buffer (see decode_blocks())
+    index = thread_info->index;
+    first_block = index->segment_first_block[start_segment] + start_idx;
+    last_block = index->segment_first_block[end_segment] + end_idx;
+    if (last_block >= index->n_blocks)  // a channel with no blocks at all
+        last_block = index->n_blocks - 1;
     
-    // normal case - everything is in one segment
-    if (start_segment == end_segment) {
-        if (end_idx < (channel->segments[start_segment].metadata_fps->metadata.time_series_section_2->number_of_blocks - 1)) {
-            total_samps += channel->segments[start_segment].time_series_indices_fps->time_series_indices[end_idx+1].start_sample -
-            channel->segments[start_segment].time_series_indices_fps->time_series_indices[start_idx].start_sample;
-            //fprintf(stderr, "total_samps = %d\n", total_samps);
-            total_data_bytes += channel->segments[start_segment].time_series_indices_fps->time_series_indices[end_idx+1].file_offset -
-            channel->segments[start_segment].time_series_indices_fps->time_series_indices[start_idx].file_offset;
-        }
-        else {
-            // case where end_idx is last block in segment
-            total_samps += channel->segments[start_segment].metadata_fps->metadata.time_series_section_2->number_of_samples -
-            channel->segments[start_segment].time_series_indices_fps->time_series_indices[start_idx].start_sample;
-            total_data_bytes += channel->segments[start_segment].time_series_data_fps->file_length -
-            channel->segments[start_segment].time_series_indices_fps->time_series_indices[start_idx].file_offset;
-        }
-        num_blocks = end_idx - start_idx + 1;
+    // all scratch memory comes from the worker's arena, grown only when this batch needs more than it has
+    // (a call from outside the pool gets a temporary one).  For a montage, the samples are decoded into the channel's
+    // own buffer instead, where the montage tasks pick them up.
+    arena = worker_arena;
+    if (arena == NULL) {
+        memset(&local_arena, 0, sizeof(WORKER_ARENA));
+        arena = &local_arena;
+    }
+    if (read_task->decode_only) {
+        thread_info->source_raw = (si4 *) arena_reserve(thread_info->source_raw, &thread_info->source_raw_count, (size_t) num_samps * sizeof(si4));
+        raw_data_buffer = thread_info->source_raw;
+        thread_info->source_samps = (si8) num_samps;
     }
-    // spans across segments
-    else {
-        // start with first segment
-        num_block_in_segment = channel->segments[start_segment].metadata_fps->metadata.time_series_section_2->number_of_blocks;
-        total_samps += channel->segments[start_segment].metadata_fps->metadata.time_series_section_2->number_of_samples -
-        channel->segments[start_segment].time_series_indices_fps->time_series_indices[start_idx].start_sample;
-        total_data_bytes +=  channel->segments[start_segment].time_series_data_fps->file_length -
-        channel->segments[start_segment].time_series_indices_fps->time_series_indices[start_idx].file_offset;
-        num_blocks = num_block_in_segment - start_idx;
-        
-        // this loop will only run if there are segments in between the start and stop segments
-        for (i = (start_segment + 1); i <= (end_segment - 1); i++) {
-            num_block_in_segment = channel->segments[i].metadata_fps->metadata.time_series_section_2->number_of_blocks;
-            total_samps += channel->segments[i].metadata_fps->metadata.time_series_section_2->number_of_samples;
-            total_data_bytes += channel->segments[i].time_series_data_fps->file_length -
-            channel->segments[i].time_series_indices_fps->time_series_indices[0].file_offset;
-            num_blocks += num_block_in_segment;
-        }
-        
-        // then last segment
-        num_block_in_segment = channel->segments[end_segment].metadata_fps->metadata.time_series_section_2->number_of_blocks;
-        if (end_idx < (channel->segments[end_segment].metadata_fps->metadata.time_series_section_2->number_of_blocks - 1)) {
-            total_samps += channel->segments[end_segment].time_series_indices_fps->time_series_indices[end_idx+1].start_sample -
-            channel->segments[end_segment].time_series_indices_fps->time_series_indices[0].start_sample;
-            total_data_bytes += channel->segments[end_segment].time_series_indices_fps->time_series_indices[end_idx+1].file_offset -
-            channel->segments[end_segment].time_series_indices_fps->time_series_indices[0].file_offset;
-            num_blocks += end_idx + 1;
-        }
-        else {
-            // case where end_idx is last block in segment
-            total_samps += channel->segments[end_segment].metadata_fps->metadata.time_series_section_2->number_of_samples -
-            channel->segments[end_segment].time_series_indices_fps->time_series_indices[0].start_sample;
-            total_data_bytes += channel->segments[end_segment].time_series_data_fps->file_length -
-            channel->segments[end_segment].time_series_indices_fps->time_series_indices[0].file_offset;
-            num_blocks += end_idx + 1;
-        }
-    }
-    
-    // allocate buffers
-    data_len = total_samps;
-    order = (pass_order > stop_order) ? pass_order : stop_order;
-    //filt_data = (sf8 *) calloc((size_t) data_len + (6 * order), sizeof(sf8));
-    compressed_data_buffer = (si1 *) malloc((size_t) total_data_bytes + 30);
-    // TBD fix undiagnosed abort problem
-    // where the RED_Decode runs off the end of the cdp buffer - this occurs even though
-    // CRC checks are passing on the block, and the stated size of the block is correct
-    // Can't be a RED_Decode problem since it only  happens at the last block on the right
-    // side of the screen - if it was a block/RED issue, then it would happen randomly
-    // (Unless ... it overruns the buffer on every block, and just crashses on the right-most one...)
-    // Will fix this later once I have time
-    // For now just adding 30 bytes to buffer to prevent buffer overrun abort
-    raw_data_buffer = (si4 *) malloc((size_t) (num_samps * sizeof(si4)));
-    memset_int(raw_data_buffer, RED_NAN, num_samps);
-    cdp = compressed_data_buffer;
-    idp = raw_data_buffer;
-    total_bytes_read = 0;  // this only matters when reading across segment boundaries
-    
-    // read in RED data
-    // normal case - everything is in one segment
-    if (start_segment == end_segment) {
-        fp = channel->segments[start_segment].time_series_data_fps->fp;
-        fseek(fp, channel->segments[start_segment].time_series_indices_fps->time_series_indices[start_idx].file_offset, SEEK_SET);
-        n_read = fread(cdp, sizeof(si1), (size_t) total_data_bytes, fp);
-    }
-    // spans across segments
     else {
-        // start with first segment
-        fp = channel->segments[start_segment].time_series_data_fps->fp;
-        fseek(fp, channel->segments[start_segment].time_series_indices_fps->time_series_indices[start_idx].file_offset, SEEK_SET);
-        bytes_to_read = channel->segments[start_segment].time_series_data_fps->file_length -
-        channel->segments[start_segment].time_series_indices_fps->time_series_indices[start_idx].file_offset;
-        n_read = fread(cdp, sizeof(si1), (size_t) bytes_to_read, fp);
-        cdp += bytes_to_read;
-        total_bytes_read += bytes_to_read;
-        
-        // this loop will only run if there are segments in between the start and stop segments
-        for (i = (start_segment + 1); i <= (end_segment - 1); i++) {
-            fp = channel->segments[i].time_series_data_fps->fp;
-            fseek(fp, UNIVERSAL_HEADER_BYTES, SEEK_SET);
-            bytes_to_read = channel->segments[i].time_series_data_fps->file_length -
-                channel->segments[i].time_series_indices_fps->time_series_indices[0].file_offset;
-            n_read = fread(cdp, sizeof(si1), (size_t) bytes_to_read, fp);
-            cdp += bytes_to_read;
-            total_bytes_read += bytes_to_read;
-        }
-        
-        // then last segment
-        fp = channel->segments[end_segment].time_series_data_fps->fp;
-        fseek(fp, UNIVERSAL_HEADER_BYTES, SEEK_SET);
-        //bytes_to_read = channel->segments[end_segment].time_series_data_fps->file_length -
-        //channel->segments[end_segment].time_series_indices_fps->time_series_indices[start_idx].file_offset;
-        bytes_to_read = total_data_bytes - total_bytes_read;
-        n_read = fread(cdp, sizeof(si1), (size_t) bytes_to_read, fp);
-        cdp += bytes_to_read;
+        arena->raw = (si4 *) arena_reserve(arena->raw, &arena->raw_count, (size_t) num_samps * sizeof(si4));
+        raw_data_buffer = arena->raw;
     }
+    memset_int(raw_data_buffer, RED_NAN, num_samps);
+    
+    // With fewer channels in the batch than workers, a long batch is split into pieces that idle workers decode too
+    if (read_task->n_pieces > 1)
+        decode_split(read_task, first_block, last_block, raw_data_buffer, (si8) num_samps, start_time, native_samp_freq, arena);
+    else
+        decode_blocks(read_task, first_block, last_block, raw_data_buffer, (si8) num_samps, start_time, native_samp_freq, arena);
     
-    // set up RED processing struct
-    cdp = compressed_data_buffer;
-    max_samps = channel->metadata.time_series_section_2->maximum_block_samples;
+    // display filters, in place (this task is the only one using the channel's filter state).  Only reads going
+    // forward keep the state; the next batch behind the view ends where this one starts, so it can't continue it.
+    // (A batch cancelled while it was being decoded leaves the filter and its pages alone.)
+    if (!read_task->decode_only && !read_task_cancelled(read_task)) {
+        if (thread_info->filter.n_sections > 0)
+            filter_run(&thread_info->filter, raw_data_buffer, (si8) num_samps, start_time, end_time, native_samp_freq, read_task->direction > 0);
+        batch_to_pages(raw_data_buffer, (si8) num_samps, native_samp_freq, read_task->page_start_sec, n_pages, read_task->page_data, page_served,
+                       fixed_info, chan_idx, thread_info->index->units_conversion_factor);
+    }
     
-    // create RED processing struct
-    rps = (RED_PROCESSING_STRUCT *) calloc((size_t) 1, sizeof(RED_PROCESSING_STRUCT));
-    rps->compression.mode = RED_DECOMPRESSION;
-    //rps->directives.return_block_extrema = MEF_TRUE;
-    rps->decompressed_ptr = rps->decompressed_data = idp;
-    rps->difference_buffer = (si1 *) e_calloc((size_t) RED_MAX_DIFFERENCE_BYTES(max_samps), sizeof(ui1), __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
+    if (arena == &local_arena)
+        arena_free(arena);
     
-    //thread_info->number_of_discontinuities = 0;
-    sample_counter = 0;
+    return(NULL);
+}
+
+
+// Decode blocks first_block..last_block of a read task's channel into the batch's raw samples, each block at its own
+// offset from the batch start, using the calling worker's arena for scratch.  Decoded blocks go through the block
+// cache, so blocks shared with neighboring pages, or revisited, aren't read again.  Runs of blocks that aren't cached
+// are read in one piece, usually ahead of time with the rest of the batch.
+static void decode_blocks(READ_TASK *read_task, si8 first_block, si8 last_block, si4 *raw, si8 num_samps, si8 start_time, sf8 samp_freq,
+                          WORKER_ARENA *arena)
+{
+    CHANNEL_INDEX *index;
+    BLOCK_CACHE *cache;
+    BLOCK_CACHE_ENTRY *entry;
+    SEGMENT_BLOCKS *blocks;
+    DATA_FILE *data_file;
+    IO_REQUEST *request;
+    RED_PROCESSING_STRUCT *rps;
+    MAPPED_FILE *data_map;
+    si8 b, k, run_end, run_offset, run_bytes, seg_first, run_avail, n_read;
+    si4 seg, blocks_seg, *samples;
+    si1 *compressed_data_buffer, *cdp;
+    ui1 *run_data, *block_scratch;
+    ui4 max_samps;
     
-    temp_data_buf = NULL;
+    index = read_task->thread_info->index;
+    cache = read_task->thread_info->fixed_info->block_cache;
+    max_samps = index->maximum_block_samples;
+    rps = NULL;
+    block_scratch = NULL;
+    seg = (si4) (upper_bound_si8(index->segment_first_block, 0, (si8) index->n_segments + 1, first_block) - 1);
+    blocks = NULL;
+    data_file = NULL;
+    blocks_seg = -1;
     
-    // decode first block to temp array
-    if (num_blocks >= 1)
+    for (b = first_block; b <= last_block; b = run_end)
     {
-        temp_data_buf = (int *) malloc((max_samps * 1.1) * sizeof(si4));
-        rps->decompressed_ptr = rps->decompressed_data = temp_data_buf;
-        rps->compressed_data = cdp;
-        rps->block_header = (RED_BLOCK_HEADER *) rps->compressed_data;
-        
-        if (!check_block_crc((ui1*)(rps->block_header), max_samps, compressed_data_buffer, total_data_bytes))
-        {
-            fprintf(stdout, "**CRC block failure!**\n");
-            goto skip_rest_of_decoding;
+        if (read_task_cancelled(read_task))
+            break;
+        entry = block_cache_get(cache, index, b);
+        if (entry != NULL) {
+            place_block(raw, num_samps, entry, start_time, samp_freq);
+            block_cache_release(cache, entry);
+            run_end = b + 1;
+            continue;
         }
         
-        RED_decode(rps);
-        cdp += rps->block_header->block_bytes;
-        
-        if (times_specified)
-        {
-            // rps->block_header->start_time is already offset during RED_decode()
-            
-            if ((rps->block_header->start_time - start_time) >= 0)
-                offset_into_output_buffer = (si4) ((((rps->block_header->start_time - start_time) / 1000000.0) * channel->metadata.time_series_section_2->sampling_frequency) + 0.5);
-            else
-                offset_into_output_buffer = (si4) ((((rps->block_header->start_time - start_time) / 1000000.0) * channel->metadata.time_series_section_2->sampling_frequency) - 0.5);
+        // read this block and the uncached blocks after it, up to the end of the segment
+        while (b >= index->segment_first_block[seg + 1])
+            seg++;
+        if (seg != blocks_seg) {
+            segment_blocks_release(index, blocks);
+            data_file_release(index, data_file);
+            blocks = segment_blocks_get(index, seg);
+            data_file = (blocks != NULL) ? data_file_get(index, seg) : NULL;
+            blocks_seg = seg;
         }
-        else
-            offset_into_output_buffer = (si4) (channel->segments[start_segment].metadata_fps->metadata.time_series_section_2->start_sample +
-                                                          channel->segments[start_segment].time_series_indices_fps->time_series_indices[start_idx].start_sample) - start_samp;
-        
-        // copy requested samples from first block to output buffer
-        // TBD this loop could be optimized
-        for (i=0;i<rps->block_header->number_of_samples;i++)
-        {
-            if (offset_into_output_buffer < 0)
-            {
-                offset_into_output_buffer++;
-                continue;
-            }
-            
-            if ((ui4) offset_into_output_buffer >= num_samps)
+        if ((blocks == NULL) || (data_file == NULL)) {
+            // (the segment's .tidx or .tdat file can't be opened, its samples stay NAN)
+            run_end = index->segment_first_block[seg + 1];
+            continue;
+        }
+        seg_first = index->segment_first_block[seg];
+        for (run_end = b + 1; (run_end <= last_block) && (run_end < index->segment_first_block[seg + 1]); ++run_end) {
+            if (block_cache_contains(cache, index, run_end))
                 break;
-            
-            *(raw_data_buffer + offset_into_output_buffer) = temp_data_buf[i];
-            
-            offset_into_output_buffer++;
         }
-        sample_counter = offset_into_output_buffer;
+        run_offset = blocks->file_offset[b - seg_first];
+        run_bytes = blocks->file_offset[run_end - 1 - seg_first] + blocks->bytes[run_end - 1 - seg_first] - run_offset;
         
-    }
-    
-    // decode bytes to samples
-    for (i=1;i<num_blocks-1;i++) {
-        rps->compressed_data = cdp;
-        rps->block_header = (RED_BLOCK_HEADER *) rps->compressed_data;
-        if (!check_block_crc((ui1*)(rps->block_header), max_samps, compressed_data_buffer, total_data_bytes))
-        {
-            fprintf(stdout, "*****************CRC block failure!**\n");
-            goto skip_rest_of_decoding;
+        // A run read ahead with the batch (see io_batch_run()) is decoded from its buffer.  Otherwise the compressed
+        // data comes straight from the mapped file (through the page cache, without a read call or a copy of the whole
+        // run).  If the file isn't mapped, or the run goes past the mapping, the run is read into a buffer here, with a
+        // positional read, which other reads of the same file can't disturb.
+        request = io_plan_find(&read_task->io, seg, run_offset, run_bytes);
+        data_map = &data_file->file;
+        if (request != NULL) {
+            data_map = NULL;
+            run_data = request->buffer + (run_offset - request->offset);
+            run_avail = run_bytes;
         }
-        
-        if (times_specified)
-        {
-            block_start_time_offset = rps->block_header->start_time;
-            remove_recording_time_offset( &block_start_time_offset );
-            
-            // The next two checks see if the block contains out-of-bounds samples.
-            // In that case, skip the block and move on
-            if (block_start_time_offset < start_time)
-            {
-                cdp += rps->block_header->block_bytes;
-                continue;
-            }
-            if (block_start_time_offset + ((rps->block_header->number_of_samples / channel->metadata.time_series_section_2->sampling_frequency) * 1e6) >= end_time)
-            {
-                // Comment this out for now, it creates a strange boundary condition
-                // cdp += rps->block_header->block_bytes;
-                continue;
-            }
-            
-            rps->decompressed_ptr = rps->decompressed_data = raw_data_buffer + (int)((((block_start_time_offset - start_time) / 1000000.0) * channel->metadata.time_series_section_2->sampling_frequency) + 0.5);
+        else if ((data_map->addr != NULL) && ((run_offset + run_bytes) <= (si8) data_map->bytes)) {
+            run_data = (ui1 *) data_map->addr + run_offset;
+            run_avail = run_bytes;
+            advise_will_need(data_map, run_offset, run_avail);
         }
-        
-        
-        RED_decode(rps);
-
-        cdp += rps->block_header->block_bytes;
-        idp += rps->block_header->number_of_samples;
-        rps->decompressed_ptr = rps->decompressed_data = idp;
-        
-        sample_counter += rps->block_header->number_of_samples;
-    }
-    
-    // decode last block to temp array
-    if (num_blocks >= 2)
-    {
-        // temp_data_buf already is malloc'd by this point
-        rps->decompressed_ptr = rps->decompressed_data = temp_data_buf;
-        rps->compressed_data = cdp;
-        rps->block_header = (RED_BLOCK_HEADER *) rps->compressed_data;
-        
-        
-        if (!check_block_crc((ui1*)(rps->block_header), max_samps, compressed_data_buffer, total_data_bytes))
-        {
-            fprintf(stdout, "**CRC block failure!**\n");
-            goto skip_rest_of_decoding;
+        else {
+            data_map = NULL;
+            // (30 spare bytes: RED_decode has been seen to run slightly past the end of the last block)
+            arena->compressed = (si1 *) arena_reserve(arena->compressed, &arena->compressed_bytes, (size_t) run_bytes + 30);
+            compressed_data_buffer = arena->compressed;
+            n_read = data_file_read(data_file, compressed_data_buffer, run_bytes, run_offset);
+            run_data = (ui1 *) compressed_data_buffer;
+            run_avail = n_read;
         }
         
-        RED_decode(rps);
-        cdp += rps->block_header->block_bytes;
-        
-        if (times_specified)
-        {
-            if ((rps->block_header->start_time - start_time) >= 0)
-                offset_into_output_buffer = (si4) ((((rps->block_header->start_time - start_time) / 1000000.0) * channel->metadata.time_series_section_2->sampling_frequency) + 0.5);
-            else
-                offset_into_output_buffer = (si4) ((((rps->block_header->start_time - start_time) / 1000000.0) * channel->metadata.time_series_section_2->sampling_frequency) - 0.5);
-        }
-        else
-            offset_into_output_buffer = (si4) channel->segments[start_segment].time_series_indices_fps->time_series_indices[start_idx].start_sample - start_samp;
+        if (rps == NULL)
+            rps = arena_rps(arena, max_samps);
         
-        // copy requested samples from first block to output buffer
-        // TBD this loop could be optimized
-        for (i=0;i<rps->block_header->number_of_samples;i++)
+        for (k = b; k < run_end; ++k)
         {
-            if (offset_into_output_buffer < 0)
+            cdp = (si1 *) run_data + (blocks->file_offset[k - seg_first] - run_offset);
+            if (!check_block_crc((ui1 *) cdp, max_samps, run_data, (ui8) run_avail))
             {
-                offset_into_output_buffer++;
+                // The block's samples stay NAN (a gap in the pages).  It goes into the cache with no samples, so it
+                // isn't read or checked again (or reported again) while it stays there.
+#ifndef _WIN32
+                fprintf(stderr, "%s: CRC failure in block %ld, left blank\n", read_task->thread_info->f_name, k);
+#else
+                fprintf(stderr, "%s: CRC failure in block %lld, left blank\n", read_task->thread_info->f_name, k);
+#endif
+                block_cache_release(cache, block_cache_put(cache, index, k, 0, NULL, 0));
                 continue;
             }
+            // RED_decode rewrites the block header (recording time offset, decryption) in place, so a block from the
+            // read-only mapping is decoded from a small reusable copy
+            if (data_map != NULL) {
+                if (block_scratch == NULL) {
+                    arena->block_scratch = (ui1 *) arena_reserve(arena->block_scratch, &arena->block_scratch_bytes,
+                                                                 (size_t) RED_MAX_COMPRESSED_BYTES(max_samps, 1) + 30);
+                    block_scratch = arena->block_scratch;
+                }
+                memcpy(block_scratch, cdp, (size_t) ((RED_BLOCK_HEADER *) cdp)->block_bytes);
+                cdp = (si1 *) block_scratch;
+            }
+            rps->compressed_data = (ui1 *) cdp;
+            rps->block_header = (RED_BLOCK_HEADER *) rps->compressed_data;
             
-            if ((ui4) offset_into_output_buffer >= num_samps)
-                break;
-            
-            *(raw_data_buffer + offset_into_output_buffer) = temp_data_buf[i];
+            // (the decoded samples are handed to the block cache, which recycles their buffer when they are evicted)
+            samples = block_cache_samples(cache, (si4) rps->block_header->number_of_samples);
+            rps->decompressed_ptr = rps->decompressed_data = samples;
+            RED_decode(rps);
             
-            offset_into_output_buffer++;
-        }
-        sample_counter = offset_into_output_buffer;
-        
-    }
-    
-skip_rest_of_decoding:
-    
-    // we're done with the compressed data, get rid of it
-    if (compressed_data_buffer != NULL)
-        free (compressed_data_buffer);
-    if (rps != NULL)
-    {
-        if (rps->difference_buffer != NULL)
-            free(rps->difference_buffer);
-        free(rps);
-    }
-    
-    // TBD add filtering back in?  More difficult now since data may contain NaNs.
-    // for now do filtering the same filtering we were doing before
-    
-    // pass filter
-    //    if (pass_order){
-    //        filtfilt(pass_filt_nums, pass_filt_dens, pass_order, raw_data_buffer, data_len, filt_data, NULL, NULL);
-    //        for (i = 0; i < data_len; ++i)
-    //            raw_data_buffer[i] = (si4) (filt_data[i] + 0.5);
-    //    }
-    //
-    //    // stop filter
-    //    if (stop_order) {
-    //        filtfilt(stop_filt_nums, stop_filt_dens, stop_order, raw_data_buffer, data_len, filt_data, NULL, NULL);
-    //        for (i = 0; i < data_len; ++i)
-    //            raw_data_buffer[i] = (si4) (filt_data[i] + 0.5);
-    //    }
-    //
-    
-    if (times_specified)
-        out_samp_period = (sf8) (((end_time - start_time) / 1000000.0) * channel->metadata.time_series_section_2->sampling_frequency) / (sf8) fixed_info->samps_per_page;
-    else
-        out_samp_period = (sf8) (end_samp - start_samp) / (sf8) fixed_info->samps_per_page;
-    
-    if (DBUG) printf("out_samp_period  %lf samps_per_page %d\n", out_samp_period, samps_per_page);
-    
-    dp = raw_data_buffer;
-    next_samp = 0;
-    curr_samp = 0;
-    last_val = *dp;
-    
-    //interpolate and copy to page_data
-    i=0;
-    if (DBUG) printf("interpolating and copying to pg data: next samp: %d, curr samp: %d\n", next_samp, curr_samp);
-    
-    //page_data[chan_idx] = 0.0;  // set first samp to zero (will probably get overwritten)
-    for (j=0;j<samps_per_page;j++)
-        page_data[(j * num_chans) + chan_idx] = (sf4) NAN;  // set all rest to NAN
-    
-    for (j=0; j < samps_per_page; ) {
-        current_val = *dp++;
-        if (curr_samp >= next_samp) {
-            if (current_val == RED_NAN || last_val == RED_NAN)
-                page_data[(j * num_chans) + chan_idx] = (sf4) NAN;  // python (numpy) recognizes this NAN value
-            else
-                page_data[(j * num_chans) + chan_idx] = (sf4) (((curr_samp - next_samp) * (current_val - last_val)) + last_val) * channel->metadata.time_series_section_2->units_conversion_factor;
-            next_samp += out_samp_period;
-            j++;
-        }
-        last_val = current_val;
-        curr_samp += 1.0;
-        
-        // check for over-running buffer
-        // this actually happens - is the logic bad for this loop?
-        // logic looks okay - but sometimes at the right-most page of a recording, it runs way past the end of raw_data_buffer.
-        // The way next_samp is initially caluclated might be incorrect in some cases.  If this becomes a big problem,
-        // it should be debugged more fully.
-        // Seems fixed now?
-        if (i >= num_samps)
-        {
-            if (DBUG) fprintf(stdout, "**** BUFFER OVERFLOW detected when downsampling %d  *****\n", j);
-                break;
+            // rps->block_header->start_time is already offset during RED_decode()
+            entry = block_cache_put(cache, index, k, rps->block_header->start_time, samples, (si4) rps->block_header->number_of_samples);
+            place_block(raw, num_samps, entry, start_time, samp_freq);
+            block_cache_release(cache, entry);
         }
-        
-        i++;
     }
-    
-    if (raw_data_buffer != NULL)
-        free(raw_data_buffer);
-    if (temp_data_buf != NULL)
-        free(temp_data_buf);
-    
-    return(NULL);
+    segment_blocks_release(index, blocks);
+    data_file_release(index, data_file);
 }
 
-
-#ifndef _WIN32
-static void set_rf_flag(int x)
+static void decode_split_lock(DECODE_SPLIT *split)
 {
-	read_files_flag = 1;
-	
-	return;
-}
+#ifndef _WIN32
+    pthread_mutex_lock(&split->lock);
 #else
-void CALLBACK set_rf_flag(HWND hwnd, UINT uMsg, UINT timerId, DWORD dwTime)
-{
-    while (1)
-    {
-        read_files_flag = 1;
-
-        //printf("RF TIMER\n");
-
-        Sleep(500);
-    }
-
-    return;
-}
+    EnterCriticalSection(&split->lock);
 #endif
+}
 
-
-static ui8 update_buffer_limits(char* buff_lim_path, double first_sec_written, double last_sec_written)
+static void decode_split_unlock(DECODE_SPLIT *split)
 {
-	FILE *bl_fp;
-	ui8 curr_time;
-	
-	curr_time = time(NULL);
-	if (DBUG) printf("updating buffer limits\n");
-	
-	// update buffer limits file
 #ifndef _WIN32
-	while ((bl_fp = fopen(buff_lim_path, "w")) == NULL) usleep((useconds_t) 100000);
+    pthread_mutex_unlock(&split->lock);
 #else
-	while ((bl_fp = fopen(buff_lim_path, "wb")) == NULL) Sleep(100);
+    LeaveCriticalSection(&split->lock);
 #endif
-	fprintf(bl_fp, "%0.12lf\n%0.12lf\n", first_sec_written, last_sec_written);
+}
+
+// decode pieces until none is left to start
+static void decode_split_work(DECODE_SPLIT *split, WORKER_ARENA *arena)
+{
+    si4 k;
+    
+    while (1) {
+        decode_split_lock(split);
+        k = split->next_piece;
+        if (k < split->n_pieces)
+            split->next_piece++;
+        decode_split_unlock(split);
+        if (k == split->n_pieces)
+            return;
+        
+        decode_blocks(split->read_task, split->piece_first[k], split->piece_first[k + 1] - 1, split->raw, split->num_samps, split->start_time,
+                      split->samp_freq, arena);
+        
+        decode_split_lock(split);
+        if (++split->n_done == split->n_pieces) {
 #ifndef _WIN32
-	fprintf(bl_fp, "%ld\n", curr_time); //add page server "heartbeat"
+            pthread_cond_broadcast(&split->done_cond);
 #else
-    fprintf(bl_fp, "%lld\n", curr_time);
+            WakeAllConditionVariable(&split->done_cond);
 #endif
-	fclose(bl_fp);
-	
-	return(curr_time);
-	
+        }
+        decode_split_unlock(split);
+    }
 }
 
-static si4 check_fud(char *path, sf8 num) 
+static void decode_split_release(DECODE_SPLIT *split)
 {
-    FILE *fp;
-    sf8 newnum;
-    si4 out_val;
+    si4 refs;
     
-    
-    if (DBUG) printf("in checkfud\n");
+    decode_split_lock(split);
+    refs = --split->refs;
+    decode_split_unlock(split);
+    if (refs > 0)
+        return;
 #ifndef _WIN32
-    while ((fp = fopen(path, "r")) == NULL) usleep((useconds_t) 100000); 
+    pthread_mutex_destroy(&split->lock);
+    pthread_cond_destroy(&split->done_cond);
 #else
-    while ((fp = fopen(path, "rb")) == NULL) Sleep(100); 
+    DeleteCriticalSection(&split->lock);
 #endif
-    if (DBUG) printf("wait done\n");
-
-    fscanf(fp, "%lf\n", &newnum); 
-    fclose(fp);
-    if (DBUG) printf("file closed\n");
-    
-    if (newnum == num) 
-        return(0);
-    else
-        return(1);
-
+    free(split);
 }
 
+// A helper runs whatever pieces are left when it starts, which may be none.
 #ifndef _WIN32
-static void *heartbeat_thread(void *argument)
+static void *decode_piece_thread(void *argument)
+#else
+DWORD WINAPI decode_piece_thread(LPVOID argument)
+#endif
 {
-    char *page_dir;
-    char file_name[4096];
-    FILE *fp;
-    sf8 ui_time;
+    DECODE_SPLIT *split;
     
-    page_dir = (THREAD_INFO *) argument;
-    fprintf(stderr, "page_dir == %s", page_dir);
+    split = (DECODE_SPLIT *) argument;
+    decode_split_work(split, worker_arena);
+    decode_split_release(split);
     
-    sprintf(file_name, "%sHEARTBEAT_UI", page_dir);
+    return(NULL);
+}
 
+// Decode a read task's blocks in up to n_pieces pieces of about the same compressed size.  The task's worker decodes
+// pieces itself while helpers queued on the pool take the others, and it only waits for pieces a helper has started,
+// so the split never holds it up when every worker is busy.
+static void decode_split(READ_TASK *read_task, si8 first_block, si8 last_block, si4 *raw, si8 num_samps, si8 start_time, sf8 samp_freq,
+                         WORKER_ARENA *arena)
+{
+    CHANNEL_INDEX *index;
+    SEGMENT_BLOCKS *blocks;
+    DECODE_SPLIT *split;
+    si8 n_blocks, b, seg_end, *cum_bytes;
+    si4 n_pieces, seg, k;
     
-    while (1)
-    {
-        
-        while ((fp = fopen(file_name, "r")) == NULL) usleep((useconds_t) 100000); //page_specs file
-        fscanf(fp, "%lf\n", &ui_time);
-        fclose(fp);
-        
-        if (time(NULL) - ui_time > 5)
-            exit(0);
-        
-        usleep((useconds_t) 500000);
-        
+    index = read_task->thread_info->index;
+    n_blocks = last_block - first_block + 1;
+    n_pieces = read_task->n_pieces;
+    if (n_pieces > (n_blocks / DECODE_PIECE_MIN_BLOCKS))
+        n_pieces = (si4) (n_blocks / DECODE_PIECE_MIN_BLOCKS);
+    if ((n_pieces < 2) || (read_task->pool == NULL)) {
+        decode_blocks(read_task, first_block, last_block, raw, num_samps, start_time, samp_freq, arena);
+        return;
     }
-}
+    
+    // compressed bytes of the blocks before each one (a segment whose index can't be read counts as none)
+    cum_bytes = (si8 *) malloc((size_t) (n_blocks + 1) * sizeof(si8));
+    cum_bytes[0] = 0;
+    seg = (si4) (upper_bound_si8(index->segment_first_block, 0, (si8) index->n_segments + 1, first_block) - 1);
+    for (b = first_block; b <= last_block; seg++) {
+        seg_end = index->segment_first_block[seg + 1];
+        blocks = segment_blocks_get(index, seg);
+        for (; (b <= last_block) && (b < seg_end); ++b)
+            cum_bytes[b - first_block + 1] = cum_bytes[b - first_block] + ((blocks != NULL) ? blocks->bytes[b - index->segment_first_block[seg]] : 0);
+        segment_blocks_release(index, blocks);
+    }
+    
+    // piece k starts at the first block with k / n_pieces of the bytes before it
+    split = (DECODE_SPLIT *) calloc((size_t) 1, sizeof(DECODE_SPLIT) + ((size_t) n_pieces + 1) * sizeof(si8));
+    split->piece_first = (si8 *) (split + 1);
+    split->piece_first[0] = first_block;
+    for (k = 1; k < n_pieces; ++k)
+        split->piece_first[k] = first_block + upper_bound_si8(cum_bytes, 0, n_blocks, ((cum_bytes[n_blocks] * k) / n_pieces) - 1);
+    split->piece_first[n_pieces] = last_block + 1;
+    free(cum_bytes);
+    
+    split->read_task = read_task;
+    split->raw = raw;
+    split->num_samps = num_samps;
+    split->start_time = start_time;
+    split->samp_freq = samp_freq;
+    split->n_pieces = n_pieces;
+    split->refs = n_pieces;
+#ifndef _WIN32
+    pthread_mutex_init(&split->lock, NULL);
+    pthread_cond_init(&split->done_cond, NULL);
 #else
-DWORD WINAPI heartbeat_thread(LPVOID argument)
-{
-    char* page_dir;
-    char file_name[4096];
-    FILE* fp;
-    sf8 ui_time;
+    InitializeCriticalSection(&split->lock);
+    InitializeConditionVariable(&split->done_cond);
+#endif
+    for (k = 1; k < n_pieces; ++k)
+        pool_submit(read_task->pool, decode_piece_thread, (void *) split);
+    
+    decode_split_work(split, arena);
+    decode_split_lock(split);
+    while (split->n_done < split->n_pieces) {
+#ifndef _WIN32
+        pthread_cond_wait(&split->done_cond, &split->lock);
+#else
+        SleepConditionVariableCS(&split->done_cond, &split->lock, INFINITE);
+#endif
+    }
+    decode_split_unlock(split);
+    decode_split_release(split);
+}
+
+// Kernels (see SIMD_KERNELS).  min_max() folds n samples into min_val and max_val, skipping RED_NAN: min_val starts
+// at 0x7FFFFFFF and max_val at RED_NAN, so max_val is still RED_NAN if every sample was.  interpolate() makes n
+// columns, column j lying frac[j] of the way back from raw[idx[j]] toward raw[idx[j] - 1] (the same arithmetic the
+// column walk in downsample_page always used), or NAN if either sample is RED_NAN.
+
+static void fill_si4_c(si4 *ptr, si4 value, si8 n)
+{
+    si8 i;
+    
+    for (i = 0; i < n; ++i)
+        ptr[i] = value;
+}
+
+static void fill_sf4_c(sf4 *ptr, sf4 value, si8 n)
+{
+    si8 i;
+    
+    for (i = 0; i < n; ++i)
+        ptr[i] = value;
+}
+
+static void min_max_c(si4 *raw, si8 n, si4 *min_val, si4 *max_val)
+{
+    si4 v, lo, hi;
+    si8 i;
+    
+    lo = *min_val;
+    hi = *max_val;
+    for (i = 0; i < n; ++i) {
+        v = raw[i];
+        hi = (v > hi) ? v : hi;
+        v = (v == RED_NAN) ? 0x7FFFFFFF : v;
+        lo = (v < lo) ? v : lo;
+    }
+    *min_val = lo;
+    *max_val = hi;
+}
+
+static void interpolate_c(si4 *raw, si4 *idx, sf8 *frac, si4 n, sf4 *out, sf8 units_conversion_factor)
+{
+    si4 j, current_val, last_val;
+    
+    for (j = 0; j < n; ++j) {
+        current_val = raw[idx[j]];
+        last_val = raw[(idx[j] > 0) ? (idx[j] - 1) : 0];
+        if ((current_val == RED_NAN) || (last_val == RED_NAN))
+            out[j] = (sf4) NAN;
+        else
+            out[j] = (sf4) ((sf4) ((frac[j] * (current_val - last_val)) + last_val) * units_conversion_factor);
+    }
+}
+
+#ifdef SIMD_X86
+TARGET_SSE41 static void fill_si4_sse41(si4 *ptr, si4 value, si8 n)
+{
+    __m128i v;
+    si8 i;
+    
+    v = _mm_set1_epi32(value);
+    for (i = 0; (i + 4) <= n; i += 4)
+        _mm_storeu_si128((__m128i *) (ptr + i), v);
+    fill_si4_c(ptr + i, value, n - i);
+}
+
+TARGET_SSE41 static void fill_sf4_sse41(sf4 *ptr, sf4 value, si8 n)
+{
+    __m128 v;
+    si8 i;
+    
+    v = _mm_set1_ps(value);
+    for (i = 0; (i + 4) <= n; i += 4)
+        _mm_storeu_ps(ptr + i, v);
+    fill_sf4_c(ptr + i, value, n - i);
+}
+
+TARGET_SSE41 static void min_max_sse41(si4 *raw, si8 n, si4 *min_val, si4 *max_val)
+{
+    __m128i v, lo, hi, red_nan, big;
+    si4 lanes[4], k;
+    si8 i;
+    
+    red_nan = _mm_set1_epi32(RED_NAN);
+    big = _mm_set1_epi32(0x7FFFFFFF);
+    lo = _mm_set1_epi32(*min_val);
+    hi = _mm_set1_epi32(*max_val);
+    for (i = 0; (i + 4) <= n; i += 4) {
+        v = _mm_loadu_si128((__m128i *) (raw + i));
+        hi = _mm_max_epi32(hi, v);
+        lo = _mm_min_epi32(lo, _mm_blendv_epi8(v, big, _mm_cmpeq_epi32(v, red_nan)));
+    }
+    _mm_storeu_si128((__m128i *) lanes, lo);
+    for (k = 0; k < 4; ++k)
+        *min_val = (lanes[k] < *min_val) ? lanes[k] : *min_val;
+    _mm_storeu_si128((__m128i *) lanes, hi);
+    for (k = 0; k < 4; ++k)
+        *max_val = (lanes[k] > *max_val) ? lanes[k] : *max_val;
+    min_max_c(raw + i, n - i, min_val, max_val);
+}
+
+TARGET_SSE41 static void interpolate_sse41(si4 *raw, si4 *idx, sf8 *frac, si4 n, sf4 *out, sf8 units_conversion_factor)
+{
+    __m128i cur, last, red_nan, nan_mask;
+    __m128d lo, hi, ucf;
+    __m128 result;
+    si4 j, p0, p1, p2, p3;
+    
+    red_nan = _mm_set1_epi32(RED_NAN);
+    ucf = _mm_set1_pd(units_conversion_factor);
+    for (j = 0; (j + 4) <= n; j += 4) {
+        cur = _mm_set_epi32(raw[idx[j + 3]], raw[idx[j + 2]], raw[idx[j + 1]], raw[idx[j]]);
+        p0 = (idx[j] > 0) ? (idx[j] - 1) : 0;
+        p1 = (idx[j + 1] > 0) ? (idx[j + 1] - 1) : 0;
+        p2 = (idx[j + 2] > 0) ? (idx[j + 2] - 1) : 0;
+        p3 = (idx[j + 3] > 0) ? (idx[j + 3] - 1) : 0;
+        last = _mm_set_epi32(raw[p3], raw[p2], raw[p1], raw[p0]);
+        nan_mask = _mm_or_si128(_mm_cmpeq_epi32(cur, red_nan), _mm_cmpeq_epi32(last, red_nan));
+        cur = _mm_sub_epi32(cur, last);
+        lo = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(frac + j), _mm_cvtepi32_pd(cur)), _mm_cvtepi32_pd(last));
+        hi = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(frac + j + 2), _mm_cvtepi32_pd(_mm_srli_si128(cur, 8))), _mm_cvtepi32_pd(_mm_srli_si128(last, 8)));
+        // (rounded to sf4 before scaling, as the scalar code does)
+        lo = _mm_cvtps_pd(_mm_cvtpd_ps(lo));
+        hi = _mm_cvtps_pd(_mm_cvtpd_ps(hi));
+        result = _mm_movelh_ps(_mm_cvtpd_ps(_mm_mul_pd(lo, ucf)), _mm_cvtpd_ps(_mm_mul_pd(hi, ucf)));
+        result = _mm_blendv_ps(result, _mm_set1_ps((sf4) NAN), _mm_castsi128_ps(nan_mask));
+        _mm_storeu_ps(out + j, result);
+    }
+    interpolate_c(raw, idx + j, frac + j, n - j, out + j, units_conversion_factor);
+}
+
+TARGET_AVX2 static void fill_si4_avx2(si4 *ptr, si4 value, si8 n)
+{
+    __m256i v;
+    si8 i;
+    
+    v = _mm256_set1_epi32(value);
+    for (i = 0; (i + 8) <= n; i += 8)
+        _mm256_storeu_si256((__m256i *) (ptr + i), v);
+    fill_si4_c(ptr + i, value, n - i);
+}
+
+TARGET_AVX2 static void fill_sf4_avx2(sf4 *ptr, sf4 value, si8 n)
+{
+    __m256 v;
+    si8 i;
+    
+    v = _mm256_set1_ps(value);
+    for (i = 0; (i + 8) <= n; i += 8)
+        _mm256_storeu_ps(ptr + i, v);
+    fill_sf4_c(ptr + i, value, n - i);
+}
+
+TARGET_AVX2 static void min_max_avx2(si4 *raw, si8 n, si4 *min_val, si4 *max_val)
+{
+    __m256i v, lo, hi, red_nan, big;
+    si4 lanes[8], k;
+    si8 i;
+    
+    red_nan = _mm256_set1_epi32(RED_NAN);
+    big = _mm256_set1_epi32(0x7FFFFFFF);
+    lo = _mm256_set1_epi32(*min_val);
+    hi = _mm256_set1_epi32(*max_val);
+    for (i = 0; (i + 8) <= n; i += 8) {
+        v = _mm256_loadu_si256((__m256i *) (raw + i));
+        hi = _mm256_max_epi32(hi, v);
+        lo = _mm256_min_epi32(lo, _mm256_blendv_epi8(v, big, _mm256_cmpeq_epi32(v, red_nan)));
+    }
+    _mm256_storeu_si256((__m256i *) lanes, lo);
+    for (k = 0; k < 8; ++k)
+        *min_val = (lanes[k] < *min_val) ? lanes[k] : *min_val;
+    _mm256_storeu_si256((__m256i *) lanes, hi);
+    for (k = 0; k < 8; ++k)
+        *max_val = (lanes[k] > *max_val) ? lanes[k] : *max_val;
+    min_max_c(raw + i, n - i, min_val, max_val);
+}
+
+TARGET_AVX2 static void interpolate_avx2(si4 *raw, si4 *idx, sf8 *frac, si4 n, sf4 *out, sf8 units_conversion_factor)
+{
+    __m128i vidx, vprev, cur, last, red_nan, nan_mask;
+    __m256d val, ucf;
+    __m128 result;
+    si4 j;
+    
+    red_nan = _mm_set1_epi32(RED_NAN);
+    ucf = _mm256_set1_pd(units_conversion_factor);
+    for (j = 0; (j + 4) <= n; j += 4) {
+        vidx = _mm_loadu_si128((__m128i *) (idx + j));
+        vprev = _mm_max_epi32(_mm_sub_epi32(vidx, _mm_set1_epi32(1)), _mm_setzero_si128());
+        cur = _mm_i32gather_epi32(raw, vidx, 4);
+        last = _mm_i32gather_epi32(raw, vprev, 4);
+        nan_mask = _mm_or_si128(_mm_cmpeq_epi32(cur, red_nan), _mm_cmpeq_epi32(last, red_nan));
+        val = _mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(frac + j), _mm256_cvtepi32_pd(_mm_sub_epi32(cur, last))), _mm256_cvtepi32_pd(last));
+        // (rounded to sf4 before scaling, as the scalar code does)
+        val = _mm256_cvtps_pd(_mm256_cvtpd_ps(val));
+        result = _mm256_cvtpd_ps(_mm256_mul_pd(val, ucf));
+        result = _mm_blendv_ps(result, _mm_set1_ps((sf4) NAN), _mm_castsi128_ps(nan_mask));
+        _mm_storeu_ps(out + j, result);
+    }
+    interpolate_c(raw, idx + j, frac + j, n - j, out + j, units_conversion_factor);
+}
+
+static si4 cpu_has_sse41(void)
+{
+#ifdef _MSC_VER
+    si4 info[4];
+    
+    __cpuid(info, 1);
+    return((info[2] >> 19) & 1);
+#else
+    return(__builtin_cpu_supports("sse4.1"));
+#endif
+}
+
+static si4 cpu_has_avx2(void)
+{
+#ifdef _MSC_VER
+    si4 info[4];
+    
+    // the os also has to save the ymm registers
+    __cpuid(info, 1);
+    if (!((info[2] >> 27) & 1) || ((_xgetbv(0) & 6) != 6))
+        return(0);
+    __cpuidex(info, 7, 0);
+    return((info[1] >> 5) & 1);
+#else
+    return(__builtin_cpu_supports("avx2"));
+#endif
+}
+#endif  // SIMD_X86
+
+// pick the kernels for this cpu (until then, and on other cpus, they are the plain C ones)
+static void simd_init(void)
+{
+#ifdef SIMD_X86
+    if (cpu_has_avx2()) {
+        simd.fill_si4 = fill_si4_avx2;
+        simd.fill_sf4 = fill_sf4_avx2;
+        simd.min_max = min_max_avx2;
+        simd.interpolate = interpolate_avx2;
+        simd.name = "avx2";
+    }
+    else if (cpu_has_sse41()) {
+        simd.fill_si4 = fill_si4_sse41;
+        simd.fill_sf4 = fill_sf4_sse41;
+        simd.min_max = min_max_sse41;
+        simd.interpolate = interpolate_sse41;
+        simd.name = "sse4.1";
+    }
+#endif
+    if (DBUG) printf("using %s kernels\n", simd.name);
+}
+
+// Set up a channel's display filters for its sampling frequency: a second-order Butterworth high-pass and low-pass,
+// and a notch (RBJ cookbook biquads).  Cutoffs that are off, or at or above Nyquist, are left out.
+static void filter_design(CHANNEL_FILTER *filter, FIXED_INFO *fixed_info, sf8 samp_freq)
+{
+    si4 s, type;
+    sf8 hz, q, w0, cos_w0, alpha, a0;
+    
+    memset(filter, 0, sizeof(CHANNEL_FILTER));
+    filter->next_time = -1;
+    for (type = 0; type < 3; ++type)
+    {
+        hz = (type == 0) ? fixed_info->highpass_hz : ((type == 1) ? fixed_info->lowpass_hz : fixed_info->notch_hz);
+        if ((hz <= 0.0) || (hz >= (samp_freq / 2.0)))
+            continue;
+        q = (type == 2) ? FILTER_NOTCH_Q : FILTER_BUTTERWORTH_Q;
+        w0 = 2.0 * 3.14159265358979323846 * hz / samp_freq;
+        cos_w0 = cos(w0);
+        alpha = sin(w0) / (2.0 * q);
+        a0 = 1.0 + alpha;
+        s = filter->n_sections++;
+        if (type == 0) {
+            filter->b0[s] = ((1.0 + cos_w0) / 2.0) / a0;
+            filter->b1[s] = -(1.0 + cos_w0) / a0;
+            filter->b2[s] = filter->b0[s];
+        }
+        else if (type == 1) {
+            filter->b0[s] = ((1.0 - cos_w0) / 2.0) / a0;
+            filter->b1[s] = (1.0 - cos_w0) / a0;
+            filter->b2[s] = filter->b0[s];
+        }
+        else {
+            filter->b0[s] = 1.0 / a0;
+            filter->b1[s] = (-2.0 * cos_w0) / a0;
+            filter->b2[s] = filter->b0[s];
+        }
+        filter->a1[s] = (-2.0 * cos_w0) / a0;
+        filter->a2[s] = (1.0 - alpha) / a0;
+    }
+}
+
+// Start the filter as if the input had always been x, so that a read that doesn't continue the previous one (a seek,
+// paging backward, or data after a gap) doesn't begin with the filter's step response.
+static void filter_settle(CHANNEL_FILTER *filter, sf8 x)
+{
+    si4 s;
+    sf8 y;
+    
+    for (s = 0; s < filter->n_sections; ++s) {
+        y = x * (filter->b0[s] + filter->b1[s] + filter->b2[s]) / (1.0 + filter->a1[s] + filter->a2[s]);
+        filter->z2[s] = (filter->b2[s] * x) - (filter->a2[s] * y);
+        filter->z1[s] = (filter->b1[s] * x) - (filter->a1[s] * y) + filter->z2[s];
+        x = y;
+    }
+}
+
+// Filter a batch of decoded samples in place.  The state carries on from the channel's previous batch when this one
+// starts where that one ended (to within half a sample); otherwise it is settled on the first sample.  RED_NAN
+// samples are left alone, and the filter settles again on the first sample after them.  Unless keep_state is set,
+// the channel's state is left as it was.
+// The cascade is plain C rather than a kernel in the simd table: each output sample depends on the one before, so
+// the lanes would have to hold different channels, and each channel's batch is decoded and filtered by its own read
+// task (the pool runs the channels in parallel instead).
+static void filter_run(CHANNEL_FILTER *filter, si4 *raw, si8 num_samps, si8 start_time, si8 end_time, sf8 samp_freq, si4 keep_state)
+{
+    si4 s, settled;
+    si8 i;
+    sf8 x, y;
+    CHANNEL_FILTER scratch;
+    
+    if (!keep_state) {
+        scratch = *filter;
+        filter = &scratch;
+    }
+    settled = ((filter->next_time >= 0) && (fabs((sf8) (start_time - filter->next_time)) < (500000.0 / samp_freq)));
+    for (i = 0; i < num_samps; ++i)
+    {
+        if (raw[i] == RED_NAN) {
+            settled = 0;
+            continue;
+        }
+        x = (sf8) raw[i];
+        if (!settled) {
+            filter_settle(filter, x);
+            settled = 1;
+        }
+        for (s = 0; s < filter->n_sections; ++s) {
+            y = (filter->b0[s] * x) + filter->z1[s];
+            filter->z1[s] = (filter->b1[s] * x) - (filter->a1[s] * y) + filter->z2[s];
+            filter->z2[s] = (filter->b2[s] * x) - (filter->a2[s] * y);
+            x = y;
+        }
+        // (clamped short of RED_NAN)
+        if (x > 2147483647.0)
+            x = 2147483647.0;
+        else if (x < -2147483647.0)
+            x = -2147483647.0;
+        raw[i] = (si4) floor(x + 0.5);
+    }
+    // a batch ending in a gap leaves nothing to carry on from
+    filter->next_time = settled ? end_time : -1;
+}
+
+// Add one montage line from the page specs to *montage_ptr (created on the first one):
+//     average c<n> c<n> ...                    a common-average group; groups are a0, a1, ... in the order given
+//     trace <source> <weight> <source> <weight> ...   a derived trace; a source is c<n> (channel) or a<n> (group)
+// so a bipolar trace is "trace c3 1 c4 -1", an average reference "trace c3 1 a0 -1", and a Laplacian is a trace
+// with weights on the neighbors.  Returns 0 for a line that can't be used.
+static si4 montage_parse_line(MONTAGE **montage_ptr, si1 *line, si4 num_chans)
+{
+    MONTAGE *montage;
+    MONTAGE_GROUP group;
+    MONTAGE_TRACE trace;
+    si1 *cursor, token[64];
+    si4 used, n;
+    sf8 weight;
+    
+    montage = *montage_ptr;
+    if (montage == NULL) {
+        montage = (MONTAGE *) calloc((size_t) 1, sizeof(MONTAGE));
+        montage->num_chans = num_chans;
+        montage->channel_used = (si1 *) calloc((size_t) num_chans, sizeof(si1));
+        *montage_ptr = montage;
+    }
+    
+    if (!strncmp(line, "average ", 8)) {
+        memset(&group, 0, sizeof(MONTAGE_GROUP));
+        group.members = (si4 *) calloc((size_t) num_chans, sizeof(si4));
+        for (cursor = line + 8; sscanf(cursor, "%63s%n", token, &used) == 1; cursor += used) {
+            if ((sscanf(token, "c%d", &n) != 1) || (n < 0) || (n >= num_chans) || (group.n_members == num_chans)) {
+                free(group.members);
+                return(0);
+            }
+            group.members[group.n_members++] = n;
+        }
+        if (group.n_members == 0) {
+            free(group.members);
+            return(0);
+        }
+        montage->groups = (MONTAGE_GROUP *) realloc(montage->groups, (size_t) (montage->n_groups + 1) * sizeof(MONTAGE_GROUP));
+        montage->groups[montage->n_groups++] = group;
+        
+        return(1);
+    }
+    
+    memset(&trace, 0, sizeof(MONTAGE_TRACE));
+    for (cursor = line + 6; sscanf(cursor, "%63s%n", token, &used) == 1; cursor += used) {
+        if (trace.n_terms == MONTAGE_MAX_TERMS)
+            return(0);
+        if ((sscanf(token, "c%d", &n) == 1) && (n >= 0) && (n < num_chans))
+            trace.sources[trace.n_terms] = n;
+        else if ((sscanf(token, "a%d", &n) == 1) && (n >= 0) && (n < montage->n_groups))
+            trace.sources[trace.n_terms] = -1 - n;
+        else
+            return(0);
+        cursor += used;
+        if (sscanf(cursor, "%lf%n", &weight, &used) != 1)
+            return(0);
+        trace.weights[trace.n_terms++] = weight;
+    }
+    if (trace.n_terms == 0)
+        return(0);
+    montage->traces = (MONTAGE_TRACE *) realloc(montage->traces, (size_t) (montage->n_traces + 1) * sizeof(MONTAGE_TRACE));
+    montage->traces[montage->n_traces++] = trace;
+    
+    return(1);
+}
+
+// once the channels are open: sampling frequencies, units and filters of the groups and traces, and which channels
+// have to be decoded
+static void montage_setup(MONTAGE *montage, THREAD_INFO *thread_info, FIXED_INFO *fixed_info)
+{
+    si4 g, t, k, src;
+    MONTAGE_TRACE *trace;
+    
+    memset(montage->channel_used, 0, (size_t) montage->num_chans);
+    for (g = 0; g < montage->n_groups; ++g) {
+        montage->groups[g].samp_freq = thread_info[montage->groups[g].members[0]].native_fs;
+        for (k = 0; k < montage->groups[g].n_members; ++k)
+            montage->channel_used[montage->groups[g].members[k]] = 1;
+    }
+    for (t = 0; t < montage->n_traces; ++t) {
+        trace = montage->traces + t;
+        src = trace->sources[0];
+        if (src >= 0) {
+            trace->samp_freq = thread_info[src].native_fs;
+            trace->units_conversion_factor = thread_info[src].index->units_conversion_factor;
+        }
+        else {
+            src = montage->groups[-1 - src].members[0];
+            trace->samp_freq = montage->groups[-1 - trace->sources[0]].samp_freq;
+            trace->units_conversion_factor = thread_info[src].index->units_conversion_factor;
+        }
+        if (trace->units_conversion_factor == 0.0)
+            trace->units_conversion_factor = 1.0;
+        for (k = 0; k < trace->n_terms; ++k) {
+            if (trace->sources[k] >= 0)
+                montage->channel_used[trace->sources[k]] = 1;
+        }
+        filter_design(&trace->filter, fixed_info, trace->samp_freq);
+    }
+}
+
+static void montage_free(MONTAGE *montage)
+{
+    si4 g;
+    
+    if (montage == NULL)
+        return;
+    for (g = 0; g < montage->n_groups; ++g) {
+        free(montage->groups[g].members);
+        if (montage->groups[g].mean != NULL)
+            free(montage->groups[g].mean);
+    }
+    free(montage->groups);
+    free(montage->traces);
+    free(montage->channel_used);
+    free(montage);
+}
+
+// sample i of a batch at samp_freq, from a source decoded at source_freq (the nearest earlier sample)
+static si8 montage_source_sample(si8 i, sf8 samp_freq, sf8 source_freq)
+{
+    if (source_freq == samp_freq)
+        return(i);
+    
+    return((si8) (i * (source_freq / samp_freq)));
+}
+
+// the mean of a montage group over the batch, in physical units, skipping members with no data
+#ifndef _WIN32
+static void *montage_group_thread(void *argument)
+#else
+DWORD WINAPI montage_group_thread(LPVOID argument)
+#endif
+{
+    MONTAGE_TASK *task;
+    MONTAGE_GROUP *group;
+    THREAD_INFO *member;
+    si4 k, count, v;
+    si8 i, n, s;
+    sf8 sum;
+    
+    task = (MONTAGE_TASK *) argument;
+    group = task->montage->groups + task->index;
+    n = (si8) (((task->n_pages * task->thread_info->fixed_info->secs_per_page) * group->samp_freq) + 0.5);
+    group->mean = (sf4 *) arena_reserve(group->mean, &group->mean_count, (size_t) n * sizeof(sf4));
+    group->num_samps = n;
+    for (i = 0; i < n; ++i)
+    {
+        sum = 0.0;
+        count = 0;
+        for (k = 0; k < group->n_members; ++k) {
+            member = task->thread_info + group->members[k];
+            s = montage_source_sample(i, group->samp_freq, member->native_fs);
+            if (s >= member->source_samps)
+                continue;
+            v = member->source_raw[s];
+            if (v == RED_NAN)
+                continue;
+            sum += v * member->index->units_conversion_factor;
+            count++;
+        }
+        group->mean[i] = (count > 0) ? (sf4) (sum / count) : (sf4) NAN;
+    }
+    
+    return(NULL);
+}
+
+// One derived trace of a batch: the weighted sum of its sources, filtered and cut into pages like a channel's samples
+// in read_thread.  A sample is RED_NAN if any of its sources has no data there.
+#ifndef _WIN32
+static void *montage_trace_thread(void *argument)
+#else
+DWORD WINAPI montage_trace_thread(LPVOID argument)
+#endif
+{
+    MONTAGE_TASK *task;
+    MONTAGE_TRACE *trace;
+    MONTAGE_GROUP *group;
+    THREAD_INFO *source;
+    FIXED_INFO *fixed_info;
+    WORKER_ARENA *arena, local_arena;
+    si4 k, v, *raw;
+    si8 i, n, s, start_time, end_time;
+    sf8 sum, m;
+    
+    task = (MONTAGE_TASK *) argument;
+    trace = task->montage->traces + task->index;
+    fixed_info = task->thread_info->fixed_info;
+    start_time = task->page_start_sec * 1000000;
+    end_time = (task->page_start_sec + (task->n_pages * fixed_info->secs_per_page)) * 1000000;
+    n = (si8) ((((end_time - start_time) / 1000000.0) * trace->samp_freq) + 0.5);
+    
+    arena = worker_arena;
+    if (arena == NULL) {
+        memset(&local_arena, 0, sizeof(WORKER_ARENA));
+        arena = &local_arena;
+    }
+    arena->raw = (si4 *) arena_reserve(arena->raw, &arena->raw_count, (size_t) n * sizeof(si4));
+    raw = arena->raw;
+    
+    for (i = 0; i < n; ++i)
+    {
+        sum = 0.0;
+        for (k = 0; k < trace->n_terms; ++k) {
+            if (trace->sources[k] >= 0) {
+                source = task->thread_info + trace->sources[k];
+                s = montage_source_sample(i, trace->samp_freq, source->native_fs);
+                if ((s >= source->source_samps) || ((v = source->source_raw[s]) == RED_NAN))
+                    break;
+                sum += trace->weights[k] * v * source->index->units_conversion_factor;
+            }
+            else {
+                group = task->montage->groups + (-1 - trace->sources[k]);
+                s = montage_source_sample(i, trace->samp_freq, group->samp_freq);
+                if ((s >= group->num_samps) || isnan(m = group->mean[s]))
+                    break;
+                sum += trace->weights[k] * m;
+            }
+        }
+        if (k < trace->n_terms) {
+            raw[i] = RED_NAN;
+            continue;
+        }
+        // back to the trace's units (clamped short of RED_NAN)
+        sum /= trace->units_conversion_factor;
+        if (sum > 2147483647.0)
+            sum = 2147483647.0;
+        else if (sum < -2147483647.0)
+            sum = -2147483647.0;
+        raw[i] = (si4) floor(sum + 0.5);
+    }
+    
+    if (trace->filter.n_sections > 0)
+        filter_run(&trace->filter, raw, n, start_time, end_time, trace->samp_freq, task->direction > 0);
+    batch_to_pages(raw, n, trace->samp_freq, task->page_start_sec, task->n_pages, task->page_data, NULL, fixed_info, task->index,
+                   trace->units_conversion_factor);
+    
+    if (arena == &local_arena)
+        arena_free(arena);
+    
+    return(NULL);
+}
+
+// Cut a batch of samples (starting at page_start_sec) into its pages, and downsample each into the given row of its
+// page.  Pages already served elsewhere (page_served[p] set) are skipped.
+static void batch_to_pages(si4 *raw, si8 num_samps, sf8 samp_freq, sf8 page_start_sec, si4 n_pages, sf4 **page_data, si4 *page_served,
+                           FIXED_INFO *fixed_info, si4 row, sf8 units_conversion_factor)
+{
+    si4 p;
+    si8 start_time, page_start_time, page_end_time, page_offset, page_samps;
+    sf8 out_samp_period;
+    
+    start_time = page_start_sec * 1000000;
+    for (p = 0; p < n_pages; ++p)
+    {
+        if ((page_served != NULL) && page_served[p])
+            continue;
+        page_start_time = (page_start_sec + (p * fixed_info->secs_per_page)) * 1000000;
+        page_end_time = (page_start_sec + ((p + 1) * fixed_info->secs_per_page)) * 1000000;
+        page_offset = (si8) ((((page_start_time - start_time) / 1000000.0) * samp_freq) + 0.5);
+        page_samps = (si8) ((((page_end_time - page_start_time) / 1000000.0) * samp_freq) + 0.5);
+        if ((page_offset + page_samps) > num_samps)
+            page_samps = num_samps - page_offset;
+        if (page_samps < 1) {
+            page_offset = 0;
+            page_samps = 1;
+        }
+        out_samp_period = (sf8) (((page_end_time - page_start_time) / 1000000.0) * samp_freq) / (sf8) fixed_info->samps_per_page;
+        if (DBUG) printf("out_samp_period  %lf samps_per_page %d\n", out_samp_period, fixed_info->samps_per_page);
+        
+        downsample_page(raw + page_offset, page_samps, out_samp_period, page_row(page_data[p], fixed_info, row), fixed_info, units_conversion_factor);
+    }
+}
+
+// a channel's row within a page slot
+static sf4 *page_row(sf4 *page_data, FIXED_INFO *fixed_info, si4 chan_idx)
+{
+    return(page_data + ((size_t) chan_idx * (size_t) fixed_info->samps_per_page * (size_t) fixed_info->samp_values));
+}
+
+// One page of one channel from its raw samples, into the channel's row of the page: either the envelope, or one
+// value per column interpolated between the raw samples.
+static void downsample_page(si4 *raw, si8 num_samps, sf8 out_samp_period, sf4 *row, FIXED_INFO *fixed_info, sf8 units_conversion_factor)
+{
+    si4 j, n, samps_per_page, col_idx[INTERP_CHUNK];
+    si8 k;
+    sf8 next_samp, col_frac[INTERP_CHUNK];
+    
+    samps_per_page = fixed_info->samps_per_page;
+    
+    if (fixed_info->display_mode == DISPLAY_ENVELOPE)
+    {
+        envelope_decimate(raw, num_samps, out_samp_period, samps_per_page, row, 1, units_conversion_factor);
+        return;
+    }
+    
+    // Column j takes the first raw sample at or after j * out_samp_period (and after the previous column's sample),
+    // interpolated back toward the one before it.  Columns are placed without walking the samples, then made a
+    // chunk at a time by the interpolate kernel.
+    next_samp = 0;
+    k = 0;
+    for (j = 0; j < samps_per_page; j += n)
+    {
+        for (n = 0; (n < INTERP_CHUNK) && ((j + n) < samps_per_page); ++n) {
+            if ((sf8) k < next_samp)
+                k = (si8) ceil(next_samp);
+            if (k >= num_samps)
+                break;
+            col_idx[n] = (si4) k;
+            col_frac[n] = (sf8) k - next_samp;
+            next_samp += out_samp_period;
+            k++;
+        }
+        simd.interpolate(raw, col_idx, col_frac, n, row + j, units_conversion_factor);
+        if (k >= num_samps) {
+            j += n;
+            break;
+        }
+    }
+    
+    // at the right-most page of a recording the columns can run past the samples; the rest are NAN
+    if (j < samps_per_page) {
+        if (DBUG) fprintf(stdout, "**** BUFFER OVERFLOW detected when downsampling %d  *****\n", j);
+        simd.fill_sf4(row + j, (sf4) NAN, samps_per_page - j);
+    }
+}
+
+// write one envelope column, scaled to physical units; max_val of RED_NAN means the column had no valid samples
+static void envelope_store(sf4 *out, si4 out_stride, si4 col, si4 min_val, si4 max_val, sf8 units_conversion_factor)
+{
+    sf4 lo, hi, temp;
+    
+    if (max_val == RED_NAN) {
+        lo = hi = (sf4) NAN;
+    }
+    else {
+        lo = (sf4) (min_val * units_conversion_factor);
+        hi = (sf4) (max_val * units_conversion_factor);
+        if (lo > hi) {  // negative conversion factor
+            temp = lo;
+            lo = hi;
+            hi = temp;
+        }
+    }
+    out[(2 * col) * out_stride] = lo;
+    out[((2 * col) + 1) * out_stride] = hi;
+}
+
+// Envelope decimation: a single pass over the decoded samples, writing the (min, max) of the samples under
+// each output column to out[2j], out[2j+1] (times out_stride).  The min_max kernel skips RED_NAN samples without
+// branching (RED_NAN is the smallest si4, so it can never be the max).  Columns with no valid samples are NAN.
+static void envelope_decimate(si4 *raw, si8 num_samps, sf8 samps_per_col, si4 n_cols, sf4 *out, si4 out_stride, sf8 units_conversion_factor)
+{
+    si4 j, min_val, max_val;
+    si8 bin_start, bin_end;
+    
+    for (j = 0; j < n_cols; ++j) {
+        bin_start = (si8) (j * samps_per_col);
+        bin_end = (si8) ((j + 1) * samps_per_col);
+        // when zoomed in past the native rate a column still gets the nearest sample
+        if (bin_end <= bin_start)
+            bin_end = bin_start + 1;
+        if (bin_end > num_samps)
+            bin_end = num_samps;
+        
+        min_val = 0x7FFFFFFF;
+        max_val = RED_NAN;
+        simd.min_max(raw + bin_start, bin_end - bin_start, &min_val, &max_val);
+        envelope_store(out, out_stride, j, min_val, max_val, units_conversion_factor);
+    }
+}
+
+static ui8 update_buffer_limits(RING_BUFFER *ring, sf8 first_sec_written, sf8 last_sec_written)
+{
+	RING_HEADER *header;
+	ui8 curr_time;
+	
+	curr_time = time(NULL);
+	if (DBUG) printf("updating buffer limits\n");
+	
+	// update buffer limits in the ring header
+	header = ring->header;
+	header->generation++;
+	MEMORY_BARRIER();
+	header->first_sec = first_sec_written;
+	header->last_sec = last_sec_written;
+	header->heartbeat = (si8) curr_time;  // page server "heartbeat"
+	MEMORY_BARRIER();
+	header->generation++;
+	
+	return(curr_time);
+	
+}
+
+static si4 get_num_cores(void)
+{
+    si4 n_cores;
+#ifndef _WIN32
+    n_cores = (si4) sysconf(_SC_NPROCESSORS_ONLN);
+#else
+    SYSTEM_INFO sys_info;
+    
+    GetSystemInfo(&sys_info);
+    n_cores = (si4) sys_info.dwNumberOfProcessors;
+#endif
+    if (n_cores < 1)
+        n_cores = 1;
+    
+    return(n_cores);
+}
+
+static void queue_init(TASK_QUEUE *queue)
+{
+    queue->size = 256;
+    queue->head = 0;
+    queue->count = 0;
+    queue->tasks = (POOL_TASK *) calloc((size_t) queue->size, sizeof(POOL_TASK));
+}
+
+// add a task to the back of the queue; the queue grows if it is full
+static void queue_push(TASK_QUEUE *queue, POOL_FUNC func, void *arg)
+{
+    POOL_TASK *new_tasks;
+    si4 i, tail;
+    
+    if (queue->count == queue->size)
+    {
+        new_tasks = (POOL_TASK *) calloc((size_t) queue->size * 2, sizeof(POOL_TASK));
+        for (i = 0; i < queue->count; ++i)
+            new_tasks[i] = queue->tasks[(queue->head + i) % queue->size];
+        free(queue->tasks);
+        queue->tasks = new_tasks;
+        queue->head = 0;
+        queue->size *= 2;
+    }
+    tail = (queue->head + queue->count) % queue->size;
+    queue->tasks[tail].func = func;
+    queue->tasks[tail].arg = arg;
+    queue->count++;
+}
+
+static POOL_TASK queue_pop(TASK_QUEUE *queue)
+{
+    POOL_TASK task;
+    
+    task = queue->tasks[queue->head];
+    queue->head = (queue->head + 1) % queue->size;
+    queue->count--;
+    
+    return(task);
+}
+
+static void pool_init(WORKER_POOL *pool, si4 num_workers)
+{
+    si4 i;
+#ifdef _WIN32
+    DWORD ThreadId;
+#endif
+    
+    pool->num_workers = num_workers;
+    pool->quit = 0;
+    pool->pending = 0;
+    pool->background_pending = 0;
+    pool->background_running = 0;
+    pool->max_background = (num_workers > 1) ? (num_workers / 2) : 1;
+    queue_init(&pool->queue);
+    queue_init(&pool->background_queue);
+#ifndef _WIN32
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->workers = (pthread_t *) calloc((size_t) num_workers, sizeof(pthread_t));
+    for (i = 0; i < num_workers; ++i)
+        pthread_create(pool->workers + i, NULL, pool_worker_thread, (void *) pool);
+#else
+    InitializeCriticalSection(&pool->lock);
+    InitializeConditionVariable(&pool->work_cond);
+    InitializeConditionVariable(&pool->done_cond);
+    pool->workers = (HANDLE *) calloc((size_t) num_workers, sizeof(HANDLE));
+    for (i = 0; i < num_workers; ++i)
+        pool->workers[i] = CreateThread(NULL, 0, pool_worker_thread, (void*) pool, 0, &ThreadId);
+#endif
+    if (DBUG) printf("worker pool started with %d threads\n", num_workers);
+}
+
+static void pool_lock(WORKER_POOL *pool)
+{
+#ifndef _WIN32
+    pthread_mutex_lock(&pool->lock);
+#else
+    EnterCriticalSection(&pool->lock);
+#endif
+}
+
+static void pool_unlock(WORKER_POOL *pool)
+{
+#ifndef _WIN32
+    pthread_mutex_unlock(&pool->lock);
+#else
+    LeaveCriticalSection(&pool->lock);
+#endif
+}
+
+static void pool_signal(WORKER_POOL *pool)
+{
+#ifndef _WIN32
+    pthread_cond_signal(&pool->work_cond);
+#else
+    WakeConditionVariable(&pool->work_cond);
+#endif
+}
+
+static void pool_submit(WORKER_POOL *pool, POOL_FUNC func, void *arg)
+{
+    pool_lock(pool);
+    queue_push(&pool->queue, func, arg);
+    pool->pending++;
+    pool_signal(pool);
+    pool_unlock(pool);
+}
+
+static void pool_submit_background(WORKER_POOL *pool, POOL_FUNC func, void *arg)
+{
+    pool_lock(pool);
+    queue_push(&pool->background_queue, func, arg);
+    pool->background_pending++;
+    pool_signal(pool);
+    pool_unlock(pool);
+}
+
+// block until every submitted foreground task has finished running
+static void pool_wait(WORKER_POOL *pool)
+{
+    pool_lock(pool);
+    while (pool->pending > 0) {
+#ifndef _WIN32
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+#else
+        SleepConditionVariableCS(&pool->done_cond, &pool->lock, INFINITE);
+#endif
+    }
+    pool_unlock(pool);
+}
+
+// block until every submitted background task has finished running
+static void pool_wait_background(WORKER_POOL *pool)
+{
+    pool_lock(pool);
+    while (pool->background_pending > 0) {
+#ifndef _WIN32
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+#else
+        SleepConditionVariableCS(&pool->done_cond, &pool->lock, INFINITE);
+#endif
+    }
+    pool_unlock(pool);
+}
+
+#ifndef _WIN32
+static void *pool_worker_thread(void *argument)
+#else
+DWORD WINAPI pool_worker_thread(LPVOID argument)
+#endif
+{
+    WORKER_POOL *pool;
+    POOL_TASK task;
+    si4 background;
+    WORKER_ARENA arena;
+    
+    pool = (WORKER_POOL *) argument;
+    memset(&arena, 0, sizeof(WORKER_ARENA));
+    worker_arena = &arena;
+    
+    pool_lock(pool);
+    while (1)
+    {
+        while ((pool->queue.count == 0) && (pool->quit == 0) &&
+               ((pool->background_queue.count == 0) || (pool->background_running >= pool->max_background))) {
+#ifndef _WIN32
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+#else
+            SleepConditionVariableCS(&pool->work_cond, &pool->lock, INFINITE);
+#endif
+        }
+        if (pool->quit)
+            break;
+        if (pool->queue.count > 0) {
+            task = queue_pop(&pool->queue);
+            background = 0;
+        }
+        else {
+            task = queue_pop(&pool->background_queue);
+            pool->background_running++;
+            background = 1;
+        }
+        pool_unlock(pool);
+        
+        task.func(task.arg);
+        
+        pool_lock(pool);
+        if (background) {
+            pool->background_running--;
+            pool->background_pending--;
+            // another worker may now pick up background work
+            pool_signal(pool);
+        }
+        else {
+            pool->pending--;
+        }
+#ifndef _WIN32
+        pthread_cond_broadcast(&pool->done_cond);
+#else
+        WakeAllConditionVariable(&pool->done_cond);
+#endif
+    }
+    pool_unlock(pool);
+    
+    worker_arena = NULL;
+    arena_free(&arena);
+    
+    return(NULL);
+}
+
+// Grow an arena buffer to at least needed bytes.  The contents aren't kept; they are scratch for one task.
+static void *arena_reserve(void *buf, size_t *capacity, size_t needed)
+{
+    if (needed <= *capacity)
+        return(buf);
+    if (buf != NULL)
+        free(buf);
+    // some headroom, so a run of slightly larger batches doesn't reallocate each time
+    needed += needed / 4;
+    buf = malloc(needed);
+    *capacity = (buf != NULL) ? needed : 0;
+    
+    return(buf);
+}
+
+// the arena's RED decompression struct, with a difference buffer big enough for blocks of max_samps samples
+static RED_PROCESSING_STRUCT *arena_rps(WORKER_ARENA *arena, ui4 max_samps)
+{
+    size_t difference_bytes;
+    
+    if (arena->rps == NULL) {
+        arena->rps = (RED_PROCESSING_STRUCT *) calloc((size_t) 1, sizeof(RED_PROCESSING_STRUCT));
+        arena->rps->compression.mode = RED_DECOMPRESSION;
+    }
+    difference_bytes = (size_t) RED_MAX_DIFFERENCE_BYTES(max_samps);
+    if (difference_bytes > arena->difference_bytes) {
+        if (arena->rps->difference_buffer != NULL)
+            free(arena->rps->difference_buffer);
+        arena->rps->difference_buffer = (si1 *) calloc(difference_bytes, sizeof(ui1));
+        arena->difference_bytes = difference_bytes;
+    }
+    
+    return(arena->rps);
+}
+
+static void arena_free(WORKER_ARENA *arena)
+{
+    if (arena->raw != NULL)
+        free(arena->raw);
+    if (arena->compressed != NULL)
+        free(arena->compressed);
+    if (arena->block_scratch != NULL)
+        free(arena->block_scratch);
+    if (arena->rps != NULL) {
+        if (arena->rps->difference_buffer != NULL)
+            free(arena->rps->difference_buffer);
+        free(arena->rps);
+    }
+    memset(arena, 0, sizeof(WORKER_ARENA));
+}
+
+// create (or resize) a file and map it shared, so the UI process sees writes without any file i/o
+static si4 map_file(si1 *path, size_t bytes, MAPPED_FILE *mf)
+{
+#ifndef _WIN32
+    mf->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (mf->fd < 0)
+        return(0);
+    if (ftruncate(mf->fd, (off_t) bytes) != 0) {
+        close(mf->fd);
+        return(0);
+    }
+    mf->addr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, mf->fd, 0);
+    if (mf->addr == MAP_FAILED) {
+        mf->addr = NULL;
+        close(mf->fd);
+        return(0);
+    }
+#else
+    mf->file_handle = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mf->file_handle == INVALID_HANDLE_VALUE)
+        return(0);
+    mf->map_handle = CreateFileMappingA(mf->file_handle, NULL, PAGE_READWRITE, (DWORD) ((ui8) bytes >> 32), (DWORD) ((ui8) bytes & 0xFFFFFFFF), NULL);
+    if (mf->map_handle == NULL) {
+        CloseHandle(mf->file_handle);
+        return(0);
+    }
+    mf->addr = MapViewOfFile(mf->map_handle, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+    if (mf->addr == NULL) {
+        CloseHandle(mf->map_handle);
+        CloseHandle(mf->file_handle);
+        return(0);
+    }
+#endif
+    mf->bytes = bytes;
+    
+    return(1);
+}
+
+// map an existing file read-only, at its current size
+static si4 map_file_readonly(si1 *path, MAPPED_FILE *mf)
+{
+#ifndef _WIN32
+    struct stat sb;
+    
+    mf->fd = open(path, O_RDONLY);
+    if (mf->fd < 0)
+        return(0);
+    if ((fstat(mf->fd, &sb) != 0) || (sb.st_size == 0)) {
+        close(mf->fd);
+        return(0);
+    }
+    mf->addr = mmap(NULL, (size_t) sb.st_size, PROT_READ, MAP_SHARED, mf->fd, 0);
+    close(mf->fd);  // the mapping stays valid; this keeps open files down when many segments are mapped
+    mf->fd = -1;
+    if (mf->addr == MAP_FAILED) {
+        mf->addr = NULL;
+        return(0);
+    }
+    mf->bytes = (size_t) sb.st_size;
+#else
+    LARGE_INTEGER size;
+    
+    mf->file_handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mf->file_handle == INVALID_HANDLE_VALUE)
+        return(0);
+    if (!GetFileSizeEx(mf->file_handle, &size) || (size.QuadPart == 0)) {
+        CloseHandle(mf->file_handle);
+        return(0);
+    }
+    mf->map_handle = CreateFileMappingA(mf->file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mf->map_handle == NULL) {
+        CloseHandle(mf->file_handle);
+        return(0);
+    }
+    mf->addr = MapViewOfFile(mf->map_handle, FILE_MAP_READ, 0, 0, 0);
+    if (mf->addr == NULL) {
+        CloseHandle(mf->map_handle);
+        CloseHandle(mf->file_handle);
+        return(0);
+    }
+    mf->bytes = (size_t) size.QuadPart;
+#endif
+    
+    return(1);
+}
+
+static void unmap_file(MAPPED_FILE *mf)
+{
+    if (mf->addr == NULL)
+        return;
+#ifndef _WIN32
+    munmap(mf->addr, mf->bytes);
+    if (mf->fd >= 0)
+        close(mf->fd);
+#else
+    UnmapViewOfFile(mf->addr);
+    CloseHandle(mf->map_handle);
+    CloseHandle(mf->file_handle);
+#endif
+    mf->addr = NULL;
+    mf->bytes = 0;
+}
+
+static void ring_init(RING_BUFFER *ring, si1 *page_dir)
+{
+    si1 header_path[1024];
+    
+    strcpy(ring->page_dir, page_dir);
+    ring->data_path[0] = 0;
+    ring->data_map.addr = NULL;
+    ring->slots = NULL;
+    ring->slot_samps = 0;
+    
+    sprintf(header_path, "%s/page_ring", page_dir);
+#ifndef _WIN32
+    while (!map_file(header_path, RING_HEADER_BYTES, &ring->header_map)) usleep((useconds_t) 100000);
+#else
+    while (!map_file(header_path, RING_HEADER_BYTES, &ring->header_map)) Sleep(100);
+#endif
+    ring->header = (RING_HEADER *) ring->header_map.addr;
+    memset(ring->header, 0, RING_HEADER_BYTES);
+    ring->header->version = RING_VERSION;
+    ring->header->fud = -1.0;  // page specs not yet served
+    MEMORY_BARRIER();
+    ring->header->magic = RING_MAGIC;
+}
+
+// Called for new page specs.  The data file is only replaced when the page geometry changes; the UI notices the
+// new layout_id and remaps.  fud tells the UI which page specs the ring now holds.
+static void ring_set_layout(RING_BUFFER *ring, si4 num_chans, si4 samps_per_page, si4 samp_values, sf8 secs_per_page, sf8 fud, sf8 origin_sec)
+{
+    RING_HEADER *header;
+    si4 n_slots;
+    
+    header = ring->header;
+    n_slots = N_PAGES_AHEAD + N_PAGES_BEHIND + 2;
+    
+    header->generation++;
+    MEMORY_BARRIER();
+    if ((ring->data_map.addr == NULL) || (header->num_chans != num_chans) || (header->samps_per_page != samps_per_page) ||
+        (header->samp_values != samp_values)) {
+        if (ring->data_map.addr != NULL) {
+            unmap_file(&ring->data_map);
+            remove(ring->data_path);  // may fail on Windows while the UI still has it mapped
+        }
+        header->layout_id++;
+        sprintf(ring->data_path, "%s/page_ring_%u", ring->page_dir, header->layout_id);
+        ring->slot_samps = (size_t) num_chans * (size_t) samps_per_page * (size_t) samp_values;
+#ifndef _WIN32
+        while (!map_file(ring->data_path, ring->slot_samps * n_slots * sizeof(sf4), &ring->data_map)) usleep((useconds_t) 100000);
+#else
+        while (!map_file(ring->data_path, ring->slot_samps * n_slots * sizeof(sf4), &ring->data_map)) Sleep(100);
+#endif
+        ring->slots = (sf4 *) ring->data_map.addr;
+        header->num_chans = num_chans;
+        header->samps_per_page = samps_per_page;
+        header->samp_values = samp_values;
+        header->n_slots = n_slots;
+    }
+    header->secs_per_page = secs_per_page;
+    header->origin_sec = origin_sec;
+    header->first_sec = origin_sec;
+    header->last_sec = origin_sec - secs_per_page;
+    header->fud = fud;
+    MEMORY_BARRIER();
+    header->generation++;
+}
+
+// discard every page and start the ring over at origin_sec
+static void ring_reset(RING_BUFFER *ring, sf8 origin_sec)
+{
+    RING_HEADER *header;
+    
+    header = ring->header;
+    header->generation++;
+    MEMORY_BARRIER();
+    header->origin_sec = origin_sec;
+    header->first_sec = origin_sec;
+    header->last_sec = origin_sec - header->secs_per_page;
+    MEMORY_BARRIER();
+    header->generation++;
+}
+
+static sf4 *ring_slot(RING_BUFFER *ring, sf8 page_start_sec)
+{
+    si8 page_num, slot_num;
+    
+    page_num = (si8) floor(((page_start_sec - ring->header->origin_sec) / ring->header->secs_per_page) + 0.5);
+    slot_num = page_num % ring->header->n_slots;
+    if (slot_num < 0)
+        slot_num += ring->header->n_slots;
+    
+    return(ring->slots + (slot_num * ring->slot_samps));
+}
+
+static void control_init(CONTROL_CHANNEL *control)
+{
+    control->curr_view_sec = 0.0;
+    control->seek_pending = 0;
+    control->specs_pending = 0;
+    control->quit = 0;
+    control->page_specs = NULL;
+    control->last_ui_heartbeat = time(NULL);
+#ifndef _WIN32
+    pthread_mutex_init(&control->lock, NULL);
+    pthread_cond_init(&control->cond, NULL);
+#else
+    InitializeCriticalSection(&control->lock);
+    InitializeConditionVariable(&control->cond);
+#endif
+}
+
+static void control_lock(CONTROL_CHANNEL *control)
+{
+#ifndef _WIN32
+    pthread_mutex_lock(&control->lock);
+#else
+    EnterCriticalSection(&control->lock);
+#endif
+}
+
+static void control_unlock(CONTROL_CHANNEL *control)
+{
+#ifndef _WIN32
+    pthread_mutex_unlock(&control->lock);
+#else
+    LeaveCriticalSection(&control->lock);
+#endif
+}
+
+// wait (lock held) for control_thread to signal a command; returns 0 on timeout
+static si4 control_wait(CONTROL_CHANNEL *control, si4 timeout_secs)
+{
+#ifndef _WIN32
+    struct timespec deadline;
+    
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_secs;
+    
+    return(pthread_cond_timedwait(&control->cond, &control->lock, &deadline) == 0);
+#else
+    return(SleepConditionVariableCS(&control->cond, &control->lock, (DWORD) timeout_secs * 1000) != 0);
+#endif
+}
+
+// "control_thread" blocks on stdin for commands from the UI.  A closed pipe means the UI is gone, and is taken as a
+// quit, so that the server loop shuts down as it does for one (finishing any cache files being written).
+#ifndef _WIN32
+static void *control_thread(void *argument)
+#else
+DWORD WINAPI control_thread(LPVOID argument)
+#endif
+{
+    CONTROL_CHANNEL *control;
+    ui4 cmd_header[2];
+    si1 *payload;
+    sf8 seek_sec;
+    
+    control = (CONTROL_CHANNEL *) argument;
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    
+    while (1)
+    {
+        if (fread(cmd_header, sizeof(ui4), 2, stdin) != 2)
+            break;
+        if (cmd_header[1] > CMD_MAX_PAYLOAD)
+            break;
+        payload = (si1 *) malloc((size_t) cmd_header[1] + 1);
+        if (fread(payload, sizeof(si1), (size_t) cmd_header[1], stdin) != cmd_header[1]) {
+            free(payload);
+            break;
+        }
+        payload[cmd_header[1]] = 0;
+        
+        control_lock(control);
+        control->last_ui_heartbeat = time(NULL);
+        switch (cmd_header[0]) {
+            case CMD_SEEK:
+                if (cmd_header[1] >= sizeof(sf8)) {
+                    memcpy(&seek_sec, payload, sizeof(sf8));
+                    control->curr_view_sec = seek_sec;
+                    control->seek_pending = 1;
+                }
+                break;
+            case CMD_PAGE_SPECS:
+                // only the newest page specs matter
+                if (control->page_specs != NULL)
+                    free(control->page_specs);
+                control->page_specs = payload;
+                payload = NULL;
+                control->specs_pending = 1;
+                break;
+            case CMD_QUIT:
+                control->quit = 1;
+                break;
+            case CMD_HEARTBEAT:
+            default:
+                break;
+        }
+        // heartbeats only need to be recorded, everything else wakes up the server loop
+        if (cmd_header[0] != CMD_HEARTBEAT) {
+#ifndef _WIN32
+            pthread_cond_signal(&control->cond);
+#else
+            WakeConditionVariable(&control->cond);
+#endif
+        }
+        control_unlock(control);
+        if (payload != NULL)
+            free(payload);
+    }
+    
+    if (DBUG) printf("control channel closed\n");
+    control_lock(control);
+    control->quit = 1;
+#ifndef _WIN32
+    pthread_cond_signal(&control->cond);
+#else
+    WakeConditionVariable(&control->cond);
+#endif
+    control_unlock(control);
+    
+    return(NULL);
+}
+
+static void first_page_lock(FIRST_PAGE *first_page)
+{
+#ifndef _WIN32
+    pthread_mutex_lock(&first_page->lock);
+#else
+    EnterCriticalSection(&first_page->lock);
+#endif
+}
+
+static void first_page_unlock(FIRST_PAGE *first_page)
+{
+#ifndef _WIN32
+    pthread_mutex_unlock(&first_page->lock);
+#else
+    LeaveCriticalSection(&first_page->lock);
+#endif
+}
+
+// Write server_info: the number of channels and the start of the first page, then one line per channel (name, start
+// and end times, channel number, units conversion factor, ring row) in the given order, then the number of channels
+// again once every channel is listed.  The file is written aside and renamed, so the UI never reads half of it.
+static void write_server_info(si1 *path, THREAD_INFO *thread_info, si4 *rows, si4 n_rows, si4 num_chans, sf8 view_sec, si4 complete)
+{
+    si1 temp_path[1100];
+    FILE *si_fp;
+    CHANNEL_INDEX *index;
+    si4 i;
+    
+    sprintf(temp_path, "%s.tmp", path);
+#ifndef _WIN32
+    while ((si_fp = fopen(temp_path, "w")) == NULL) usleep((useconds_t) 100000);
+#else
+    while ((si_fp = fopen(temp_path, "wb")) == NULL) Sleep(100);
+#endif
+    fprintf(si_fp, "%d %lf\n", num_chans, view_sec);
+    for (i = 0; i < n_rows; ++i) {
+        index = thread_info[rows[i]].index;
+        fprintf(si_fp, "%s ", thread_info[rows[i]].f_name);
+#ifndef _WIN32
+        fprintf(si_fp, "%ld %ld ", index->earliest_start_time, index->latest_end_time);
+        fprintf(si_fp, "%ld ", index->acquisition_channel_number);
+#else
+        fprintf(si_fp, "%lld %lld ", index->earliest_start_time, index->latest_end_time);
+        fprintf(si_fp, "%lld ", index->acquisition_channel_number);
+#endif
+        fprintf(si_fp, "%f %d\n", index->units_conversion_factor, rows[i]);
+    }
+    if (complete)
+        fprintf(si_fp, "%d\n", num_chans);
+    fclose(si_fp);
+#ifndef _WIN32
+    rename(temp_path, path);
+#else
+    MoveFileExA(temp_path, path, MOVEFILE_REPLACE_EXISTING);
+#endif
+}
+
+// Which page to read next, given the view and the pages buffered so far ([first_sec, last_sec], empty while
+// last_sec < first_sec): 1 for the page after last_sec, -1 for the page before first_sec, 0 if there is nothing to
+// read.  The nearest page to the view goes first, ahead of the view on a tie, until N_PAGES_AHEAD pages after the
+// view and N_PAGES_BEHIND pages before it are buffered (or the recording ends).
+static si4 next_page_direction(sf8 view_sec, sf8 first_sec, sf8 last_sec, sf8 secs_per_page, sf8 start_sec, sf8 end_sec)
+{
+    si4 ahead_full, behind_full;
+    
+    ahead_full = ((last_sec - view_sec) >= (N_PAGES_AHEAD * secs_per_page)) || (last_sec >= end_sec);
+    behind_full = ((view_sec - first_sec) >= (N_PAGES_BEHIND * secs_per_page)) || (first_sec <= start_sec);
+    if (ahead_full && behind_full)
+        return(0);
+    if (ahead_full)
+        return(-1);
+    if (behind_full)
+        return(1);
+    
+    return(((last_sec - view_sec) <= (view_sec - first_sec)) ? 1 : -1);
+}
+
+// How many consecutive pages to read in the given direction: up to max_pages, without going past the
+// N_PAGES_AHEAD / N_PAGES_BEHIND limits (or the ends of the recording) that next_page_direction() stops at.
+static si4 batch_length(si4 direction, sf8 view_sec, sf8 first_sec, sf8 last_sec, sf8 secs_per_page, sf8 start_sec, sf8 end_sec, si4 max_pages)
+{
+    si4 n;
+    
+    for (n = 0; n < max_pages; ++n) {
+        if (direction > 0) {
+            if (((last_sec - view_sec) >= (N_PAGES_AHEAD * secs_per_page)) || (last_sec >= end_sec))
+                break;
+            last_sec += secs_per_page;
+        }
+        else {
+            if (((view_sec - first_sec) >= (N_PAGES_BEHIND * secs_per_page)) || (first_sec <= start_sec))
+                break;
+            first_sec -= secs_per_page;
+        }
+    }
+    
+    return((n > 0) ? n : 1);
+}
+
+// copy the next line of text into line (without the newline); returns 0 if the text ran out or the line doesn't fit
+static si4 get_spec_line(si1 **cursor, si1 *line, si4 max_len)
+{
+    si1 *c;
+    si4 len;
+    
+    c = *cursor;
+    if (*c == 0)
+        return(0);
+    for (len = 0; (c[len] != '\n') && (c[len] != 0); ++len);
+    if (len >= max_len)
+        return(0);
+    memcpy(line, c, (size_t) len);
+    line[len] = 0;
+    if ((len > 0) && (line[len - 1] == '\r'))
+        line[len - 1] = 0;
+    *cursor = c + len + ((c[len] == '\n') ? 1 : 0);
+    
+    return(1);
+}
+
+// Page specs text, one item per line: fud, data folder, number of channels, one channel path per channel,
+// samples per page, seconds per page, password and events file.  Optional "keyword value" lines may follow:
+//     display_mode line|envelope
+//     cache_dir <folder for the min/max pyramid cache>
+//     index_memory <megabytes of segment block indices kept loaded>
+//     open_files <number of segment data files kept open>
+//     highpass <Hz>, lowpass <Hz>, notch <Hz>   display filters (see filter_design())
+//     average ..., trace ...   a montage (see montage_parse_line())
+// Returns 0 if the text is malformed, in which case the specs are ignored.
+static si4 parse_page_specs(si1 *text, PAGE_SPECS *specs, si1 f_names[][256])
+{
+    si1 *cursor, line[1024];
+    si4 i;
+    sf8 megabytes;
+    
+    cursor = text;
+    
+    if (!get_spec_line(&cursor, line, sizeof(line)) || (sscanf(line, "%lf", &specs->fud) != 1))
+        return(0);
+    if (!get_spec_line(&cursor, specs->data_path, sizeof(specs->data_path)))
+        return(0);
+    if (!get_spec_line(&cursor, line, sizeof(line)) || (sscanf(line, "%d", &specs->num_chans) != 1))
+        return(0);
+    if ((specs->num_chans < 1) || (specs->num_chans > 2048))
+        return(0);
+    for (i = 0; i < specs->num_chans; ++i) {
+        if (!get_spec_line(&cursor, f_names[i], 255))
+            return(0);
+    }
+    if (!get_spec_line(&cursor, line, sizeof(line)) || (sscanf(line, "%d", &specs->samps_per_page) != 1))
+        return(0);
+    if (!get_spec_line(&cursor, line, sizeof(line)) || (sscanf(line, "%lf", &specs->secs_per_page) != 1))
+        return(0);
+    if ((specs->samps_per_page < 1) || (specs->secs_per_page <= 0.0))
+        return(0);
+    if (!get_spec_line(&cursor, specs->password, sizeof(specs->password)))
+        return(0);
+    if (!get_spec_line(&cursor, specs->events_file, sizeof(specs->events_file)))
+        return(0);
+    
+    // optional settings
+    specs->display_mode = DISPLAY_LINE;
+    specs->cache_dir[0] = 0;
+    specs->index_memory_bytes = INDEX_MEMORY_BYTES;
+    specs->open_files = DATA_FILES_OPEN;
+    specs->highpass_hz = specs->lowpass_hz = specs->notch_hz = 0.0;
+    specs->montage = NULL;
+    while (get_spec_line(&cursor, line, sizeof(line))) {
+        if (!strcmp(line, "display_mode envelope"))
+            specs->display_mode = DISPLAY_ENVELOPE;
+        else if (!strcmp(line, "display_mode line"))
+            specs->display_mode = DISPLAY_LINE;
+        else if (!strncmp(line, "cache_dir ", 10))
+            strcpy(specs->cache_dir, line + 10);
+        else if (!strncmp(line, "index_memory ", 13)) {
+            if (sscanf(line + 13, "%lf", &megabytes) == 1)
+                specs->index_memory_bytes = (si8) (megabytes * 1024.0 * 1024.0);
+        }
+        else if (!strncmp(line, "open_files ", 11))
+            sscanf(line + 11, "%d", &specs->open_files);
+        else if (!strncmp(line, "highpass ", 9))
+            sscanf(line + 9, "%lf", &specs->highpass_hz);
+        else if (!strncmp(line, "lowpass ", 8))
+            sscanf(line + 8, "%lf", &specs->lowpass_hz);
+        else if (!strncmp(line, "notch ", 6))
+            sscanf(line + 6, "%lf", &specs->notch_hz);
+        else if (!strncmp(line, "average ", 8) || !strncmp(line, "trace ", 6)) {
+            if (!montage_parse_line(&specs->montage, line, specs->num_chans))
+                fprintf(stderr, "bad montage line ignored: %s\n", line);
+        }
+        else
+            fprintf(stderr, "unknown page spec ignored: %s\n", line);
+    }
+    if ((specs->montage != NULL) && (specs->montage->n_traces == 0)) {
+        montage_free(specs->montage);
+        specs->montage = NULL;
+    }
+    
+    return(1);
+}
+
+static void block_cache_init(BLOCK_CACHE *cache, size_t max_bytes)
+{
+    memset(cache, 0, sizeof(BLOCK_CACHE));
+    cache->n_buckets = BLOCK_CACHE_BUCKETS;
+    cache->buckets = (BLOCK_CACHE_ENTRY **) calloc((size_t) cache->n_buckets, sizeof(BLOCK_CACHE_ENTRY *));
+    cache->max_bytes = max_bytes;
+#ifndef _WIN32
+    pthread_mutex_init(&cache->lock, NULL);
+#else
+    InitializeCriticalSection(&cache->lock);
+#endif
+}
+
+static void block_cache_lock(BLOCK_CACHE *cache)
+{
+#ifndef _WIN32
+    pthread_mutex_lock(&cache->lock);
+#else
+    EnterCriticalSection(&cache->lock);
+#endif
+}
+
+static void block_cache_unlock(BLOCK_CACHE *cache)
+{
+#ifndef _WIN32
+    pthread_mutex_unlock(&cache->lock);
+#else
+    LeaveCriticalSection(&cache->lock);
+#endif
+}
+
+static ui4 block_cache_bucket(BLOCK_CACHE *cache, CHANNEL_INDEX *owner, si8 block)
+{
+    ui8 hash;
+    
+    hash = (((ui8) (size_t) owner) >> 4) * 0x9E3779B97F4A7C15ULL;
+    hash ^= ((ui8) block) * 0xC2B2AE3D27D4EB4FULL;
+    hash ^= hash >> 29;
+    
+    return((ui4) (hash & (cache->n_buckets - 1)));
+}
+
+// call with the lock held
+static BLOCK_CACHE_ENTRY *block_cache_find(BLOCK_CACHE *cache, CHANNEL_INDEX *owner, si8 block)
+{
+    BLOCK_CACHE_ENTRY *entry;
+    
+    for (entry = cache->buckets[block_cache_bucket(cache, owner, block)]; entry != NULL; entry = entry->hash_next) {
+        if ((entry->owner == owner) && (entry->block == block))
+            return(entry);
+    }
+    
+    return(NULL);
+}
+
+static void block_cache_unlink_lru(BLOCK_CACHE *cache, BLOCK_CACHE_ENTRY *entry)
+{
+    if (entry->lru_prev != NULL)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        cache->lru_head = entry->lru_next;
+    if (entry->lru_next != NULL)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        cache->lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void block_cache_push_lru(BLOCK_CACHE *cache, BLOCK_CACHE_ENTRY *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL)
+        cache->lru_head->lru_prev = entry;
+    cache->lru_head = entry;
+    if (cache->lru_tail == NULL)
+        cache->lru_tail = entry;
+}
+
+// Sample buffers hold 2^class samples, so the buffer of any evicted block of a class fits the next block of that
+// class.  (A channel's blocks are mostly the same length, so little of a buffer goes unused.)
+static si4 block_cache_class(si4 number_of_samples)
+{
+    si4 class;
+    
+    class = BLOCK_CACHE_MIN_CLASS;
+    while (((si8) 1 << class) < number_of_samples)
+        ++class;
+    
+    return(class);
+}
+
+// memory held by an entry and its samples (a block that failed its CRC check has none)
+static size_t block_cache_entry_bytes(BLOCK_CACHE_ENTRY *entry)
+{
+    if (entry->samples == NULL)
+        return(sizeof(BLOCK_CACHE_ENTRY));
+    
+    return(sizeof(BLOCK_CACHE_ENTRY) + (((size_t) 1 << block_cache_class(entry->number_of_samples)) * sizeof(si4)));
+}
+
+// a buffer to decode a block into, for block_cache_put(): an evicted block's, or a new one if none of its class is free
+static si4 *block_cache_samples(BLOCK_CACHE *cache, si4 number_of_samples)
+{
+    si4 class, *samples;
+    
+    class = block_cache_class(number_of_samples);
+    block_cache_lock(cache);
+    samples = cache->free_samples[class];
+    if (samples != NULL) {
+        cache->free_samples[class] = *((si4 **) samples);
+        cache->free_bytes -= ((size_t) 1 << class) * sizeof(si4);
+    }
+    block_cache_unlock(cache);
+    if (samples == NULL)
+        samples = (si4 *) malloc(((size_t) 1 << class) * sizeof(si4));
+    
+    return(samples);
+}
+
+// keep a block's sample buffer for the next block of its class, or free it if enough are kept; call with the lock held
+static void block_cache_recycle(BLOCK_CACHE *cache, si4 *samples, si4 number_of_samples)
+{
+    si4 class;
+    size_t bytes;
+    
+    if (samples == NULL)
+        return;
+    class = block_cache_class(number_of_samples);
+    bytes = ((size_t) 1 << class) * sizeof(si4);
+    if ((cache->free_bytes + bytes) > BLOCK_CACHE_FREE_BYTES) {
+        free(samples);
+        return;
+    }
+    *((si4 **) samples) = cache->free_samples[class];
+    cache->free_samples[class] = samples;
+    cache->free_bytes += bytes;
+}
+
+// take an entry out of the cache, keeping it and its samples for reuse; call with the lock held
+static void block_cache_remove(BLOCK_CACHE *cache, BLOCK_CACHE_ENTRY *entry)
+{
+    BLOCK_CACHE_ENTRY **link;
+    
+    link = cache->buckets + block_cache_bucket(cache, entry->owner, entry->block);
+    while (*link != entry)
+        link = &(*link)->hash_next;
+    *link = entry->hash_next;
+    block_cache_unlink_lru(cache, entry);
+    cache->bytes -= block_cache_entry_bytes(entry);
+    block_cache_recycle(cache, entry->samples, entry->number_of_samples);
+    if ((cache->free_bytes + sizeof(BLOCK_CACHE_ENTRY)) > BLOCK_CACHE_FREE_BYTES) {
+        free(entry);
+        return;
+    }
+    entry->hash_next = cache->free_entries;
+    cache->free_entries = entry;
+    cache->free_bytes += sizeof(BLOCK_CACHE_ENTRY);
+}
+
+// returns the block pinned (release it with block_cache_release()), or NULL if it isn't cached (the miss is
+// counted when the decoded block is put)
+static BLOCK_CACHE_ENTRY *block_cache_get(BLOCK_CACHE *cache, CHANNEL_INDEX *owner, si8 block)
+{
+    BLOCK_CACHE_ENTRY *entry;
+    
+    block_cache_lock(cache);
+    entry = block_cache_find(cache, owner, block);
+    if (entry != NULL) {
+        entry->refs++;
+        block_cache_unlink_lru(cache, entry);
+        block_cache_push_lru(cache, entry);
+        cache->hits++;
+    }
+    block_cache_unlock(cache);
+    
+    return(entry);
+}
+
+// like block_cache_get(), without pinning, counting or touching the entry
+static si4 block_cache_contains(BLOCK_CACHE *cache, CHANNEL_INDEX *owner, si8 block)
+{
+    si4 found;
+    
+    block_cache_lock(cache);
+    found = (block_cache_find(cache, owner, block) != NULL);
+    block_cache_unlock(cache);
+    
+    return(found);
+}
+
+// Add a decoded block (the cache takes ownership of samples, from block_cache_samples()) and return it pinned.
+// Least recently used blocks that aren't pinned are evicted to make room.
+static BLOCK_CACHE_ENTRY *block_cache_put(BLOCK_CACHE *cache, CHANNEL_INDEX *owner, si8 block, si8 start_time, si4 *samples, si4 number_of_samples)
+{
+    BLOCK_CACHE_ENTRY *entry, *victim, *prev;
+    ui4 bucket;
+    
+    block_cache_lock(cache);
+    cache->misses++;  // every block put had to be decoded
+    
+    // someone else decoded it meanwhile
+    entry = block_cache_find(cache, owner, block);
+    if (entry != NULL) {
+        block_cache_recycle(cache, samples, number_of_samples);
+        entry->refs++;
+        block_cache_unlock(cache);
+        return(entry);
+    }
+    
+    entry = cache->free_entries;
+    if (entry != NULL) {
+        cache->free_entries = entry->hash_next;
+        cache->free_bytes -= sizeof(BLOCK_CACHE_ENTRY);
+        memset(entry, 0, sizeof(BLOCK_CACHE_ENTRY));
+    }
+    else {
+        entry = (BLOCK_CACHE_ENTRY *) calloc((size_t) 1, sizeof(BLOCK_CACHE_ENTRY));
+    }
+    entry->owner = owner;
+    entry->block = block;
+    entry->start_time = start_time;
+    entry->number_of_samples = number_of_samples;
+    entry->samples = samples;
+    entry->refs = 1;
+    bucket = block_cache_bucket(cache, owner, block);
+    entry->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    block_cache_push_lru(cache, entry);
+    cache->bytes += block_cache_entry_bytes(entry);
+    
+    victim = cache->lru_tail;
+    while ((cache->bytes > cache->max_bytes) && (victim != NULL)) {
+        prev = victim->lru_prev;
+        if (victim->refs == 0) {
+            block_cache_remove(cache, victim);
+            cache->evictions++;
+        }
+        victim = prev;
+    }
+    
+    block_cache_unlock(cache);
+    
+    return(entry);
+}
+
+static void block_cache_release(BLOCK_CACHE *cache, BLOCK_CACHE_ENTRY *entry)
+{
+    block_cache_lock(cache);
+    entry->refs--;
+    block_cache_unlock(cache);
+}
+
+// drop every block of a channel that is being closed
+static void block_cache_purge(BLOCK_CACHE *cache, CHANNEL_INDEX *owner)
+{
+    BLOCK_CACHE_ENTRY *entry, *next;
+    
+    block_cache_lock(cache);
+    for (entry = cache->lru_head; entry != NULL; entry = next) {
+        next = entry->lru_next;
+        if (entry->owner == owner)
+            block_cache_remove(cache, entry);
+    }
+    block_cache_unlock(cache);
+}
+
+static void block_cache_report(BLOCK_CACHE *cache)
+{
+    block_cache_lock(cache);
+    fprintf(stderr, "block cache: %llu hits, %llu misses, %llu evictions, %llu bytes in use\n",
+            (unsigned long long) cache->hits, (unsigned long long) cache->misses,
+            (unsigned long long) cache->evictions, (unsigned long long) cache->bytes);
+    block_cache_unlock(cache);
+}
+
+// copy a decoded block into a page's raw sample buffer, at the block's offset from the start of the page
+// (a block that failed its CRC check has no samples, and leaves the page's samples NAN)
+static void place_block(si4 *raw, si8 num_samps, BLOCK_CACHE_ENTRY *entry, si8 page_start_time, sf8 samp_freq)
+{
+    si8 offset, first, n;
+    sf8 delta;
+    
+    if (entry->number_of_samples == 0)
+        return;
+    delta = ((entry->start_time - page_start_time) / 1000000.0) * samp_freq;
+    offset = (si8) ((delta >= 0) ? (delta + 0.5) : (delta - 0.5));
+    first = (offset < 0) ? -offset : 0;
+    n = entry->number_of_samples - first;
+    if ((offset + first + n) > num_samps)
+        n = num_samps - (offset + first);
+    if (n > 0)
+        memcpy(raw + offset + first, entry->samples + first, (size_t) n * sizeof(si4));
+}
+
+static si4 compare_names(const void *a, const void *b)
+{
+    return(strcmp(*(si1 **) a, *(si1 **) b));
+}
+
+// The names of a channel's segments (their directories without ".segd"), in order.  Free with free_names().
+static si1 **list_segments(si1 *channel_path, si4 *n_segments)
+{
+    si1 **names, *name;
+    si4 n, max_n;
+    size_t len;
+#ifndef _WIN32
+    DIR *dir;
+    struct dirent *entry;
+#else
+    si1 pattern[1200];
+    struct _finddata_t entry;
+    intptr_t handle;
+#endif
+    
+    n = 0;
+    max_n = 64;
+    names = (si1 **) calloc((size_t) max_n, sizeof(si1 *));
+#ifndef _WIN32
+    dir = opendir(channel_path);
+    while ((dir != NULL) && ((entry = readdir(dir)) != NULL)) {
+        name = entry->d_name;
+#else
+    sprintf(pattern, "%s/*.%s", channel_path, SEGMENT_DIRECTORY_TYPE_STRING);
+    handle = _findfirst(pattern, &entry);
+    while (handle != -1) {
+        name = entry.name;
+#endif
+        len = strlen(name);
+        if ((len > 5) && (name[len - 5] == '.') && !strcmp(name + len - 4, SEGMENT_DIRECTORY_TYPE_STRING)) {
+            if (n == max_n) {
+                max_n *= 2;
+                names = (si1 **) realloc(names, (size_t) max_n * sizeof(si1 *));
+            }
+            names[n] = (si1 *) calloc(len - 4, sizeof(si1));
+            memcpy(names[n++], name, len - 5);
+        }
+#ifdef _WIN32
+        if (_findnext(handle, &entry) != 0)
+            break;
+#endif
+    }
+#ifndef _WIN32
+    if (dir != NULL)
+        closedir(dir);
+#else
+    if (handle != -1)
+        _findclose(handle);
+#endif
+    qsort(names, (size_t) n, sizeof(si1 *), compare_names);
+    *n_segments = n;
+    
+    return(names);
+}
+
+static void free_names(si1 **names, si4 n)
+{
+    si4 i;
+    
+    for (i = 0; i < n; ++i)
+        free(names[i]);
+    free(names);
+}
+
+// Build a channel's index from its segments' metadata (.tmet) files alone; the block indices are read later, a
+// segment at a time, when something needs them.  Sets password_needed if the password can't read the metadata.
+static CHANNEL_INDEX *build_channel_index(si1 *channel_path, si1 *password)
+{
+    CHANNEL_INDEX *index;
+    FILE_PROCESSING_STRUCT *fps;
+    TIME_SERIES_METADATA_SECTION_2 *tsm;
+    UNIVERSAL_HEADER *uh;
+    si1 **names, path[1200];
+    si4 j, n_names, have_metadata;
+    si8 n;
+    
+    names = list_segments(channel_path, &n_names);
+    index = (CHANNEL_INDEX *) calloc((size_t) 1, sizeof(CHANNEL_INDEX));
+    index->n_segments = n_names;
+    index->password = password;
+    index->segment_first_block = (si8 *) calloc((size_t) index->n_segments + 1, sizeof(si8));
+    index->segment_start_sample = (si8 *) calloc((size_t) index->n_segments + 1, sizeof(si8));
+    index->segment_end_sample = (si8 *) calloc((size_t) index->n_segments + 1, sizeof(si8));
+    index->segment_start_time = (si8 *) calloc((size_t) index->n_segments + 1, sizeof(si8));
+    index->segment_files = (SEGMENT_FILES *) calloc((size_t) index->n_segments + 1, sizeof(SEGMENT_FILES));
+    index->segment_blocks = (SEGMENT_BLOCKS **) calloc((size_t) index->n_segments + 1, sizeof(SEGMENT_BLOCKS *));
+    index->earliest_start_time = index->latest_end_time = -1;
+    
+    n = 0;
+    have_metadata = 0;
+    for (j = 0; j < index->n_segments; ++j)
+    {
+        sprintf(index->segment_files[j].data_path, "%s/%s.%s/%s.%s", channel_path, names[j], SEGMENT_DIRECTORY_TYPE_STRING,
+                names[j], TIME_SERIES_DATA_FILE_TYPE_STRING);
+        sprintf(path, "%s/%s.%s/%s.%s", channel_path, names[j], SEGMENT_DIRECTORY_TYPE_STRING,
+                names[j], TIME_SERIES_METADATA_FILE_TYPE_STRING);
+        index->segment_first_block[j] = n;
+        index->segment_start_time[j] = (j > 0) ? index->segment_start_time[j - 1] : 0;
+        index->segment_start_sample[j] = index->segment_end_sample[j] = (j > 0) ? index->segment_end_sample[j - 1] : 0;
+        
+        // (a segment whose metadata can't be read is left without blocks)
+        fps = read_MEF_file(NULL, path, password, NULL, NULL, RETURN_ON_FAIL);
+        if (fps == NULL)
+            continue;
+        
+        // level 1 access is needed to read the technical metadata (level 2 not really needed)
+        if ((fps->metadata.section_1->section_2_encryption != NO_ENCRYPTION) ||
+            (fps->metadata.section_1->section_3_encryption != NO_ENCRYPTION))
+        {
+            index->encrypted = 1;
+            if ((fps->password_data == NULL) || (fps->password_data->access_level < LEVEL_1_ACCESS))
+                password_needed = 1;
+        }
+        
+        tsm = fps->metadata.time_series_section_2;
+        uh = fps->universal_header;
+        if (!have_metadata) {
+            index->sampling_frequency = tsm->sampling_frequency;
+            index->units_conversion_factor = tsm->units_conversion_factor;
+            index->acquisition_channel_number = tsm->acquisition_channel_number;
+            have_metadata = 1;
+        }
+        if (tsm->maximum_block_samples > index->maximum_block_samples)
+            index->maximum_block_samples = tsm->maximum_block_samples;
+        index->segment_start_sample[j] = tsm->start_sample;
+        index->segment_end_sample[j] = tsm->start_sample + tsm->number_of_samples;
+        if (tsm->number_of_blocks > 0) {
+            index->segment_start_time[j] = uh->start_time;
+            if ((index->earliest_start_time == -1) || (uh->start_time < index->earliest_start_time))
+                index->earliest_start_time = uh->start_time;
+            if ((index->latest_end_time == -1) || (uh->end_time > index->latest_end_time))
+                index->latest_end_time = uh->end_time;
+        }
+        n += tsm->number_of_blocks;
+        
+        fps->directives.free_password_data = MEF_TRUE;
+        free_file_processing_struct(fps);
+    }
+    index->segment_first_block[index->n_segments] = n;
+    index->n_blocks = n;
+    free_names(names, n_names);
+    channel_index_open(index);
+    
+    return(index);
+}
+
+// per-segment state for reading, which an index from the cache needs too
+static void channel_index_open(CHANNEL_INDEX *index)
+{
+    index->data_files = (DATA_FILE **) calloc((size_t) index->n_segments + 1, sizeof(DATA_FILE *));
+    index->data_map_failed = (si1 *) calloc((size_t) index->n_segments + 1, sizeof(si1));
+}
+
+// nothing may be using the index (or reading its segments into the index cache)
+static void free_channel_index(CHANNEL_INDEX *index)
+{
+    if (index == NULL)
+        return;
+    data_file_drop(index);
+    free(index->data_files);
+    free(index->data_map_failed);
+    index_lru_drop(index);
+    free(index->segment_blocks);
+    if (index->cache_map != NULL) {
+        unmap_file(index->cache_map);
+        free(index->cache_map);
+        free(index);
+        return;
+    }
+    free(index->segment_first_block);
+    free(index->segment_start_sample);
+    free(index->segment_end_sample);
+    free(index->segment_start_time);
+    free(index->segment_files);
+    free(index);
+}
+
+// Read a segment's block index from its .tidx file (named like the .tdat file), or NULL if it can't be read or
+// doesn't hold the n_blocks blocks the metadata says the segment has.
+static SEGMENT_BLOCKS *read_segment_blocks(si1 *tdat_path, si1 *password, si4 segment, si8 start_sample, si8 n_blocks)
+{
+    FILE_PROCESSING_STRUCT *fps;
+    TIME_SERIES_INDEX *tsi;
+    SEGMENT_BLOCKS *blocks;
+    si1 path[1024];
+    size_t len, memory;
+    si8 i, n, rebase;
+    
+    strcpy(path, tdat_path);
+    len = strlen(path);
+    if (len < 4)
+        return(NULL);
+    strcpy(path + len - 4, TIME_SERIES_INDICES_FILE_TYPE_STRING);
+    fps = read_MEF_file(NULL, path, password, NULL, NULL, RETURN_ON_FAIL);
+    if (fps == NULL)
+        return(NULL);
+    if (fps->universal_header->number_of_entries < n_blocks) {
+        fps->directives.free_password_data = MEF_TRUE;
+        free_file_processing_struct(fps);
+        return(NULL);
+    }
+    tsi = fps->time_series_indices;
+    
+    // Some files count block start samples from the start of the channel instead of the segment.  (The first
+    // segment is taken as it is, its start sample being 0 anyway.)
+    rebase = 0;
+    if ((segment > 0) && (n_blocks > 0) && (tsi[0].start_sample == start_sample))
+        rebase = start_sample;
+    
+    n = n_blocks + 1;
+    memory = sizeof(SEGMENT_BLOCKS) + ((size_t) n * ((3 * sizeof(si8)) + (4 * sizeof(si4))));
+    blocks = (SEGMENT_BLOCKS *) calloc((size_t) 1, memory);
+    blocks->n_blocks = n_blocks;
+    blocks->memory = memory;
+    blocks->start_time = (si8 *) (blocks + 1);
+    blocks->start_sample = blocks->start_time + n;
+    blocks->file_offset = blocks->start_sample + n;
+    blocks->bytes = (si4 *) (blocks->file_offset + n);
+    blocks->samples = blocks->bytes + n;
+    blocks->min_value = blocks->samples + n;
+    blocks->max_value = blocks->min_value + n;
+    for (i = 0; i < n_blocks; ++i) {
+        blocks->start_time[i] = tsi[i].start_time;
+        blocks->start_sample[i] = start_sample + (tsi[i].start_sample - rebase);
+        blocks->file_offset[i] = tsi[i].file_offset;
+        blocks->bytes[i] = (si4) tsi[i].block_bytes;
+        blocks->samples[i] = (si4) tsi[i].number_of_samples;
+        blocks->min_value[i] = tsi[i].minimum_sample_value;
+        blocks->max_value[i] = tsi[i].maximum_sample_value;
+    }
+    
+    fps->directives.free_password_data = MEF_TRUE;
+    free_file_processing_struct(fps);
+    
+    return(blocks);
+}
+
+static void index_lru_init(INDEX_LRU *lru, size_t max_bytes)
+{
+    memset(lru, 0, sizeof(INDEX_LRU));
+    lru->max_bytes = max_bytes;
+#ifndef _WIN32
+    pthread_mutex_init(&lru->lock, NULL);
+#else
+    InitializeCriticalSection(&lru->lock);
+#endif
+}
+
+static void index_lru_lock(INDEX_LRU *lru)
+{
+#ifndef _WIN32
+    pthread_mutex_lock(&lru->lock);
+#else
+    EnterCriticalSection(&lru->lock);
+#endif
+}
+
+static void index_lru_unlock(INDEX_LRU *lru)
+{
+#ifndef _WIN32
+    pthread_mutex_unlock(&lru->lock);
+#else
+    LeaveCriticalSection(&lru->lock);
+#endif
+}
+
+static void index_lru_unlink(INDEX_LRU *lru, SEGMENT_BLOCKS *blocks)
+{
+    if (blocks->lru_prev != NULL)
+        blocks->lru_prev->lru_next = blocks->lru_next;
+    else
+        lru->lru_head = blocks->lru_next;
+    if (blocks->lru_next != NULL)
+        blocks->lru_next->lru_prev = blocks->lru_prev;
+    else
+        lru->lru_tail = blocks->lru_prev;
+    blocks->lru_prev = blocks->lru_next = NULL;
+}
+
+static void index_lru_push(INDEX_LRU *lru, SEGMENT_BLOCKS *blocks)
+{
+    blocks->lru_prev = NULL;
+    blocks->lru_next = lru->lru_head;
+    if (lru->lru_head != NULL)
+        lru->lru_head->lru_prev = blocks;
+    lru->lru_head = blocks;
+    if (lru->lru_tail == NULL)
+        lru->lru_tail = blocks;
+}
+
+// drop a loaded segment, clearing its channel's pointer to it; call with the lock held
+static void index_lru_remove(INDEX_LRU *lru, SEGMENT_BLOCKS *blocks)
+{
+    index_lru_unlink(lru, blocks);
+    lru->bytes -= blocks->memory;
+    *blocks->home = NULL;
+    free(blocks);
+}
+
+// drop least recently used segments that aren't pinned until the ceiling is met; call with the lock held
+static void index_lru_trim(INDEX_LRU *lru)
+{
+    SEGMENT_BLOCKS *victim, *prev;
+    
+    victim = lru->lru_tail;
+    while ((lru->bytes > lru->max_bytes) && (victim != NULL)) {
+        prev = victim->lru_prev;
+        if (victim->refs == 0) {
+            index_lru_remove(lru, victim);
+            lru->evictions++;
+        }
+        victim = prev;
+    }
+}
+
+static void index_lru_set_limit(INDEX_LRU *lru, size_t max_bytes)
+{
+    index_lru_lock(lru);
+    lru->max_bytes = max_bytes;
+    index_lru_trim(lru);
+    index_lru_unlock(lru);
+}
+
+// drop every loaded segment of a channel that is being closed
+static void index_lru_drop(CHANNEL_INDEX *index)
+{
+    SEGMENT_BLOCKS *blocks;
+    si4 i;
+    
+    if (index->segment_blocks == NULL)
+        return;
+    if (index->lru != NULL)
+        index_lru_lock(index->lru);
+    for (i = 0; i < index->n_segments; ++i) {
+        blocks = index->segment_blocks[i];
+        if (blocks == NULL)
+            continue;
+        if (blocks->memory > 0)
+            index_lru_remove(index->lru, blocks);
+        else
+            free(blocks);  // (its arrays are in the index cache mapping)
+        index->segment_blocks[i] = NULL;
+    }
+    if (index->lru != NULL)
+        index_lru_unlock(index->lru);
+}
+
+static void index_lru_report(INDEX_LRU *lru)
+{
+    index_lru_lock(lru);
+    fprintf(stderr, "segment indices: %llu loads, %llu evictions, %llu bytes in use\n",
+            (unsigned long long) lru->loads, (unsigned long long) lru->evictions, (unsigned long long) lru->bytes);
+    index_lru_unlock(lru);
+}
+
+// A segment's block index, pinned until segment_blocks_release().  If it isn't loaded, it is read from the .tidx
+// file (outside the lock, so other channels carry on meanwhile), and least recently used segments of any channel
+// may be dropped to stay under the ceiling.  NULL if the file can't be read.
+static SEGMENT_BLOCKS *segment_blocks_get(CHANNEL_INDEX *index, si4 segment)
+{
+    INDEX_LRU *lru;
+    SEGMENT_BLOCKS *blocks, *loaded;
+    
+    lru = index->lru;
+    index_lru_lock(lru);
+    blocks = index->segment_blocks[segment];
+    if (blocks != NULL) {
+        blocks->refs++;
+        if (blocks->memory > 0) {
+            index_lru_unlink(lru, blocks);
+            index_lru_push(lru, blocks);
+        }
+        index_lru_unlock(lru);
+        return(blocks);
+    }
+    index_lru_unlock(lru);
+    
+    loaded = read_segment_blocks(index->segment_files[segment].data_path, index->password, segment, index->segment_start_sample[segment],
+                                 index->segment_first_block[segment + 1] - index->segment_first_block[segment]);
+    if (loaded == NULL)
+        return(NULL);
+    
+    // (another read may have loaded it meanwhile)
+    index_lru_lock(lru);
+    blocks = index->segment_blocks[segment];
+    if (blocks == NULL) {
+        blocks = loaded;
+        loaded = NULL;
+        blocks->home = index->segment_blocks + segment;
+        *blocks->home = blocks;
+        lru->bytes += blocks->memory;
+        lru->loads++;
+    }
+    else if (blocks->memory > 0) {
+        index_lru_unlink(lru, blocks);
+    }
+    if (blocks->memory > 0)
+        index_lru_push(lru, blocks);
+    blocks->refs++;
+    index_lru_trim(lru);
+    index_lru_unlock(lru);
+    if (loaded != NULL)
+        free(loaded);
+    
+    return(blocks);
+}
+
+static void segment_blocks_release(CHANNEL_INDEX *index, SEGMENT_BLOCKS *blocks)
+{
+    if (blocks == NULL)
+        return;
+    index_lru_lock(index->lru);
+    blocks->refs--;
+    index_lru_unlock(index->lru);
+}
+
+// the most files the cache may keep open: at least 1, and at most half of what the process may open, leaving the
+// rest for the pyramid and index cache files, the ring and the UI's pipes
+static si4 data_file_cache_limit(si4 max_open)
+{
+#ifndef _WIN32
+    struct rlimit rl;
+    
+    if ((getrlimit(RLIMIT_NOFILE, &rl) == 0) && (rl.rlim_cur != RLIM_INFINITY) && ((rlim_t) max_open > rl.rlim_cur / 2))
+        max_open = (si4) (rl.rlim_cur / 2);
+#endif
+    if (max_open < 1)
+        max_open = 1;
+    
+    return(max_open);
+}
+
+static void data_file_cache_init(DATA_FILE_CACHE *cache, si4 max_open)
+{
+    memset(cache, 0, sizeof(DATA_FILE_CACHE));
+    cache->max_open = data_file_cache_limit(max_open);
+#ifndef _WIN32
+    pthread_mutex_init(&cache->lock, NULL);
+#else
+    InitializeCriticalSection(&cache->lock);
+#endif
+}
+
+static void data_file_cache_lock(DATA_FILE_CACHE *cache)
+{
+#ifndef _WIN32
+    pthread_mutex_lock(&cache->lock);
+#else
+    EnterCriticalSection(&cache->lock);
+#endif
+}
+
+static void data_file_cache_unlock(DATA_FILE_CACHE *cache)
+{
+#ifndef _WIN32
+    pthread_mutex_unlock(&cache->lock);
+#else
+    LeaveCriticalSection(&cache->lock);
+#endif
+}
+
+static void data_file_cache_unlink(DATA_FILE_CACHE *cache, DATA_FILE *data_file)
+{
+    if (data_file->lru_prev != NULL)
+        data_file->lru_prev->lru_next = data_file->lru_next;
+    else
+        cache->lru_head = data_file->lru_next;
+    if (data_file->lru_next != NULL)
+        data_file->lru_next->lru_prev = data_file->lru_prev;
+    else
+        cache->lru_tail = data_file->lru_prev;
+    data_file->lru_prev = data_file->lru_next = NULL;
+}
+
+static void data_file_cache_push(DATA_FILE_CACHE *cache, DATA_FILE *data_file)
+{
+    data_file->lru_prev = NULL;
+    data_file->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL)
+        cache->lru_head->lru_prev = data_file;
+    cache->lru_head = data_file;
+    if (cache->lru_tail == NULL)
+        cache->lru_tail = data_file;
+}
+
+// Open a segment's .tdat file for reading, and map it too if asked to and it can be (file.addr stays NULL if not).
+// Returns 0 if the file can't be opened.
+static si4 data_file_open(si1 *path, si4 map, MAPPED_FILE *file)
+{
+#ifndef _WIN32
+    struct stat sb;
+    
+    memset(file, 0, sizeof(MAPPED_FILE));
+    file->fd = open(path, O_RDONLY);
+    if (file->fd < 0)
+        return(0);
+    if (map && (fstat(file->fd, &sb) == 0) && (sb.st_size > 0)) {
+        file->addr = mmap(NULL, (size_t) sb.st_size, PROT_READ, MAP_SHARED, file->fd, 0);
+        if (file->addr == MAP_FAILED) {
+            file->addr = NULL;
+        }
+        else {
+            file->bytes = (size_t) sb.st_size;
+            madvise(file->addr, file->bytes, MADV_SEQUENTIAL);
+        }
+    }
+#else
+    LARGE_INTEGER size;
+    
+    memset(file, 0, sizeof(MAPPED_FILE));
+    file->file_handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file->file_handle == INVALID_HANDLE_VALUE)
+        return(0);
+    if (map && GetFileSizeEx(file->file_handle, &size) && (size.QuadPart > 0)) {
+        file->map_handle = CreateFileMappingA(file->file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (file->map_handle != NULL) {
+            file->addr = MapViewOfFile(file->map_handle, FILE_MAP_READ, 0, 0, 0);
+            if (file->addr == NULL) {
+                CloseHandle(file->map_handle);
+                file->map_handle = NULL;
+            }
+            else {
+                file->bytes = (size_t) size.QuadPart;
+            }
+        }
+    }
+#endif
+    
+    return(1);
+}
+
+static void data_file_close(MAPPED_FILE *file)
+{
+#ifndef _WIN32
+    if (file->addr != NULL)
+        munmap(file->addr, file->bytes);
+    close(file->fd);
+#else
+    if (file->addr != NULL) {
+        UnmapViewOfFile(file->addr);
+        CloseHandle(file->map_handle);
+    }
+    CloseHandle(file->file_handle);
+#endif
+    file->addr = NULL;
+    file->bytes = 0;
+}
+
+// close an open file, clearing its channel's pointer to it; call with the lock held
+static void data_file_cache_remove(DATA_FILE_CACHE *cache, DATA_FILE *data_file)
+{
+    data_file_cache_unlink(cache, data_file);
+    cache->n_open--;
+    *data_file->home = NULL;
+    data_file_close(&data_file->file);
+    free(data_file);
+}
+
+// close least recently used files that aren't pinned until the limit is met; call with the lock held
+static void data_file_cache_trim(DATA_FILE_CACHE *cache)
+{
+    DATA_FILE *victim, *prev;
+    
+    victim = cache->lru_tail;
+    while ((cache->n_open > cache->max_open) && (victim != NULL)) {
+        prev = victim->lru_prev;
+        if (victim->refs == 0) {
+            data_file_cache_remove(cache, victim);
+            cache->evictions++;
+        }
+        victim = prev;
+    }
+}
+
+static void data_file_cache_set_limit(DATA_FILE_CACHE *cache, si4 max_open)
+{
+    data_file_cache_lock(cache);
+    cache->max_open = data_file_cache_limit(max_open);
+    data_file_cache_trim(cache);
+    data_file_cache_unlock(cache);
+}
+
+static void data_file_cache_report(DATA_FILE_CACHE *cache)
+{
+    data_file_cache_lock(cache);
+    fprintf(stderr, "data files: %llu opens, %llu evictions, %d open\n",
+            (unsigned long long) cache->opens, (unsigned long long) cache->evictions, cache->n_open);
+    data_file_cache_unlock(cache);
+}
+
+// A segment's open .tdat file, pinned until data_file_release().  If it isn't open, it is opened (outside the lock)
+// and mapped, unless mapping it has failed before, and least recently used files of any channel may be closed to
+// stay under the limit.  NULL if the file can't be opened.
+static DATA_FILE *data_file_get(CHANNEL_INDEX *index, si4 segment)
+{
+    DATA_FILE_CACHE *cache;
+    DATA_FILE *data_file, *opened;
+    si4 map;
+    
+    cache = index->file_cache;
+    data_file_cache_lock(cache);
+    data_file = index->data_files[segment];
+    if (data_file != NULL) {
+        data_file->refs++;
+        data_file_cache_unlink(cache, data_file);
+        data_file_cache_push(cache, data_file);
+        data_file_cache_unlock(cache);
+        return(data_file);
+    }
+    map = !index->data_map_failed[segment];
+    data_file_cache_unlock(cache);
+    
+    opened = (DATA_FILE *) calloc((size_t) 1, sizeof(DATA_FILE));
+    if (!data_file_open(index->segment_files[segment].data_path, map, &opened->file)) {
+        free(opened);
+        return(NULL);
+    }
+    
+    // (another read may have opened it meanwhile)
+    data_file_cache_lock(cache);
+    if (map && (opened->file.addr == NULL))
+        index->data_map_failed[segment] = 1;
+    data_file = index->data_files[segment];
+    if (data_file == NULL) {
+        data_file = opened;
+        opened = NULL;
+        data_file->home = index->data_files + segment;
+        *data_file->home = data_file;
+        cache->n_open++;
+        cache->opens++;
+    }
+    else {
+        data_file_cache_unlink(cache, data_file);
+    }
+    data_file_cache_push(cache, data_file);
+    data_file->refs++;
+    data_file_cache_trim(cache);
+    data_file_cache_unlock(cache);
+    if (opened != NULL) {
+        data_file_close(&opened->file);
+        free(opened);
+    }
+    
+    return(data_file);
+}
+
+static void data_file_release(CHANNEL_INDEX *index, DATA_FILE *data_file)
+{
+    if (data_file == NULL)
+        return;
+    data_file_cache_lock(index->file_cache);
+    data_file->refs--;
+    if (index->file_cache->n_open > index->file_cache->max_open)
+        data_file_cache_trim(index->file_cache);  // (files opened while every open one was in use)
+    data_file_cache_unlock(index->file_cache);
+}
+
+// Read bytes at an offset of the file, without a file position, so reads of the same file by several workers can't
+// disturb each other.  Returns the number of bytes read, which is short at the end of the file or on an error.
+static si8 data_file_read(DATA_FILE *data_file, void *buffer, si8 bytes, si8 offset)
+{
+    si8 done;
+#ifndef _WIN32
+    ssize_t n;
+    
+    for (done = 0; done < bytes; done += (si8) n) {
+        n = pread(data_file->file.fd, (ui1 *) buffer + done, (size_t) (bytes - done), (off_t) (offset + done));
+        if ((n < 0) && (errno == EINTR))
+            n = 0;
+        else if (n <= 0)
+            break;
+    }
+#else
+    OVERLAPPED overlapped;
+    DWORD n, chunk;
+    
+    for (done = 0; done < bytes; done += (si8) n) {
+        memset(&overlapped, 0, sizeof(OVERLAPPED));
+        overlapped.Offset = (DWORD) ((ui8) (offset + done) & 0xFFFFFFFF);
+        overlapped.OffsetHigh = (DWORD) ((ui8) (offset + done) >> 32);
+        chunk = ((bytes - done) > 0x40000000) ? 0x40000000 : (DWORD) (bytes - done);
+        if (!ReadFile(data_file->file.file_handle, (ui1 *) buffer + done, chunk, &n, &overlapped) || (n == 0))
+            break;
+    }
+#endif
+    
+    return(done);
+}
+
+// close every open file of a channel that is being closed
+static void data_file_drop(CHANNEL_INDEX *index)
+{
+    DATA_FILE *data_file;
+    si4 i;
+    
+    if (index->data_files == NULL)
+        return;
+    if (index->file_cache != NULL)
+        data_file_cache_lock(index->file_cache);
+    for (i = 0; i < index->n_segments; ++i) {
+        data_file = index->data_files[i];
+        if (data_file == NULL)
+            continue;
+        if (index->file_cache != NULL) {
+            data_file_cache_remove(index->file_cache, data_file);
+        }
+        else {
+            data_file_close(&data_file->file);
+            free(data_file);
+        }
+        index->data_files[i] = NULL;
+    }
+    if (index->file_cache != NULL)
+        data_file_cache_unlock(index->file_cache);
+}
+
+static void io_queue_init(IO_QUEUE *queue, WORKER_POOL *decode_pool)
+{
+    memset(queue, 0, sizeof(IO_QUEUE));
+    queue->decode_pool = decode_pool;
+#ifndef _WIN32
+    pthread_mutex_init(&queue->lock, NULL);
+#else
+    InitializeCriticalSection(&queue->lock);
+#endif
+#ifdef USE_IO_URING
+    queue->have_ring = (io_uring_queue_init(IO_QUEUE_DEPTH, &queue->ring, 0) == 0);
+    if (queue->have_ring) {
+        pthread_create(&queue->completion_thread, NULL, io_uring_completion_thread, (void *) queue);
+        return;
+    }
+#endif
+    pool_init(&queue->io_pool, IO_THREADS);
+}
+
+static void io_queue_lock(IO_QUEUE *queue)
+{
+#ifndef _WIN32
+    pthread_mutex_lock(&queue->lock);
+#else
+    EnterCriticalSection(&queue->lock);
+#endif
+}
+
+static void io_queue_unlock(IO_QUEUE *queue)
+{
+#ifndef _WIN32
+    pthread_mutex_unlock(&queue->lock);
+#else
+    LeaveCriticalSection(&queue->lock);
+#endif
+}
+
+static void io_queue_report(IO_QUEUE *queue)
+{
+    io_queue_lock(queue);
+    fprintf(stderr, "batched reads: %llu batches, %llu reads, %llu bytes\n",
+            (unsigned long long) queue->batches, (unsigned long long) queue->reads, (unsigned long long) queue->bytes);
+    io_queue_unlock(queue);
+}
+
+// The runs of uncached blocks a read task will decode, found before any of the batch's reads are issued (see
+// io_batch_run()).  These are the runs read_thread() finds too, unless the block cache changes in between, in which
+// case it reads what it doesn't find here itself.
+#ifndef _WIN32
+static void *io_plan_thread(void *argument)
+#else
+DWORD WINAPI io_plan_thread(LPVOID argument)
+#endif
+{
+    READ_TASK *read_task;
+    CHANNEL_INDEX *index;
+    BLOCK_CACHE *cache;
+    IO_PLAN *plan;
+    IO_REQUEST *request;
+    SEGMENT_BLOCKS *blocks;
+    DATA_FILE *data_file;
+    si8 start_time, end_time, start_samp, end_samp, first_block, last_block, b, run_end, seg_first;
+    si4 start_segment, end_segment, seg, blocks_seg;
+    ui4 num_samps;
+    
+    read_task = (READ_TASK *) argument;
+    index = read_task->thread_info->index;
+    cache = read_task->thread_info->fixed_info->block_cache;
+    plan = &read_task->io;
+    plan->n_requests = 0;
+    
+    // (as in read_thread(), which finds the blocks the same way)
+    start_time = read_task->page_start_sec * 1000000;
+    end_time = (read_task->page_start_sec + (read_task->n_pages * read_task->thread_info->fixed_info->secs_per_page)) * 1000000;
+    num_samps = (ui4)((((end_time - start_time) / 1000000.0) * index->sampling_frequency) + 0.5);
+    if (pyramid_zoom(read_task, (si8) num_samps) || index_zoom(read_task, (si8) num_samps))
+        return(NULL);
+    start_samp = sample_for_uutc_c(start_time, index);
+    end_samp = sample_for_uutc_c(end_time, index);
+    start_segment = segment_for_sample(index, start_samp);
+    end_segment = segment_for_sample(index, end_samp);
+    if (start_segment == -1)
+        start_segment = 0;
+    if (end_segment == -1)
+        end_segment = index->n_segments - 1;
+    first_block = index->segment_first_block[start_segment] + block_for_sample(index, start_segment, start_samp);
+    last_block = index->segment_first_block[end_segment] + block_for_sample(index, end_segment, end_samp);
+    if (last_block >= index->n_blocks)
+        last_block = index->n_blocks - 1;
+    
+    seg = start_segment;
+    blocks = NULL;
+    blocks_seg = -1;
+    for (b = first_block; b <= last_block; b = run_end)
+    {
+        run_end = b + 1;
+        if (block_cache_contains(cache, index, b))
+            continue;
+        while (b >= index->segment_first_block[seg + 1])
+            seg++;
+        if (seg != blocks_seg) {
+            segment_blocks_release(index, blocks);
+            blocks = segment_blocks_get(index, seg);
+            blocks_seg = seg;
+        }
+        if (blocks == NULL) {
+            run_end = index->segment_first_block[seg + 1];
+            continue;
+        }
+        seg_first = index->segment_first_block[seg];
+        for (; (run_end <= last_block) && (run_end < index->segment_first_block[seg + 1]); ++run_end) {
+            if (block_cache_contains(cache, index, run_end))
+                break;
+        }
+        data_file = data_file_get(index, seg);
+        if (data_file == NULL)
+            continue;
+        
+        if (plan->n_requests == plan->max_requests) {
+            plan->max_requests = (plan->max_requests > 0) ? (plan->max_requests * 2) : 16;
+            plan->requests = (IO_REQUEST *) realloc(plan->requests, (size_t) plan->max_requests * sizeof(IO_REQUEST));
+        }
+        request = plan->requests + plan->n_requests++;
+        memset(request, 0, sizeof(IO_REQUEST));
+        request->data_file = data_file;
+        request->segment = seg;
+        request->offset = blocks->file_offset[b - seg_first];
+        request->bytes = blocks->file_offset[run_end - 1 - seg_first] + blocks->bytes[run_end - 1 - seg_first] - request->offset;
+        request->mapped = (data_file->file.addr != NULL) && ((request->offset + request->bytes) <= (si8) data_file->file.bytes);
+    }
+    segment_blocks_release(index, blocks);
+    
+    return(NULL);
+}
+
+// a read of the batch is in; once a task's last one is, the task is decoded
+static void io_request_done(IO_REQUEST *request)
+{
+    IO_QUEUE *queue;
+    si4 pending;
+    
+    queue = request->plan->queue;
+    io_queue_lock(queue);
+    pending = --request->plan->pending;
+    queue->bytes += (ui8) request->result;
+    io_queue_unlock(queue);
+    if (pending == 0)
+        read_task_ready(queue, (READ_TASK *) request->plan->task);
+}
+
+#ifndef _WIN32
+static void *io_read_thread(void *argument)
+#else
+DWORD WINAPI io_read_thread(LPVOID argument)
+#endif
+{
+    IO_REQUEST *request;
+    
+    request = (IO_REQUEST *) argument;
+    if (!read_task_cancelled((READ_TASK *) request->plan->task))
+        request->result = data_file_read(request->data_file, request->buffer, request->bytes, request->offset);
+    io_request_done(request);
+    
+    return(NULL);
+}
+
+#ifdef USE_IO_URING
+// queue the rest of a read on the ring, from where it has got to; call with the lock held
+static void io_uring_queue_read(IO_QUEUE *queue, IO_REQUEST *request)
+{
+    struct io_uring_sqe *sqe;
+    
+    sqe = io_uring_get_sqe(&queue->ring);
+    io_uring_prep_read(sqe, request->data_file->file.fd, request->buffer + request->result, (unsigned) (request->bytes - request->result),
+                       (__u64) (request->offset + request->result));
+    io_uring_sqe_set_data(sqe, request);
+    queue->in_flight++;
+}
+
+// Move waiting reads onto the ring while it has room, and submit them; call with the lock held.  The reads of a
+// cancelled batch aren't issued: they are returned, for io_request_done() once the lock is let go.
+static IO_REQUEST *io_uring_fill(IO_QUEUE *queue)
+{
+    IO_REQUEST *request, *cancelled;
+    si4 queued;
+    
+    cancelled = NULL;
+    queued = 0;
+    while ((queue->in_flight < IO_QUEUE_DEPTH) && (queue->waiting_head != NULL)) {
+        request = queue->waiting_head;
+        queue->waiting_head = request->next;
+        if (read_task_cancelled((READ_TASK *) request->plan->task)) {
+            request->next = cancelled;
+            cancelled = request;
+            continue;
+        }
+        io_uring_queue_read(queue, request);
+        queued = 1;
+    }
+    if (queue->waiting_head == NULL)
+        queue->waiting_tail = NULL;
+    if (queued)
+        io_uring_submit(&queue->ring);
+    
+    return(cancelled);
+}
+
+static void io_uring_cancelled_done(IO_REQUEST *cancelled)
+{
+    IO_REQUEST *next;
+    
+    for (; cancelled != NULL; cancelled = next) {
+        next = cancelled->next;
+        io_request_done(cancelled);
+    }
+}
+
+// Queue a batch's reads on the ring (see io_uring_completion_thread()), without waiting for any of them
+static void io_uring_run(IO_QUEUE *queue, READ_TASK **tasks, si4 n_tasks)
+{
+    IO_REQUEST *request, *cancelled;
+    si4 i, k;
+    
+    io_queue_lock(queue);
+    for (i = 0; i < n_tasks; ++i) {
+        for (k = 0; k < tasks[i]->io.n_requests; ++k) {
+            request = tasks[i]->io.requests + k;
+            if (request->buffer == NULL)
+                continue;
+            request->next = NULL;
+            if (queue->waiting_tail != NULL)
+                queue->waiting_tail->next = request;
+            else
+                queue->waiting_head = request;
+            queue->waiting_tail = request;
+        }
+    }
+    cancelled = io_uring_fill(queue);
+    io_queue_unlock(queue);
+    io_uring_cancelled_done(cancelled);
+}
+
+// Reaps the ring's completions, up to IO_QUEUE_DEPTH reads in flight at once, so that decoding starts on a task as
+// soon as its reads are in while the server loop goes on with the UI's commands.  A short read is resumed where it
+// stopped (unless its batch has been cancelled since), until it reaches the end of the file.
+static void *io_uring_completion_thread(void *argument)
+{
+    IO_QUEUE *queue;
+    struct io_uring_cqe *cqe;
+    IO_REQUEST *request, *cancelled;
+    si4 res;
+    
+    queue = (IO_QUEUE *) argument;
+    while (1) {
+        if (io_uring_wait_cqe(&queue->ring, &cqe) < 0)
+            continue;
+        request = (IO_REQUEST *) io_uring_cqe_get_data(cqe);
+        res = cqe->res;
+        io_uring_cqe_seen(&queue->ring, cqe);
+        if (res > 0)
+            request->result += res;
+        io_queue_lock(queue);
+        queue->in_flight--;
+        if ((((res > 0) && (request->result < request->bytes)) || (res == -EINTR) || (res == -EAGAIN)) &&
+            !read_task_cancelled((READ_TASK *) request->plan->task)) {
+            io_uring_queue_read(queue, request);
+            io_uring_submit(&queue->ring);
+            request = NULL;
+        }
+        cancelled = io_uring_fill(queue);
+        io_queue_unlock(queue);
+        if (request != NULL)
+            io_request_done(request);
+        io_uring_cancelled_done(cancelled);
+    }
+    
+    return(NULL);
+}
+#endif
+
+// Read the runs of a batch's tasks (see io_plan_thread()) all at once, and decode each task on the decode pool as
+// soon as its own runs are in (see read_task_ready()).  Runs in a file's mapping are only read ahead, by the kernel,
+// for the whole batch before any decoding starts.  The others are read into the task's buffer, up to the batch's
+// share of IO_BATCH_MAX_BYTES; read_thread() reads the runs past that itself.  Returns once the reads are handed to
+// the ring or the IO threads, without waiting for them or for the decoding.
+static void io_batch_run(IO_QUEUE *queue, READ_TASK **tasks, si4 n_tasks)
+{
+    IO_PLAN *plan;
+    IO_REQUEST *request;
+    size_t batch_bytes, task_bytes, offset;
+    si4 i, k, n, batch_full;
+    
+    batch_bytes = 0;
+    batch_full = 0;
+    for (i = 0; i < n_tasks; ++i) {
+        plan = &tasks[i]->io;
+        plan->queue = queue;
+        plan->task = (void *) tasks[i];
+        plan->pending = 0;
+        task_bytes = 0;
+        for (k = 0; k < plan->n_requests; ++k) {
+            request = plan->requests + k;
+            request->plan = plan;
+            request->buffer = NULL;
+            request->result = 0;
+            if (request->mapped) {
+                advise_will_need(&request->data_file->file, request->offset, request->bytes);
+            }
+            else if (!batch_full) {
+                if ((batch_bytes + (size_t) request->bytes + 30) > (IO_BATCH_MAX_BYTES / PIPELINE_BATCHES)) {
+                    batch_full = 1;
+                    continue;
+                }
+                batch_bytes += (size_t) request->bytes + 30;
+                task_bytes += (size_t) request->bytes + 30;
+                plan->pending++;
+            }
+        }
+        if (plan->pending == 0)
+            continue;
+        plan->buffer = (ui1 *) arena_reserve(plan->buffer, &plan->buffer_bytes, task_bytes);
+        if (plan->buffer == NULL) {
+            plan->pending = 0;
+            continue;
+        }
+        // (the task's first pending runs that aren't mapped)
+        offset = 0;
+        for (k = n = 0; (k < plan->n_requests) && (n < plan->pending); ++k) {
+            request = plan->requests + k;
+            if (request->mapped)
+                continue;
+            request->buffer = plan->buffer + offset;
+            offset += (size_t) request->bytes + 30;
+            n++;
+        }
+    }
+    
+    // every task's count is set before any read can finish
+    io_queue_lock(queue);
+    queue->batches++;
+    for (i = 0; i < n_tasks; ++i)
+        queue->reads += (ui8) tasks[i]->io.pending;
+    io_queue_unlock(queue);
+    for (i = 0; i < n_tasks; ++i) {
+        if (tasks[i]->io.pending == 0)
+            read_task_ready(queue, tasks[i]);
+    }
+    
+#ifdef USE_IO_URING
+    if (queue->have_ring) {
+        io_uring_run(queue, tasks, n_tasks);
+        return;
+    }
+#endif
+    for (i = 0; i < n_tasks; ++i) {
+        for (k = 0; k < tasks[i]->io.n_requests; ++k) {
+            request = tasks[i]->io.requests + k;
+            if (request->buffer != NULL)
+                pool_submit(&queue->io_pool, io_read_thread, (void *) request);
+        }
+    }
+}
+
+// the batch has been decoded: let go of the files its runs were read from
+static void io_batch_finish(READ_TASK **tasks, si4 n_tasks)
+{
+    IO_PLAN *plan;
+    si4 i, k;
+    
+    for (i = 0; i < n_tasks; ++i) {
+        plan = &tasks[i]->io;
+        for (k = 0; k < plan->n_requests; ++k)
+            data_file_release(tasks[i]->thread_info->index, plan->requests[k].data_file);
+        plan->n_requests = 0;
+    }
+}
+
+// the run read into memory that covers bytes at offset of a segment's .tdat file, or NULL
+static IO_REQUEST *io_plan_find(IO_PLAN *plan, si4 segment, si8 offset, si8 bytes)
+{
+    IO_REQUEST *request;
+    si4 k;
+    
+    for (k = 0; k < plan->n_requests; ++k) {
+        request = plan->requests + k;
+        if ((request->buffer != NULL) && (request->segment == segment) && (request->offset <= offset) &&
+            ((offset + bytes) <= (request->offset + request->result)))
+            return(request);
+    }
+    
+    return(NULL);
+}
+
+static void io_plan_free(IO_PLAN *plan)
+{
+    if (plan->requests != NULL)
+        free(plan->requests);
+    if (plan->buffer != NULL)
+        free(plan->buffer);
+    memset(plan, 0, sizeof(IO_PLAN));
+}
+
+static void pipeline_init(PIPELINE *pipeline, WORKER_POOL *pool, IO_QUEUE *io_queue, CONTROL_CHANNEL *control)
+{
+    memset(pipeline, 0, sizeof(PIPELINE));
+    pipeline->max_batches = PIPELINE_BATCHES;
+    pipeline->pool = pool;
+    pipeline->io_queue = io_queue;
+    pipeline->control = control;
+}
+
+// read tasks for num_chans channels in each batch, up to max_batches of which may be in flight (the pipeline is empty)
+static void pipeline_alloc(PIPELINE *pipeline, si4 num_chans, si4 max_batches)
+{
+    PAGE_BATCH *batch;
+    si4 i;
+    
+    pipeline_free(pipeline);
+    pipeline->num_chans = num_chans;
+    pipeline->max_batches = max_batches;
+    for (i = 0; i < PIPELINE_BATCHES; ++i) {
+        batch = pipeline->batches + i;
+        batch->read_tasks = (READ_TASK *) calloc((size_t) num_chans, sizeof(READ_TASK));
+        batch->tasks = (READ_TASK **) calloc((size_t) num_chans, sizeof(READ_TASK *));
+        batch->pipeline = pipeline;
+    }
+}
+
+static void pipeline_free(PIPELINE *pipeline)
+{
+    PAGE_BATCH *batch;
+    si4 i, j;
+    
+    for (i = 0; i < PIPELINE_BATCHES; ++i) {
+        batch = pipeline->batches + i;
+        if (batch->read_tasks == NULL)
+            continue;
+        for (j = 0; j < pipeline->num_chans; ++j)
+            io_plan_free(&batch->read_tasks[j].io);
+        free(batch->read_tasks);
+        free(batch->tasks);
+        batch->read_tasks = NULL;
+        batch->tasks = NULL;
+    }
+    pipeline->num_chans = 0;
+    pipeline->head = pipeline->count = 0;
+}
+
+// wake the server loop: a batch is ready for its next stage
+static void pipeline_notify(PIPELINE *pipeline)
+{
+    control_lock(pipeline->control);
+#ifndef _WIN32
+    pthread_cond_signal(&pipeline->control->cond);
+#else
+    WakeConditionVariable(&pipeline->control->cond);
+#endif
+    control_unlock(pipeline->control);
+}
+
+// whether a batch in flight is ready for its next stage: its reads to be issued, or (the oldest) to be published
+static si4 pipeline_ready(PIPELINE *pipeline)
+{
+    PAGE_BATCH *batch;
+    si4 i;
+    
+    for (i = 0; i < pipeline->count; ++i) {
+        batch = pipeline->batches + ((pipeline->head + i) % PIPELINE_BATCHES);
+        if (!batch->reads_issued) {
+            if (batch->planning == 0)
+                return(1);
+        }
+        else if ((i == 0) && (batch->decoding == 0)) {
+            return(1);
+        }
+    }
+    
+    return(0);
+}
+
+// io_plan_thread() for a task of a batch; the last of the batch's tasks to find its runs wakes the server loop
+#ifndef _WIN32
+static void *batch_plan_thread(void *argument)
+#else
+DWORD WINAPI batch_plan_thread(LPVOID argument)
+#endif
+{
+    PAGE_BATCH *batch;
+    
+    batch = ((READ_TASK *) argument)->batch;
+    if (!batch->cancelled)
+        io_plan_thread(argument);
+    if (ATOMIC_DECREMENT(batch->planning) == 0)
+        pipeline_notify(batch->pipeline);
+    
+    return(NULL);
+}
+
+// read_thread() for a task of a batch.  The task then hands its channel on to the channel's task in the next batch,
+// and the last of the batch's tasks to be decoded wakes the server loop (which may reuse the batch from then on).
+#ifndef _WIN32
+static void *batch_read_thread(void *argument)
+#else
+DWORD WINAPI batch_read_thread(LPVOID argument)
+#endif
+{
+    READ_TASK *read_task;
+    PAGE_BATCH *batch, *next_batch;
+    PIPELINE *pipeline;
+    
+    read_task = (READ_TASK *) argument;
+    batch = read_task->batch;
+    pipeline = batch->pipeline;
+    if (!batch->cancelled)
+        read_thread(argument);
+    if (ATOMIC_DECREMENT(read_task->handoff) == 0) {
+        next_batch = pipeline->batches + (((batch - pipeline->batches) + 1) % PIPELINE_BATCHES);
+        read_task_gate(next_batch->read_tasks + (read_task - batch->read_tasks));
+    }
+    if (ATOMIC_DECREMENT(batch->decoding) == 0)
+        pipeline_notify(pipeline);
+    
+    return(NULL);
+}
+
+// a task of a batch is decoded once its gate has been brought down twice (see pipeline_start())
+static void read_task_gate(READ_TASK *read_task)
+{
+    if (ATOMIC_DECREMENT(read_task->gate) == 0)
+        pool_submit(read_task->batch->pipeline->pool, batch_read_thread, (void *) read_task);
+}
+
+// whether the task's batch has been cancelled (checked between a task's stages, and between runs of blocks)
+static si4 read_task_cancelled(READ_TASK *read_task)
+{
+    return((read_task->batch != NULL) && read_task->batch->cancelled);
+}
+
+// a task's reads are in: decode it (a task of a batch once the channel's task in the batch before has been, too)
+static void read_task_ready(IO_QUEUE *queue, READ_TASK *read_task)
+{
+    if (read_task->batch != NULL)
+        read_task_gate(read_task);
+    else
+        pool_submit(queue->decode_pool, read_thread, (void *) read_task);
+}
+
+// Start a batch: n_pages pages of every channel (of every channel a montage uses, with one) from page_start_sec,
+// into their ring slots.  Its tasks find their runs on the pool, and the server loop issues its reads once they all
+// have (see pipeline_issue_reads()).
+// A task's gate starts at 2, and is brought down once when its reads are in, and once when the channel's task in the
+// batch before has been decoded (right away if there is none in flight).  That task's handoff, also 2, is brought
+// down when it has been decoded, and when this batch starts: whichever comes second brings down this task's gate.
+static PAGE_BATCH *pipeline_start(PIPELINE *pipeline, THREAD_INFO *thread_info, MONTAGE *montage, RING_BUFFER *ring, sf8 page_start_sec,
+                                  si4 n_pages, si4 direction)
+{
+    PAGE_BATCH *batch, *prev_batch;
+    READ_TASK *read_task, *prev_task;
+    sf8 secs_per_page;
+    si4 i, j;
+    
+    prev_batch = NULL;
+    if (pipeline->count > 0)
+        prev_batch = pipeline->batches + ((pipeline->head + pipeline->count - 1) % PIPELINE_BATCHES);
+    batch = pipeline->batches + ((pipeline->head + pipeline->count) % PIPELINE_BATCHES);
+    pipeline->count++;
+    
+    secs_per_page = ring->header->secs_per_page;
+    batch->page_start_sec = page_start_sec;
+    batch->n_pages = n_pages;
+    batch->direction = direction;
+    batch->reads_issued = 0;
+    batch->cancelled = 0;
+    batch->n_tasks = 0;
+    for (i = 0; i < pipeline->num_chans; ++i) {
+        read_task = batch->read_tasks + i;
+        read_task->in_batch = ((montage == NULL) || montage->channel_used[i]);
+        if (!read_task->in_batch)
+            continue;
+        read_task->thread_info = thread_info + i;
+        read_task->page_start_sec = page_start_sec;
+        read_task->n_pages = n_pages;
+        read_task->direction = direction;
+        read_task->decode_only = (montage != NULL);
+        for (j = 0; j < n_pages; ++j)
+            read_task->page_data[j] = ring_slot(ring, page_start_sec + (j * secs_per_page));
+        read_task->batch = batch;
+        read_task->gate = 2;
+        read_task->handoff = 2;
+        batch->tasks[batch->n_tasks++] = read_task;
+    }
+    batch->planning = batch->decoding = batch->n_tasks;
+    
+    for (i = 0; i < batch->n_tasks; ++i) {
+        read_task = batch->tasks[i];
+        prev_task = (prev_batch != NULL) ? (prev_batch->read_tasks + (read_task - batch->read_tasks)) : NULL;
+        if ((prev_task == NULL) || !prev_task->in_batch || (ATOMIC_DECREMENT(prev_task->handoff) == 0))
+            read_task_gate(read_task);
+    }
+    for (i = 0; i < batch->n_tasks; ++i)
+        pool_submit(pipeline->pool, batch_plan_thread, (void *) batch->tasks[i]);
+    
+    return(batch);
+}
+
+// Issue the reads of the batches whose runs have all been found, oldest first.  A batch's tasks may each be decoded
+// in as many pieces as there are workers per channel of the batch.  A cancelled batch reads nothing; its tasks just
+// pass their channels on.
+static void pipeline_issue_reads(PIPELINE *pipeline)
+{
+    PAGE_BATCH *batch;
+    si4 i, k;
+    
+    for (k = 0; k < pipeline->count; ++k) {
+        batch = pipeline->batches + ((pipeline->head + k) % PIPELINE_BATCHES);
+        if (batch->reads_issued || (batch->planning > 0))
+            continue;
+        MEMORY_BARRIER();
+        batch->reads_issued = 1;
+        if (batch->cancelled) {
+            for (i = 0; i < batch->n_tasks; ++i)
+                read_task_ready(pipeline->io_queue, batch->tasks[i]);
+            continue;
+        }
+        for (i = 0; i < batch->n_tasks; ++i) {
+            batch->tasks[i]->n_pieces = pipeline->pool->num_workers / batch->n_tasks;
+            batch->tasks[i]->pool = pipeline->pool;
+        }
+        io_batch_run(pipeline->io_queue, batch->tasks, batch->n_tasks);
+    }
+}
+
+// the oldest batch in flight, if all its tasks have been decoded, so its pages can be published; otherwise NULL
+static PAGE_BATCH *pipeline_done(PIPELINE *pipeline)
+{
+    PAGE_BATCH *batch;
+    
+    if (pipeline->count == 0)
+        return(NULL);
+    batch = pipeline->batches + pipeline->head;
+    if (!batch->reads_issued || (batch->decoding > 0))
+        return(NULL);
+    MEMORY_BARRIER();
+    
+    return(batch);
+}
+
+// let go of the oldest batch, once its pages are published
+static void pipeline_retire(PIPELINE *pipeline)
+{
+    PAGE_BATCH *batch;
+    
+    batch = pipeline->batches + pipeline->head;
+    io_batch_finish(batch->tasks, batch->n_tasks);
+    pipeline->head = (pipeline->head + 1) % PIPELINE_BATCHES;
+    pipeline->count--;
+}
+
+// cancel every batch in flight (before a jump, new page specs, or quitting, which discard them anyway)
+static void pipeline_cancel(PIPELINE *pipeline)
+{
+    si4 k;
+    
+    for (k = 0; k < pipeline->count; ++k)
+        pipeline->batches[(pipeline->head + k) % PIPELINE_BATCHES].cancelled = 1;
+}
+
+// Cancel the batches in flight that no longer have a page in [first_sec, last_sec], the pages wanted around the view,
+// and take their pages back out of [*first_sec_read, *last_sec_read].  Only the outermost batches on either side
+// can go, so that the pages read stay contiguous; those are the ones started last in their direction.
+static void pipeline_cancel_stale(PIPELINE *pipeline, sf8 first_sec, sf8 last_sec, sf8 secs_per_page, sf8 *first_sec_read, sf8 *last_sec_read)
+{
+    PAGE_BATCH *batch;
+    si4 k, direction;
+    
+    for (direction = -1; direction <= 1; direction += 2) {
+        for (k = pipeline->count - 1; k >= 0; --k) {
+            batch = pipeline->batches + ((pipeline->head + k) % PIPELINE_BATCHES);
+            if ((batch->direction != direction) || batch->cancelled)
+                continue;
+            if (direction > 0) {
+                if (batch->page_start_sec <= last_sec)
+                    break;
+                *last_sec_read = batch->page_start_sec - secs_per_page;
+            }
+            else {
+                if ((batch->page_start_sec + ((batch->n_pages - 1) * secs_per_page)) >= first_sec)
+                    break;
+                *first_sec_read = batch->page_start_sec + (batch->n_pages * secs_per_page);
+            }
+            batch->cancelled = 1;
+        }
+    }
+}
+
+// The size and modification time of a segment's .tmet, .tidx and .tdat files (named alike), which identify the
+// segment to the index cache.  Returns 0 if one of them can't be found.
+static si4 segment_files_stat(SEGMENT_FILES *files)
+{
+    static const si1 *extensions[3] = {"tmet", "tidx", "tdat"};
+    si1 path[1024];
+    struct stat sb;
+    size_t len;
+    si4 i;
+    
+    strcpy(path, files->data_path);
+    len = strlen(path);
+    if ((len < 4) || strcmp(path + len - 4, "tdat"))
+        return(0);
+    for (i = 0; i < 3; ++i) {
+        strcpy(path + len - 4, extensions[i]);
+        if (stat(path, &sb) != 0)
+            return(0);
+        files->file_size[i] = (si8) sb.st_size;
+        files->mtime[i] = (si8) sb.st_mtime;
+    }
+    
+    return(1);
+}
+
+static si8 align_8(si8 bytes)
+{
+    return((bytes + 7) & ~((si8) 7));
+}
+
+// where each array of an index cache file starts, and the file size
+static si8 index_cache_layout(si4 n_segments, si8 n_blocks, si8 offsets[12])
+{
+    si8 bytes, seg_entries, block_entries;
+    si4 i;
+    
+    seg_entries = (si8) n_segments + 1;
+    block_entries = n_blocks + 1;
+    bytes = align_8((si8) sizeof(INDEX_CACHE_HEADER));
+    offsets[0] = bytes;  // segment_files
+    bytes += align_8(seg_entries * (si8) sizeof(SEGMENT_FILES));
+    for (i = 1; i < 5; ++i) {  // segment_first_block, segment_start_sample, segment_end_sample, segment_start_time
+        offsets[i] = bytes;
+        bytes += seg_entries * (si8) sizeof(si8);
+    }
+    for (i = 5; i < 8; ++i) {  // block start_time, start_sample, file_offset
+        offsets[i] = bytes;
+        bytes += block_entries * (si8) sizeof(si8);
+    }
+    for (i = 8; i < 12; ++i) {  // block bytes, samples, min_value, max_value
+        offsets[i] = bytes;
+        bytes += align_8(block_entries * (si8) sizeof(si4));
+    }
+    
+    return(bytes);
+}
+
+// the index cache file of a channel directory, named after its path
+static void index_cache_path(si1 *cache_dir, si1 *channel_path, si1 *path)
+{
+    sprintf(path, "%s/%016llx.eidx", cache_dir, (unsigned long long) fnv1a_hash(channel_path));
+}
+
+static si8 channel_dir_mtime(si1 *channel_path)
+{
+    struct stat sb;
+    
+    if (stat(channel_path, &sb) != 0)
+        return(-1);
+    
+    return((si8) sb.st_mtime);
+}
 
-    page_dir = (char*)argument;
-    fprintf(stderr, "page_dir == %s", page_dir);
+// Map a channel's index from the cache, if there is one and every file it was built from is unchanged; NULL if not.
+// Only the files are checked (stat), nothing of the channel is read.  Every segment's blocks are in the mapping, so
+// they are never read from the .tidx files (and the kernel, not the index memory ceiling, decides what stays in RAM).
+static CHANNEL_INDEX *index_cache_load(si1 *cache_dir, si1 *channel_path)
+{
+    si1 path[1200];
+    MAPPED_FILE *mf;
+    INDEX_CACHE_HEADER *header;
+    CHANNEL_INDEX *index;
+    SEGMENT_FILES files;
+    SEGMENT_BLOCKS *blocks;
+    si8 offsets[12], first;
+    si4 i;
+    
+    index_cache_path(cache_dir, channel_path, path);
+    mf = (MAPPED_FILE *) calloc((size_t) 1, sizeof(MAPPED_FILE));
+    if (!map_file_readonly(path, mf)) {
+        free(mf);
+        return(NULL);
+    }
+    header = (INDEX_CACHE_HEADER *) mf->addr;
+    if ((mf->bytes < sizeof(INDEX_CACHE_HEADER)) || (header->magic != INDEX_CACHE_MAGIC) || (header->version != INDEX_CACHE_VERSION) ||
+        (header->n_segments < 0) || (header->n_blocks < 0) ||
+        (index_cache_layout(header->n_segments, header->n_blocks, offsets) != (si8) mf->bytes) ||
+        strcmp(header->channel_path, channel_path) || (header->channel_mtime != channel_dir_mtime(channel_path)))
+        goto stale;
+    
+    index = (CHANNEL_INDEX *) calloc((size_t) 1, sizeof(CHANNEL_INDEX));
+    index->cache_map = mf;
+    index->n_segments = header->n_segments;
+    index->n_blocks = header->n_blocks;
+    index->maximum_block_samples = header->maximum_block_samples;
+    index->sampling_frequency = header->sampling_frequency;
+    index->units_conversion_factor = header->units_conversion_factor;
+    index->acquisition_channel_number = header->acquisition_channel_number;
+    index->earliest_start_time = header->earliest_start_time;
+    index->latest_end_time = header->latest_end_time;
+    index->segment_files = (SEGMENT_FILES *) ((ui1 *) mf->addr + offsets[0]);
+    index->segment_first_block = (si8 *) ((ui1 *) mf->addr + offsets[1]);
+    index->segment_start_sample = (si8 *) ((ui1 *) mf->addr + offsets[2]);
+    index->segment_end_sample = (si8 *) ((ui1 *) mf->addr + offsets[3]);
+    index->segment_start_time = (si8 *) ((ui1 *) mf->addr + offsets[4]);
+    for (i = 0; i < index->n_segments; ++i) {
+        files = index->segment_files[i];
+        if (!segment_files_stat(&files) || memcmp(&files, index->segment_files + i, sizeof(SEGMENT_FILES))) {
+            free(index);
+            goto stale;
+        }
+    }
+    
+    index->segment_blocks = (SEGMENT_BLOCKS **) calloc((size_t) index->n_segments + 1, sizeof(SEGMENT_BLOCKS *));
+    for (i = 0; i < index->n_segments; ++i) {
+        first = index->segment_first_block[i];
+        blocks = (SEGMENT_BLOCKS *) calloc((size_t) 1, sizeof(SEGMENT_BLOCKS));
+        blocks->home = index->segment_blocks + i;
+        blocks->n_blocks = index->segment_first_block[i + 1] - first;
+        blocks->start_time = (si8 *) ((ui1 *) mf->addr + offsets[5]) + first;
+        blocks->start_sample = (si8 *) ((ui1 *) mf->addr + offsets[6]) + first;
+        blocks->file_offset = (si8 *) ((ui1 *) mf->addr + offsets[7]) + first;
+        blocks->bytes = (si4 *) ((ui1 *) mf->addr + offsets[8]) + first;
+        blocks->samples = (si4 *) ((ui1 *) mf->addr + offsets[9]) + first;
+        blocks->min_value = (si4 *) ((ui1 *) mf->addr + offsets[10]) + first;
+        blocks->max_value = (si4 *) ((ui1 *) mf->addr + offsets[11]) + first;
+        index->segment_blocks[i] = blocks;
+    }
+    channel_index_open(index);
+    
+    return(index);
+    
+stale:
+    unmap_file(mf);
+    free(mf);
+    return(NULL);
+}
 
-    sprintf(file_name, "%sHEARTBEAT_UI", page_dir);
+// queue the writing of a channel's index cache file, which reads all its .tidx files, in the background
+static void index_cache_submit(WORKER_POOL *pool, CHANNEL_INDEX *index, si1 *cache_dir, si1 *channel_path)
+{
+    INDEX_CACHE_WRITE *job;
+    
+    job = (INDEX_CACHE_WRITE *) calloc((size_t) 1, sizeof(INDEX_CACHE_WRITE));
+    job->index = index;
+    strcpy(job->cache_dir, cache_dir);
+    strcpy(job->channel_path, channel_path);
+    job->generation = pyramid_generation;
+    pool_submit_background(pool, index_cache_write_thread, (void *) job);
+}
 
-    while (1)
-    {
+// Write a channel's index to the cache, for the next time the channel is opened (background task).  The segments'
+// blocks are read one at a time, straight from their .tidx files, so neither the whole index nor the segments in
+// use by reads are held for it.  Written aside and renamed, so a reader never maps half a file.
+#ifndef _WIN32
+static void *index_cache_write_thread(void *argument)
+#else
+DWORD WINAPI index_cache_write_thread(LPVOID argument)
+#endif
+{
+    INDEX_CACHE_WRITE *job;
+    CHANNEL_INDEX *index;
+    si1 path[1200], temp_path[1300];
+    INDEX_CACHE_HEADER header;
+    SEGMENT_FILES *files;
+    SEGMENT_BLOCKS *blocks;
+    si8 offsets[12], bytes, first, n_seg_bytes;
+    ui1 *buffer;
+    FILE *fp;
+    si4 i, ok;
+    
+    job = (INDEX_CACHE_WRITE *) argument;
+    index = job->index;
+    fp = NULL;
+    files = (SEGMENT_FILES *) calloc((size_t) index->n_segments + 1, sizeof(SEGMENT_FILES));
+    for (i = 0; i < index->n_segments; ++i) {
+        strcpy(files[i].data_path, index->segment_files[i].data_path);
+        if (!segment_files_stat(files + i))
+            goto done;
+    }
+    
+    memset(&header, 0, sizeof(INDEX_CACHE_HEADER));
+    header.magic = INDEX_CACHE_MAGIC;
+    header.version = INDEX_CACHE_VERSION;
+    strcpy(header.channel_path, job->channel_path);
+    header.channel_mtime = channel_dir_mtime(job->channel_path);
+    header.n_segments = index->n_segments;
+    header.n_blocks = index->n_blocks;
+    header.maximum_block_samples = index->maximum_block_samples;
+    header.sampling_frequency = index->sampling_frequency;
+    header.units_conversion_factor = index->units_conversion_factor;
+    header.acquisition_channel_number = index->acquisition_channel_number;
+    header.earliest_start_time = index->earliest_start_time;
+    header.latest_end_time = index->latest_end_time;
+    
+    // the header and the segment arrays
+    bytes = index_cache_layout(index->n_segments, index->n_blocks, offsets);
+    n_seg_bytes = ((si8) index->n_segments + 1) * (si8) sizeof(si8);
+    buffer = (ui1 *) calloc((size_t) offsets[5], sizeof(ui1));
+    memcpy(buffer, &header, sizeof(INDEX_CACHE_HEADER));
+    memcpy(buffer + offsets[0], files, ((size_t) index->n_segments + 1) * sizeof(SEGMENT_FILES));
+    memcpy(buffer + offsets[1], index->segment_first_block, (size_t) n_seg_bytes);
+    memcpy(buffer + offsets[2], index->segment_start_sample, (size_t) n_seg_bytes);
+    memcpy(buffer + offsets[3], index->segment_end_sample, (size_t) n_seg_bytes);
+    memcpy(buffer + offsets[4], index->segment_start_time, (size_t) n_seg_bytes);
+    
+    index_cache_path(job->cache_dir, job->channel_path, path);
+    sprintf(temp_path, "%s.%p.tmp", path, (void *) index);
+    fp = fopen(temp_path, "wb");
+    if (fp == NULL) {
+        free(buffer);
+        goto done;
+    }
+    ok = (fwrite(buffer, (size_t) offsets[5], 1, fp) == 1);
+    free(buffer);
+    
+    // each segment's blocks, into each of the block arrays
+    for (i = 0; ok && (i < index->n_segments); ++i) {
+        if (job->generation != pyramid_generation) {
+            ok = 0;
+            break;
+        }
+        first = index->segment_first_block[i];
+        blocks = read_segment_blocks(index->segment_files[i].data_path, index->password, i, index->segment_start_sample[i],
+                                     index->segment_first_block[i + 1] - first);
+        if (blocks == NULL) {
+            ok = 0;
+            break;
+        }
+        if (blocks->n_blocks > 0) {
+            fseek(fp, (long) (offsets[5] + (first * (si8) sizeof(si8))), SEEK_SET);
+            ok &= (fwrite(blocks->start_time, (size_t) blocks->n_blocks * sizeof(si8), 1, fp) == 1);
+            fseek(fp, (long) (offsets[6] + (first * (si8) sizeof(si8))), SEEK_SET);
+            ok &= (fwrite(blocks->start_sample, (size_t) blocks->n_blocks * sizeof(si8), 1, fp) == 1);
+            fseek(fp, (long) (offsets[7] + (first * (si8) sizeof(si8))), SEEK_SET);
+            ok &= (fwrite(blocks->file_offset, (size_t) blocks->n_blocks * sizeof(si8), 1, fp) == 1);
+            fseek(fp, (long) (offsets[8] + (first * (si8) sizeof(si4))), SEEK_SET);
+            ok &= (fwrite(blocks->bytes, (size_t) blocks->n_blocks * sizeof(si4), 1, fp) == 1);
+            fseek(fp, (long) (offsets[9] + (first * (si8) sizeof(si4))), SEEK_SET);
+            ok &= (fwrite(blocks->samples, (size_t) blocks->n_blocks * sizeof(si4), 1, fp) == 1);
+            fseek(fp, (long) (offsets[10] + (first * (si8) sizeof(si4))), SEEK_SET);
+            ok &= (fwrite(blocks->min_value, (size_t) blocks->n_blocks * sizeof(si4), 1, fp) == 1);
+            fseek(fp, (long) (offsets[11] + (first * (si8) sizeof(si4))), SEEK_SET);
+            ok &= (fwrite(blocks->max_value, (size_t) blocks->n_blocks * sizeof(si4), 1, fp) == 1);
+        }
+        free(blocks);
+    }
+    
+    // (the file is padded out to its full size)
+    if (ok) {
+        fseek(fp, (long) (bytes - 1), SEEK_SET);
+        ok = (fputc(0, fp) != EOF);
+    }
+    if (fclose(fp) != 0)
+        ok = 0;
+    fp = NULL;
+    if (!ok) {
+        remove(temp_path);
+        goto done;
+    }
+    remove(path);  // rename() won't replace a file on Windows
+    if (rename(temp_path, path) != 0)
+        remove(temp_path);
+    
+done:
+    free(files);
+    free(job);
+    
+    return(NULL);
+}
 
-        while ((fp = fopen(file_name, "rb")) == NULL) Sleep(100); //page_specs file
-        fscanf(fp, "%lf\n", &ui_time);
-        fclose(fp);
+// ask for a range of a mapped file to be read in ahead of use
+static void advise_will_need(MAPPED_FILE *mf, si8 offset, si8 bytes)
+{
+#ifndef _WIN32
+    si8 page_size, start;
+    
+    page_size = (si8) sysconf(_SC_PAGESIZE);
+    start = offset - (offset % page_size);
+    if ((start + bytes + (offset - start)) > (si8) mf->bytes)
+        bytes = (si8) mf->bytes - offset;
+    if (bytes > 0)
+        madvise((ui1 *) mf->addr + start, (size_t) (bytes + (offset - start)), MADV_WILLNEED);
+#endif
+}
 
-        if (time(NULL) - ui_time > 5)
-            exit(0);
-        
-        Sleep(500);
+// first i in [lo, hi) with values[i] > key, or hi if there is none; values must be sorted
+static si8 upper_bound_si8(si8 *values, si8 lo, si8 hi, si8 key)
+{
+    si8 mid;
+    
+    while (lo < hi) {
+        mid = lo + ((hi - lo) / 2);
+        if (values[mid] > key)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    
+    return(lo);
+}
+
+// the last segment whose samples (end inclusive) contain sample, or -1
+static si4 segment_for_sample(CHANNEL_INDEX *index, si8 sample)
+{
+    si8 s;
+    
+    s = upper_bound_si8(index->segment_start_sample, 0, index->n_segments, sample) - 1;
+    if ((s < 0) || (sample > index->segment_end_sample[s]))
+        return(-1);
+    
+    return((si4) s);
+}
+
+// the block of a segment that sample falls in, as an index into the segment's blocks
+static si8 block_for_sample(CHANNEL_INDEX *index, si4 segment, si8 sample)
+{
+    SEGMENT_BLOCKS *blocks;
+    si8 b, n;
+    
+    n = index->segment_first_block[segment + 1] - index->segment_first_block[segment];
+    if (n <= 1)
+        return(0);
+    blocks = segment_blocks_get(index, segment);
+    if (blocks == NULL)
+        return(0);
+    b = upper_bound_si8(blocks->start_sample, 1, n, sample) - 1;
+    segment_blocks_release(index, blocks);
+    
+    return(b);
+}
 
+// The segment with blocks that a time falls in: the last one starting at or before it, or the first one if none
+// does.  -1 if no segment has blocks.
+static si4 segment_for_time(CHANNEL_INDEX *index, si8 uutc)
+{
+    si8 s;
+    
+    s = upper_bound_si8(index->segment_start_time, 0, index->n_segments, uutc) - 1;
+    while ((s >= 0) && (index->segment_first_block[s + 1] == index->segment_first_block[s]))
+        s--;
+    if (s < 0) {
+        for (s = 0; (s < index->n_segments) && (index->segment_first_block[s + 1] == index->segment_first_block[s]); ++s);
+        if (s == index->n_segments)
+            return(-1);
     }
+    
+    return((si4) s);
+}
+
+// The mapping of sample_for_uutc_c() within segment s, b being the first of the segment's blocks that starts after
+// uutc.  Without the segment's blocks (its .tidx file can't be read), the time is measured from the segment start.
+static si8 segment_sample_for_uutc(CHANNEL_INDEX *index, si4 s, SEGMENT_BLOCKS *blocks, si8 b, si8 uutc)
+{
+    si8 sample, next_sample_number;
+    si4 next;
+    
+    if (blocks == NULL) {
+        sample = index->segment_start_sample[s] + (si8) (((((sf8) (uutc - index->segment_start_time[s])) / 1000000.0) * index->sampling_frequency) + 0.5);
+        if (sample > index->segment_end_sample[s])
+            sample = index->segment_end_sample[s];
+        if (sample < index->segment_start_sample[s])
+            sample = index->segment_start_sample[s];
+        return(sample);
+    }
+    if (b == 0)
+        return(blocks->start_sample[0]);  // before the segment's first block: in a gap, or before the recording
+    
+    if (b < blocks->n_blocks) {
+        next_sample_number = blocks->start_sample[b];
+    }
+    else {
+        // the first sample of the next segment with blocks
+        for (next = s + 1; (next < index->n_segments) && (index->segment_first_block[next + 1] == index->segment_first_block[next]); ++next);
+        if (next < index->n_segments)
+            next_sample_number = index->segment_start_sample[next];
+        else
+            next_sample_number = index->segment_end_sample[index->n_segments - 1];
+    }
+    
+    sample = blocks->start_sample[b - 1] + (si8) (((((sf8) (uutc - blocks->start_time[b - 1])) / 1000000.0) * index->sampling_frequency) + 0.5);
+    if (sample > next_sample_number)
+        sample = next_sample_number;  // prevent it from going too far
+    
+    return(sample);
 }
-#endif
 
+// Map a time to a sample number: the time is measured from the start of the block it falls in, and the result
+// can't go past the start of the next block (so times in a gap map to the first sample after the gap).
+si8 sample_for_uutc_c(si8 uutc, CHANNEL_INDEX *index)
+{
+    SEGMENT_BLOCKS *blocks;
+    si8 b, sample;
+    si4 s;
+    
+    s = segment_for_time(index, uutc);
+    if (s < 0)
+        return(0);
+    
+    blocks = segment_blocks_get(index, s);
+    b = (blocks != NULL) ? upper_bound_si8(blocks->start_time, 0, blocks->n_blocks, uutc) : 0;
+    sample = segment_sample_for_uutc(index, s, blocks, b, uutc);
+    segment_blocks_release(index, blocks);
+    
+    return(sample);
+}
 
-si8 sample_for_uutc_c(si8 uutc, CHANNEL *channel)
+// Same mapping as sample_for_uutc_c(), for n increasing times start_uutc + (k * step_uutc), in one sweep over the
+// blocks instead of a search per time.
+static void samples_for_uutc_sweep(CHANNEL_INDEX *index, si8 start_uutc, sf8 step_uutc, si4 n, si8 *samples)
 {
-    ui8 i, j, sample;
-    sf8 native_samp_freq;
-    ui8 prev_sample_number;
-    si8 prev_time, seg_start_sample;
-    si8 next_sample_number;
+    SEGMENT_BLOCKS *blocks;
+    si4 k, s, seg;
+    si8 b, uutc;
+    
+    blocks = NULL;
+    s = -1;
+    b = 0;  // first block of the segment starting after the current time
+    for (k = 0; k < n; ++k)
+    {
+        uutc = start_uutc + (si8) ((k * step_uutc) + 0.5);
+        seg = segment_for_time(index, uutc);
+        if (seg < 0) {
+            samples[k] = 0;
+            continue;
+        }
+        if (seg != s) {
+            segment_blocks_release(index, blocks);
+            blocks = segment_blocks_get(index, seg);
+            s = seg;
+            b = 0;
+        }
+        while ((blocks != NULL) && (b < blocks->n_blocks) && (blocks->start_time[b] <= uutc))
+            b++;
+        samples[k] = segment_sample_for_uutc(index, s, blocks, b, uutc);
+    }
+    segment_blocks_release(index, blocks);
+}
+
+static ui8 fnv1a_hash(si1 *text)
+{
+    ui8 hash;
+    
+    hash = 0xcbf29ce484222325ULL;
+    while (*text) {
+        hash ^= (ui1) *text++;
+        hash *= 0x100000001b3ULL;
+    }
+    
+    return(hash);
+}
+
+static si4 pyramid_header_matches(PYRAMID_HEADER *header, PYRAMID_BUILD *build)
+{
+    return ((header->magic == PYRAMID_MAGIC) && (header->version == PYRAMID_VERSION) &&
+            (header->file_size == build->file_size) && (header->mtime == build->mtime) &&
+            (header->number_of_samples == build->number_of_samples) &&
+            (header->base_bin == PYRAMID_BASE_BIN) && (header->factor == PYRAMID_FACTOR) &&
+            (header->n_levels > 0) && (header->n_levels <= PYRAMID_MAX_LEVELS));
+}
+
+// Builds the pyramid of one segment (background task).  An up-to-date pyramid already in the cache is used as is.
+// Otherwise the segment's block index is read, then every block (in large chunks), each CRC-checked and decoded
+// once.  Level 0 is binned from the samples, and each level above is made from the one below.  The file is written
+// under a temporary name and renamed when complete, so a half-written pyramid is never used.
+#ifndef _WIN32
+static void *pyramid_build_thread(void *argument)
+#else
+DWORD WINAPI pyramid_build_thread(LPVOID argument)
+#endif
+{
+    PYRAMID_BUILD *build;
+    PYRAMID *pyramid;
+    PYRAMID_HEADER header;
+    FILE *fp;
+    si1 temp_path[1100];
+    ui1 *chunk, header_bytes[PYRAMID_HEADER_BYTES];
+    si4 *bins, *lower, *upper, *decoded, v;
+    si8 b, b_end, k, m, l, idx, n, total_bins, chunk_start, chunk_bytes, chunk_size, first_sample;
+    RED_PROCESSING_STRUCT *rps;
+    SEGMENT_BLOCKS *blocks;
+    
+    build = (PYRAMID_BUILD *) argument;
+    pyramid = build->pyramid;
+    blocks = NULL;
+    bins = NULL;
+    chunk = NULL;
+    decoded = NULL;
+    rps = NULL;
+    fp = NULL;
+    
+    if (build->generation != pyramid_generation)
+        goto failed;
+    
+    // reuse a pyramid built earlier from the same file
+    fp = fopen(pyramid->path, "rb");
+    if (fp != NULL) {
+        n = (si8) fread(&header, sizeof(PYRAMID_HEADER), 1, fp);
+        fclose(fp);
+        fp = NULL;
+        if ((n == 1) && pyramid_header_matches(&header, build))
+            goto built;
+    }
+    
+    if ((build->number_of_samples <= 0) || (build->number_of_blocks <= 0))
+        goto failed;
+    
+    // level sizes
+    memset(&header, 0, sizeof(PYRAMID_HEADER));
+    header.magic = PYRAMID_MAGIC;
+    header.version = PYRAMID_VERSION;
+    header.file_size = build->file_size;
+    header.mtime = build->mtime;
+    header.number_of_samples = build->number_of_samples;
+    header.base_bin = PYRAMID_BASE_BIN;
+    header.factor = PYRAMID_FACTOR;
+    total_bins = 0;
+    n = (build->number_of_samples + PYRAMID_BASE_BIN - 1) / PYRAMID_BASE_BIN;
+    while (header.n_levels < PYRAMID_MAX_LEVELS) {
+        header.level_offset[header.n_levels] = total_bins;
+        header.level_bins[header.n_levels] = n;
+        total_bins += n;
+        header.n_levels++;
+        if (n <= 1)
+            break;
+        n = (n + PYRAMID_FACTOR - 1) / PYRAMID_FACTOR;
+    }
+    
+    bins = (si4 *) malloc((size_t) total_bins * 2 * sizeof(si4));
+    if (bins == NULL)
+        goto failed;
+    for (k = 0; k < header.level_bins[0]; ++k) {
+        bins[2 * k] = 0x7FFFFFFF;
+        bins[(2 * k) + 1] = RED_NAN;
+    }
     
-    native_samp_freq = channel->metadata.time_series_section_2->sampling_frequency;
-    prev_sample_number = channel->segments[0].metadata_fps->metadata.time_series_section_2->start_sample;
-    prev_time = channel->segments[0].time_series_indices_fps->time_series_indices[0].start_time;
+    blocks = read_segment_blocks(build->tdat_path, build->password, build->segment, build->start_sample, build->number_of_blocks);
+    if (blocks == NULL)
+        goto failed;
+    fp = fopen(build->tdat_path, "rb");
+    if (fp == NULL)
+        goto failed;
+    chunk_size = PYRAMID_READ_CHUNK;
+    chunk = (ui1 *) malloc((size_t) chunk_size);
+    decoded = (si4 *) malloc((size_t) ((build->max_samps * 1.1) * sizeof(si4)));
+    rps = (RED_PROCESSING_STRUCT *) calloc((size_t) 1, sizeof(RED_PROCESSING_STRUCT));
+    rps->compression.mode = RED_DECOMPRESSION;
+    rps->difference_buffer = (si1 *) e_calloc((size_t) RED_MAX_DIFFERENCE_BYTES(build->max_samps), sizeof(ui1), __FUNCTION__, __LINE__, USE_GLOBAL_BEHAVIOR);
     
-    for (j = 0; j < (ui8) channel->number_of_segments; j++)
+    // level 0, from the decoded samples, reading as many consecutive blocks at a time as fit in a chunk
+    for (b = 0; b < build->number_of_blocks; b = b_end)
     {
-        seg_start_sample = channel->segments[j].metadata_fps->metadata.time_series_section_2->start_sample;
+        if (build->generation != pyramid_generation)
+            goto failed;
         
-        // initialize next_sample_number to end of current segment, in case we're on the last segment and we
-        // go all the way to the end of the segment.
-        // Otherwise this value will get overridden later on
-        next_sample_number = seg_start_sample + channel->segments[j].metadata_fps->metadata.time_series_section_2->number_of_samples;
+        chunk_start = blocks->file_offset[b];
+        for (b_end = b + 1; b_end < build->number_of_blocks; ++b_end) {
+            if ((blocks->file_offset[b_end] + blocks->bytes[b_end] - chunk_start) > chunk_size)
+                break;
+        }
+        chunk_bytes = blocks->file_offset[b_end - 1] + blocks->bytes[b_end - 1] - chunk_start;
+        if (chunk_bytes > chunk_size) {  // a single block bigger than a chunk
+            free(chunk);
+            chunk_size = chunk_bytes;
+            chunk = (ui1 *) malloc((size_t) chunk_size);
+        }
+        fseek(fp, chunk_start, SEEK_SET);
+        chunk_bytes = (si8) fread(chunk, sizeof(ui1), (size_t) chunk_bytes, fp);
         
-        for (i = 0; i < (ui8) channel->segments[j].metadata_fps->metadata.time_series_section_2->number_of_blocks; ++i) {
-            if (channel->segments[j].time_series_indices_fps->time_series_indices[i].start_time > uutc)
-            {
-                next_sample_number = channel->segments[j].time_series_indices_fps->time_series_indices[i].start_sample + seg_start_sample;
-                goto done;
+        for (k = b; k < b_end; ++k)
+        {
+            rps->compressed_data = chunk + (blocks->file_offset[k] - chunk_start);
+            rps->block_header = (RED_BLOCK_HEADER *) rps->compressed_data;
+            if ((blocks->file_offset[k] - chunk_start) >= chunk_bytes)
+                break;
+            // bad blocks are left out, their bins stay empty
+            if (!check_block_crc((ui1 *) rps->block_header, build->max_samps, chunk, (ui8) chunk_bytes))
+                continue;
+            rps->decompressed_ptr = rps->decompressed_data = decoded;
+            RED_decode(rps);
+            
+            // (sample numbers within the segment)
+            first_sample = blocks->start_sample[k] - build->start_sample;
+            n = rps->block_header->number_of_samples;
+            if ((first_sample + n) > build->number_of_samples)
+                n = build->number_of_samples - first_sample;
+            for (m = 0; m < n; ++m) {
+                idx = first_sample + m;
+                if (idx < 0)
+                    continue;
+                idx = 2 * (idx / PYRAMID_BASE_BIN);
+                v = decoded[m];
+                bins[idx + 1] = (v > bins[idx + 1]) ? v : bins[idx + 1];
+                v = (v == RED_NAN) ? 0x7FFFFFFF : v;
+                bins[idx] = (v < bins[idx]) ? v : bins[idx];
+            }
+        }
+    }
+    fclose(fp);
+    fp = NULL;
+    
+    // higher levels
+    for (l = 1; l < header.n_levels; ++l)
+    {
+        lower = bins + (2 * header.level_offset[l - 1]);
+        upper = bins + (2 * header.level_offset[l]);
+        for (k = 0; k < header.level_bins[l]; ++k) {
+            upper[2 * k] = 0x7FFFFFFF;
+            upper[(2 * k) + 1] = RED_NAN;
+            for (m = k * PYRAMID_FACTOR; (m < ((k + 1) * PYRAMID_FACTOR)) && (m < header.level_bins[l - 1]); ++m) {
+                upper[2 * k] = (lower[2 * m] < upper[2 * k]) ? lower[2 * m] : upper[2 * k];
+                upper[(2 * k) + 1] = (lower[(2 * m) + 1] > upper[(2 * k) + 1]) ? lower[(2 * m) + 1] : upper[(2 * k) + 1];
             }
-            prev_sample_number = channel->segments[j].time_series_indices_fps->time_series_indices[i].start_sample + seg_start_sample;
-            prev_time = channel->segments[j].time_series_indices_fps->time_series_indices[i].start_time;
         }
     }
     
+    if (build->generation != pyramid_generation)
+        goto failed;
+    
+    // write it out
+    sprintf(temp_path, "%s.tmp", pyramid->path);
+    fp = fopen(temp_path, "wb");
+    if (fp == NULL)
+        goto failed;
+    memset(header_bytes, 0, PYRAMID_HEADER_BYTES);
+    memcpy(header_bytes, &header, sizeof(PYRAMID_HEADER));
+    n = (si8) fwrite(header_bytes, PYRAMID_HEADER_BYTES, 1, fp);
+    n += (si8) fwrite(bins, (size_t) total_bins * 2 * sizeof(si4), 1, fp);
+    if (fclose(fp) != 0)
+        n = 0;
+    fp = NULL;
+    if (n != 2) {
+        remove(temp_path);
+        goto failed;
+    }
+    remove(pyramid->path);  // rename() won't replace a file on Windows
+    if (rename(temp_path, pyramid->path) != 0) {
+        remove(temp_path);
+        goto failed;
+    }
+    
+built:
+    MEMORY_BARRIER();
+    pyramid->state = PYRAMID_ON_DISK;
+    goto done;
+    
+failed:
+    pyramid->state = PYRAMID_FAILED;
+    
 done:
+    if (fp != NULL)
+        fclose(fp);
+    if (rps != NULL) {
+        if (rps->difference_buffer != NULL)
+            free(rps->difference_buffer);
+        free(rps);
+    }
+    if (bins != NULL)
+        free(bins);
+    if (chunk != NULL)
+        free(chunk);
+    if (decoded != NULL)
+        free(decoded);
+    if (blocks != NULL)
+        free(blocks);
+    free(build);
     
-    sample = prev_sample_number + (ui8) (((((sf8) (uutc - prev_time)) / 1000000.0) * native_samp_freq) + 0.5);
-    if (sample > next_sample_number)
-        sample = next_sample_number;  // prevent it from going too far
+    return(NULL);
+}
+
+// queue the pyramid build of one segment; the cache file is named after the identity of the segment's .tdat file
+static void pyramid_submit(WORKER_POOL *pool, THREAD_INFO *thread_info, si4 seg_idx, si1 *cache_dir)
+{
+    CHANNEL_INDEX *index;
+    PYRAMID *pyramid;
+    PYRAMID_BUILD *build;
+    struct stat sb;
+    si1 identity[1200];
+    si8 first;
     
-    return(sample);
+    index = thread_info->index;
+    pyramid = thread_info->pyramids + seg_idx;
+    first = index->segment_first_block[seg_idx];
+    if (index->segment_first_block[seg_idx + 1] <= first) {
+        pyramid->state = PYRAMID_FAILED;
+        return;
+    }
+    
+    build = (PYRAMID_BUILD *) calloc((size_t) 1, sizeof(PYRAMID_BUILD));
+    strcpy(build->tdat_path, index->segment_files[seg_idx].data_path);
+    if (stat(build->tdat_path, &sb) != 0) {
+        free(build);
+        pyramid->state = PYRAMID_FAILED;
+        return;
+    }
+    build->pyramid = pyramid;
+    build->file_size = (si8) sb.st_size;
+    build->mtime = (si8) sb.st_mtime;
+    build->number_of_samples = index->segment_end_sample[seg_idx] - index->segment_start_sample[seg_idx];
+    build->number_of_blocks = index->segment_first_block[seg_idx + 1] - first;
+    build->max_samps = index->maximum_block_samples;
+    build->segment = seg_idx;
+    build->start_sample = index->segment_start_sample[seg_idx];
+    build->password = index->password;
+    build->generation = pyramid_generation;
+    
+    sprintf(identity, "%s|%lld|%lld", build->tdat_path, (long long) build->file_size, (long long) build->mtime);
+    sprintf(pyramid->path, "%s/%016llx.pyr", cache_dir, (unsigned long long) fnv1a_hash(identity));
+    pyramid->state = PYRAMID_BUILDING;
+    
+    pool_submit_background(pool, pyramid_build_thread, (void *) build);
+}
+
+// Queue pyramid builds for every segment of every channel, the segments nearest the current view first.
+static void pyramid_schedule(WORKER_POOL *pool, THREAD_INFO *thread_info, si4 num_chans, si1 *cache_dir, sf8 curr_view_sec)
+{
+    si4 i, d, s, n_segments, max_segments, *view_seg;
+    CHANNEL_INDEX *index;
+    
+    view_seg = (si4 *) calloc((size_t) num_chans, sizeof(si4));
+    max_segments = 0;
+    for (i = 0; i < num_chans; ++i) {
+        index = thread_info[i].index;
+        n_segments = index->n_segments;
+        thread_info[i].pyramids = (PYRAMID *) calloc((size_t) (n_segments > 0 ? n_segments : 1), sizeof(PYRAMID));
+        for (s = 1; s < n_segments; ++s) {
+            if ((index->segment_first_block[s + 1] > index->segment_first_block[s]) &&
+                (index->segment_start_time[s] <= (si8) (curr_view_sec * 1000000.0)))
+                view_seg[i] = s;
+        }
+        if (n_segments > max_segments)
+            max_segments = n_segments;
+    }
+    
+    for (d = 0; d < max_segments; ++d) {
+        for (i = 0; i < num_chans; ++i) {
+            n_segments = thread_info[i].index->n_segments;
+            s = view_seg[i] + d;
+            if (s < n_segments)
+                pyramid_submit(pool, thread_info + i, s, cache_dir);
+            s = view_seg[i] - d;
+            if ((d > 0) && (s >= 0))
+                pyramid_submit(pool, thread_info + i, s, cache_dir);
+        }
+    }
+    
+    free(view_seg);
+}
+
+// unmap and free the pyramids; no builds may be running (see pool_wait_background())
+static void pyramid_release(THREAD_INFO *thread_info, si4 num_chans)
+{
+    si4 i, s;
+    
+    if (thread_info == NULL)
+        return;
+    for (i = 0; i < num_chans; ++i) {
+        if (thread_info[i].pyramids == NULL)
+            continue;
+        for (s = 0; s < thread_info[i].index->n_segments; ++s)
+            unmap_file(&thread_info[i].pyramids[s].map);
+        free(thread_info[i].pyramids);
+        thread_info[i].pyramids = NULL;
+    }
+}
+
+// map a built pyramid on first use; returns 0 if it isn't available (yet)
+static si4 pyramid_map(PYRAMID *pyramid)
+{
+    PYRAMID_HEADER *header;
+    si8 total_bins;
+    
+    if (pyramid->state == PYRAMID_READY)
+        return(1);
+    if (pyramid->state != PYRAMID_ON_DISK)
+        return(0);
+    MEMORY_BARRIER();
+    
+    if (!map_file_readonly(pyramid->path, &pyramid->map)) {
+        pyramid->state = PYRAMID_FAILED;
+        return(0);
+    }
+    header = (PYRAMID_HEADER *) pyramid->map.addr;
+    total_bins = -1;
+    if ((pyramid->map.bytes >= PYRAMID_HEADER_BYTES) && (header->magic == PYRAMID_MAGIC) &&
+        (header->n_levels > 0) && (header->n_levels <= PYRAMID_MAX_LEVELS))
+        total_bins = header->level_offset[header->n_levels - 1] + header->level_bins[header->n_levels - 1];
+    if ((total_bins < 0) || (pyramid->map.bytes < (PYRAMID_HEADER_BYTES + ((size_t) total_bins * 2 * sizeof(si4))))) {
+        unmap_file(&pyramid->map);
+        pyramid->state = PYRAMID_FAILED;
+        return(0);
+    }
+    pyramid->header = header;
+    pyramid->bins = (si4 *) ((ui1 *) pyramid->map.addr + PYRAMID_HEADER_BYTES);
+    pyramid->state = PYRAMID_READY;
+    
+    return(1);
+}
+
+// Whether a batch's envelope pages are zoomed out far enough to come from the pyramids (see pyramid_envelope()).
+// The pyramids hold unfiltered data, so a filtered channel is decoded instead.
+static si4 pyramid_zoom(READ_TASK *read_task, si8 num_samps)
+{
+    FIXED_INFO *fixed_info;
+    THREAD_INFO *thread_info;
+    
+    thread_info = read_task->thread_info;
+    fixed_info = thread_info->fixed_info;
+    
+    return((fixed_info->display_mode == DISPLAY_ENVELOPE) && (thread_info->pyramids != NULL) && (thread_info->filter.n_sections == 0) &&
+           !read_task->decode_only &&
+           (((sf8) num_samps / (sf8) (read_task->n_pages * fixed_info->samps_per_page)) >= (PYRAMID_MIN_BINS_PER_COL * PYRAMID_BASE_BIN)));
+}
+
+// Envelope page from the pyramids, in time proportional to the number of columns.  Each column takes the min/max
+// of the bins under it, at the coarsest level that still has PYRAMID_MIN_BINS_PER_COL bins per column.  Returns 0
+// if a segment under the page has no usable pyramid, in which case the page is decoded as usual.
+static si4 pyramid_envelope(THREAD_INFO *thread_info, si8 start_time, si8 end_time, sf4 *out, si4 out_stride)
+{
+    CHANNEL_INDEX *index;
+    PYRAMID *pyramid;
+    si4 j, s, t, n_cols, n_segments, level, l, min_val, max_val, *bins;
+    si8 *edges, a, b, seg_start, seg_end, la, lb, k, level_bin, bin_samps;
+    sf8 samps_per_col;
+    
+    index = thread_info->index;
+    n_cols = thread_info->fixed_info->samps_per_page;
+    n_segments = index->n_segments;
+    
+    // column edges, in samples
+    edges = (si8 *) malloc((size_t) (n_cols + 1) * sizeof(si8));
+    samples_for_uutc_sweep(thread_info->index, start_time, (sf8) (end_time - start_time) / (sf8) n_cols, n_cols + 1, edges);
+    
+    for (s = 0; s < n_segments; ++s) {
+        seg_start = index->segment_start_sample[s];
+        seg_end = index->segment_end_sample[s];
+        if ((seg_end <= seg_start) || (seg_end <= edges[0]) || (seg_start >= edges[n_cols]))
+            continue;
+        if (!pyramid_map(thread_info->pyramids + s)) {
+            free(edges);
+            return(0);
+        }
+    }
+    
+    samps_per_col = (((end_time - start_time) / 1000000.0) * index->sampling_frequency) / (sf8) n_cols;
+    level = 0;
+    level_bin = PYRAMID_BASE_BIN;
+    while (((level + 1) < PYRAMID_MAX_LEVELS) && ((level_bin * PYRAMID_FACTOR * PYRAMID_MIN_BINS_PER_COL) <= samps_per_col)) {
+        level++;
+        level_bin *= PYRAMID_FACTOR;
+    }
+    
+    s = 0;
+    for (j = 0; j < n_cols; ++j)
+    {
+        a = edges[j];
+        b = edges[j + 1];
+        min_val = 0x7FFFFFFF;
+        max_val = RED_NAN;
+        
+        // skip segments that end before this column; columns over a gap have a == b, and stay empty
+        while ((s < n_segments) && (index->segment_end_sample[s] <= a))
+            s++;
+        for (t = s; (t < n_segments) && (a < b); ++t)
+        {
+            seg_start = index->segment_start_sample[t];
+            seg_end = index->segment_end_sample[t];
+            if (seg_start >= b)
+                break;
+            la = ((a > seg_start) ? a : seg_start) - seg_start;
+            lb = ((b < seg_end) ? b : seg_end) - seg_start;
+            if (la >= lb)
+                continue;
+            
+            pyramid = thread_info->pyramids + t;
+            l = (level < pyramid->header->n_levels) ? level : (pyramid->header->n_levels - 1);
+            bin_samps = (si8) pyramid->header->base_bin;
+            for (k = 0; k < l; ++k)
+                bin_samps *= pyramid->header->factor;
+            bins = pyramid->bins + (2 * pyramid->header->level_offset[l]);
+            for (k = la / bin_samps; k <= ((lb - 1) / bin_samps); ++k) {
+                min_val = (bins[2 * k] < min_val) ? bins[2 * k] : min_val;
+                max_val = (bins[(2 * k) + 1] > max_val) ? bins[(2 * k) + 1] : max_val;
+            }
+        }
+        
+        envelope_store(out, out_stride, j, min_val, max_val, index->units_conversion_factor);
+    }
+    
+    free(edges);
+    
+    return(1);
+}
+
+// Whether a batch's envelope pages are zoomed out past a block per column, so they can come from the block indices
+// (see index_envelope()).  Like the pyramids, the indices hold the min/max of unfiltered data.
+static si4 index_zoom(READ_TASK *read_task, si8 num_samps)
+{
+    FIXED_INFO *fixed_info;
+    THREAD_INFO *thread_info;
+    
+    thread_info = read_task->thread_info;
+    fixed_info = thread_info->fixed_info;
+    
+    return((fixed_info->display_mode == DISPLAY_ENVELOPE) && (thread_info->filter.n_sections == 0) && !read_task->decode_only &&
+           (thread_info->index->maximum_block_samples > 0) &&
+           (((sf8) num_samps / (sf8) (read_task->n_pages * fixed_info->samps_per_page)) > (sf8) thread_info->index->maximum_block_samples));
+}
+
+// Envelope page from the block indices alone, without reading any data: each column takes the min/max of the blocks
+// under it, which the .tidx files hold for every block.  A block that straddles two columns counts in both, so at
+// this zoom a feature can show one column wider than it is.  Returns 0 if a segment's block index can't be loaded,
+// in which case the page is decoded as usual.
+static si4 index_envelope(THREAD_INFO *thread_info, si8 start_time, si8 end_time, sf4 *out, si4 out_stride)
+{
+    CHANNEL_INDEX *index;
+    SEGMENT_BLOCKS *blocks;
+    si4 j, c, s, n_cols, served, *min_vals, *max_vals;
+    si8 *edges, i, block_start, block_end;
+    
+    index = thread_info->index;
+    n_cols = thread_info->fixed_info->samps_per_page;
+    
+    // column edges, in samples
+    edges = (si8 *) malloc((size_t) (n_cols + 1) * sizeof(si8));
+    samples_for_uutc_sweep(index, start_time, (sf8) (end_time - start_time) / (sf8) n_cols, n_cols + 1, edges);
+    min_vals = (si4 *) malloc((size_t) n_cols * 2 * sizeof(si4));
+    max_vals = min_vals + n_cols;
+    for (j = 0; j < n_cols; ++j) {
+        min_vals[j] = 0x7FFFFFFF;
+        max_vals[j] = RED_NAN;
+    }
+    
+    served = 1;
+    j = 0;
+    for (s = 0; s < index->n_segments; ++s) {
+        if ((index->segment_end_sample[s] <= index->segment_start_sample[s]) || (index->segment_end_sample[s] <= edges[0]) ||
+            (index->segment_start_sample[s] >= edges[n_cols]))
+            continue;
+        blocks = segment_blocks_get(index, s);
+        if (blocks == NULL) {
+            served = 0;
+            break;
+        }
+        
+        // from the block the page starts in, to the last one that starts before it ends
+        i = upper_bound_si8(blocks->start_sample, 0, blocks->n_blocks, edges[0]) - 1;
+        if (i < 0)
+            i = 0;
+        for (; (i < blocks->n_blocks) && (blocks->start_sample[i] < edges[n_cols]); ++i) {
+            if (blocks->max_value[i] == RED_NAN)  // (no valid samples)
+                continue;
+            block_start = blocks->start_sample[i];
+            block_end = block_start + blocks->samples[i];
+            while ((j < n_cols) && (edges[j + 1] <= block_start))
+                j++;
+            // (columns over a gap have no samples, and stay empty)
+            for (c = j; (c < n_cols) && (edges[c] < block_end); ++c) {
+                if (edges[c] == edges[c + 1])
+                    continue;
+                if (blocks->min_value[i] < min_vals[c])
+                    min_vals[c] = blocks->min_value[i];
+                if (blocks->max_value[i] > max_vals[c])
+                    max_vals[c] = blocks->max_value[i];
+            }
+        }
+        segment_blocks_release(index, blocks);
+    }
+    
+    if (served) {
+        for (j = 0; j < n_cols; ++j)
+            envelope_store(out, out_stride, j, min_vals[j], max_vals[j], index->units_conversion_factor);
+    }
+    free(min_vals);
+    free(edges);
+    
+    return(served);
 }